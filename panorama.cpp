@@ -12,10 +12,42 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <algorithm>
+#include <queue>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cctype>
+#include <cfloat>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <functional>
+#include <array>
+#include <tuple>
 
 // OpenCV
+#include "opencv2/opencv_modules.hpp"
 #include "opencv2/stitching.hpp"
 #include "opencv2/highgui.hpp"
+#include "opencv2/core/hal/hal.hpp"
+#include "opencv2/core/hal/intrin.hpp"
+
+// SIFT moved from xfeatures2d into features2d with OpenCV 4.4
+#if CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR < 4 && defined(HAVE_OPENCV_XFEATURES2D)
+#include "opencv2/xfeatures2d.hpp"
+#endif
+
+// Runtime dispatch of the AVX2 and AVX-512 kernels on x86
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PANORAMA_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define PANORAMA_X86_DISPATCH 0
+#endif
 
 // CLI Args and GUI
 #include "includes/cxxopts.hpp"
@@ -28,11 +60,510 @@ enum class Status {
     ERROR
 };
 
+// Projection of the panorama surface
+enum class Projection {
+    SPHERICAL,
+    CYLINDRICAL,
+    AFFINE          // Plane of an affine registration, see cv::detail::AffineWarper
+};
+
+// Seam finders, from the fastest to the most accurate
+enum class SeamType {
+    VORONOI,            // Distance transform of the overlaps, ignores the image content
+    GRAPH_CUT_LOW_RES,  // Graph cut on a further downscaled copy, upsampled afterwards
+    GRAPH_CUT           // Graph cut of every overlapping pair, pairs run in parallel
+};
+
+// Blenders of the in-memory compositor
+enum class BlendType {
+    MULTI_BAND,     // Laplacian pyramids, see cv::detail::MultiBandBlender
+    FEATHER         // Distance weighted average, fused with warping and gains
+};
+
+// Affine pipeline of cv::Stitcher::SCANS, picked from the pairwise matches when AUTO
+enum class ScansMode {
+    AUTO,
+    ON,
+    OFF
+};
+
 // QOL
 typedef std::string Filename;
 typedef std::string Color;
 typedef cv::Mat Image;
 
+// Feature detectors available for registration
+enum class FeatureType {
+    ORB,
+    AKAZE,
+    SIFT,
+    BRISK
+};
+
+// Pairwise matchers available for registration
+enum class MatcherType {
+    BEST_OF_2_NEAREST,
+    HAMMING,
+    ANN
+};
+
+// RANSAC verification of an image pair
+struct RansacParams {
+    int max_iters       = 2000;
+    double max_ms       = 0;        // No time limit when 0
+    bool rotation_only  = false;    // Rotation about the optical centre with a shared focal
+};
+
+// Stitching pipeline settings. Defaults mirror cv::Stitcher::PANORAMA
+struct Settings {
+    double registration_resol    = 0.6;
+    double seam_estimation_resol = 0.1;
+    SeamType seam_finder         = SeamType::GRAPH_CUT;
+    double compositing_resol     = cv::Stitcher::ORIG_RESOL;
+    double confidence_thresh     = 1.0;
+    bool wave_correction         = true;
+    FeatureType features         = FeatureType::ORB;
+    int keypoint_budget          = 0;
+    int keypoint_grid            = 0;
+    MatcherType matcher          = MatcherType::BEST_OF_2_NEAREST;
+    float ann_recall             = 0.9f;
+    RansacParams ransac;
+    Projection projection        = Projection::SPHERICAL;
+    ScansMode scans              = ScansMode::OFF;
+
+    // Focal length priors of the input images in full resolution pixels, 0 where
+    // unknown. Locked intrinsics are kept fixed by bundle adjustment
+    std::vector<double> focal_priors;
+    bool lock_intrinsics         = false;
+
+    // Yaw, pitch and roll of the input images in degrees from a pan head or IMU,
+    // disabled when empty. Guided matching searches within the pose tolerance
+    std::vector<cv::Vec3d> pose_priors;
+    double pose_tolerance        = 3.0;
+
+    // Hierarchical stitching, disabled when cluster_size is 0
+    std::size_t cluster_size     = 0;
+    std::size_t cluster_overlap  = 2;
+    int match_range              = 6;
+
+    // Coarse-to-fine registration, thumbnails predict where to look for features
+    bool coarse_to_fine          = false;
+    double coarse_resol          = 0.05;
+
+    // Phase correlation of translational inputs, features only where it fails
+    bool phase_correlation       = false;
+    double phase_response_thresh = 0.05;
+
+    // Tiled compositing straight to disk, disabled when no file is given
+    Filename tiled_output;
+    int tile_size                = 1024;
+
+    // Blender of the in-memory compositor
+    BlendType blend              = BlendType::MULTI_BAND;
+
+    // Crop to the largest rectangle inside the warped images before compositing
+    bool auto_crop               = false;
+
+    // Memory ceiling of tile-local multi-band blending, disabled when 0
+    std::size_t blend_memory_mb  = 0;
+
+    // Warp lookup tables of a fixed camera rig, disabled when no file is given
+    Filename rig_cache;
+};
+
+// Camera parameters of the images making up the panorama. Cameras are
+// stored in full resolution pixel units, indices refer to the input images.
+// Affine registrations hold the affine transform of each image in R
+struct Registration {
+    std::vector<cv::detail::CameraParams> cameras;
+    std::vector<int> indices;
+    bool affine = false;
+};
+
+// Mask stored as runs of equal non zero values per row, within its bounds on the
+// panorama surface. Warped footprints take one or two runs per row, so a mask costs a
+// few bytes per row instead of one byte per pixel
+class RunMask {
+public:
+    RunMask() = default;
+    explicit RunMask(const cv::Mat& mask, cv::Point tl = cv::Point());
+
+    cv::Rect roi() const { return bounds; }
+    cv::Size size() const { return bounds.size(); }
+    bool any(cv::Rect area) const;
+    void decode(cv::Rect area, cv::Mat& mask) const;
+    RunMask bitwiseAnd(const RunMask& other) const;
+    RunMask dilate() const;
+
+    void write(cv::FileStorage& fs) const;
+    void read(const cv::FileNode& node);
+
+private:
+    void assign(const std::vector<std::vector<int>>& row_runs);
+
+    cv::Rect bounds;
+    std::vector<int> rows;      // First run of every row, followed by the run count
+    std::vector<int> runs;      // Begin and end column relative to the bounds, and value of every run
+};
+
+// Seam masks and exposure gains estimated at seam resolution
+struct Seams {
+    double warped_scale;
+    double seam_scale;
+    std::vector<cv::Point> corners;
+    std::vector<cv::UMat> masks;
+    cv::Ptr<cv::detail::ExposureCompensator> compensator;
+};
+
+// Fixed point warp lookup tables of a calibrated camera rig at compositing
+// resolution, together with its seams and exposure gains. Valid for as long as
+// the cameras, image sizes and seam settings don't change
+struct WarpTables {
+    Registration registration;
+    std::vector<cv::Size> image_sizes;
+    Projection projection;
+    double compose_scale;
+    std::vector<cv::Point> corners;
+    std::vector<Image> maps;
+    std::vector<Image> weights;
+    std::vector<RunMask> masks;
+    SeamType seam_finder;
+    Seams seams;
+};
+
+// Everything a calibrated rig needs to stitch a frame set: cached warps plus
+// feather weights of the fixed seams with the exposure gains folded in
+struct RigCompositor {
+    WarpTables tables;
+    cv::Rect canvas;
+    std::vector<Image> weights;
+};
+
+// Per row coefficients of the backward projection. For a column with angle
+// sin_u / cos_u, each camera coordinate is a * sin_u + c * cos_u + b
+struct RowCoefficients {
+    float a[3];
+    float c[3];
+    float b[3];
+};
+
+typedef void (*ProjectRowKernel)(const RowCoefficients& row, const float* sin_u, const float* cos_u,
+                                 int width, float* x, float* y);
+
+// Row kernel picked for the CPU at runtime
+struct RowKernel {
+    ProjectRowKernel function;
+    const char* name;
+};
+
+// Minimal solver of a RANSAC model, any number of image centred homographies per sample
+typedef std::function<void(const cv::Point2f* src, const cv::Point2f* dst, std::vector<cv::Matx33d>& models)> MinimalSolver;
+
+typedef void (*HammingRowKernel)(const std::uint64_t* query, const std::uint64_t* train,
+                                 int words, int count, int* distances);
+
+// Hamming kernel picked for the CPU at runtime
+struct HammingKernel {
+    HammingRowKernel function;
+    const char* name;
+};
+
+// Brute force matcher for binary descriptors. Both ratio tests and the cross check
+// come out of one blocked pass over the Hamming distances, which use the widest
+// popcount the CPU supports. Pairs are verified the same way as BestOf2Nearest
+class HammingMatcher : public cv::detail::FeaturesMatcher {
+public:
+    explicit HammingMatcher(const RansacParams& params = RansacParams());
+
+protected:
+    void match(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+               cv::detail::MatchesInfo& matches_info) CV_OVERRIDE;
+
+private:
+    // Float descriptors such as SIFT are matched as usual
+    cv::detail::BestOf2NearestMatcher float_matcher;
+    RansacParams params;
+};
+
+// Best of two nearest matching as in cv::Stitcher, with every pair verified by the
+// rotation only model instead of a general homography
+class RotationMatcher : public cv::detail::FeaturesMatcher {
+public:
+    explicit RotationMatcher(const RansacParams& params);
+
+protected:
+    void match(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+               cv::detail::MatchesInfo& matches_info) CV_OVERRIDE;
+
+private:
+    cv::detail::BestOf2NearestMatcher matcher;
+    RansacParams params;
+};
+
+// Matches all images at once through one approximate nearest neighbour index over
+// every descriptor of the set, a k-means tree for float descriptors and multi-probe
+// LSH for binary ones. The search is widened until a sample of queries finds its
+// exact nearest neighbour at the requested recall
+class AnnMatcher : public cv::detail::FeaturesMatcher {
+public:
+    AnnMatcher(float recall, const RansacParams& params);
+
+protected:
+    void match(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+               cv::detail::MatchesInfo& matches_info) CV_OVERRIDE;
+    void match(const std::vector<cv::detail::ImageFeatures>& features, std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+               const cv::UMat& mask = cv::UMat()) CV_OVERRIDE;
+
+private:
+    float recall;
+    RansacParams params;
+};
+
+// Ray bundle adjustment of cv::detail::BundleAdjusterRay, with the focal lengths of
+// chosen cameras held fixed while every other parameter is refined
+class LockedRayAdjuster : public cv::detail::BundleAdjusterBase {
+public:
+    explicit LockedRayAdjuster(const std::vector<bool>& locked);
+
+private:
+    void setUpInitialCameraParams(const std::vector<cv::detail::CameraParams>& cameras) CV_OVERRIDE;
+    void obtainRefinedCameraParams(std::vector<cv::detail::CameraParams>& cameras) const CV_OVERRIDE;
+    void calcError(cv::Mat& err) CV_OVERRIDE;
+    void calcJacobian(cv::Mat& jac) CV_OVERRIDE;
+
+    std::vector<bool> locked;
+    cv::Mat err1, err2;
+};
+
+// Backward projection from any area of the panorama surface onto a camera
+class SurfaceProjector {
+public:
+    SurfaceProjector(Projection projection, float scale, const cv::detail::CameraParams& camera);
+    SurfaceProjector(Projection projection, float scale, const float k_rinv[9]);
+
+    void buildMaps(cv::Rect area, cv::Mat& xmap, cv::Mat& ymap) const;
+    void columnTables(int u0, int width, float* sin_u, float* cos_u) const;
+    RowCoefficients rowCoefficients(int v) const;
+
+private:
+    Projection projection;
+    float scale;
+    float k_rinv[9];
+    float t[3] = {0.f, 0.f, 0.f};
+};
+
+// OpenCV rotation warper whose maps and warps go through the vectorised row
+// kernels and the fused sampler instead of full float maps and cv::remap()
+template <class Base, Projection P>
+class FastRotationWarper : public Base {
+public:
+    explicit FastRotationWarper(float scale) : Base(scale) {}
+
+    cv::Rect buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                       cv::OutputArray xmap, cv::OutputArray ymap) CV_OVERRIDE;
+    cv::Point warp(cv::InputArray src, cv::InputArray K, cv::InputArray R,
+                   int interp_mode, int border_mode, cv::OutputArray dst) CV_OVERRIDE;
+};
+
+typedef FastRotationWarper<cv::detail::SphericalWarper, Projection::SPHERICAL> FastSphericalWarper;
+typedef FastRotationWarper<cv::detail::CylindricalWarper, Projection::CYLINDRICAL> FastCylindricalWarper;
+
+// Warper creator for the fast warpers, for use wherever OpenCV takes a cv::WarperCreator
+template <class Warper>
+class FastWarperCreator : public cv::WarperCreator {
+public:
+    cv::Ptr<cv::detail::RotationWarper> create(float scale) const CV_OVERRIDE;
+};
+
+// Sparse store of a composited panorama in square tiles. Tiles nothing was written to
+// are never allocated and read as black, so the empty corners of a panorama take no
+// memory. Only the preview and output formats other than tiled BigTIFF make it dense
+class TileCanvas {
+public:
+    TileCanvas() = default;
+    TileCanvas(cv::Rect canvas, int tile_size, int type);
+
+    cv::Rect roi() const { return canvas; }
+    int tiles() const { return tiles_x * tiles_y; }
+    int index(int x, int y) const;
+    cv::Rect tile(int index) const;
+    bool occupied(int index) const { return ! data[index].empty(); }
+    cv::Mat& at(int index) { return data[index]; }
+    const cv::Mat& at(int index) const { return data[index]; }
+    cv::Mat& allocate(int index);
+    void release(int index) { data[index].release(); }
+    void paste(const cv::Mat& image);
+    void copyTo(cv::Mat& dst) const;
+    bool writeTiff(const Filename& filename) const;
+
+private:
+    cv::Rect canvas;
+    int tile_size = 0;
+    int type      = CV_8UC3;
+    int tiles_x   = 0;
+    int tiles_y   = 0;
+    std::vector<cv::Mat> data;
+};
+
+// Multi-band blender which keeps pyramids for one tile of the canvas at a time.
+// Fed images are spilled to a temporary file and read back tile by tile when
+// blend() is called, so only their masks stay in memory
+class TiledMultiBandBlender : public cv::detail::Blender {
+public:
+    TiledMultiBandBlender(int num_bands, std::size_t memory_limit);
+    ~TiledMultiBandBlender() CV_OVERRIDE;
+
+    void prepare(cv::Rect dst_roi) CV_OVERRIDE;
+    void feed(cv::InputArray img, cv::InputArray mask, cv::Point tl) CV_OVERRIDE;
+    void blend(cv::InputOutputArray dst, cv::InputOutputArray dst_mask) CV_OVERRIDE;
+    void blend(TileCanvas& dst, TileCanvas& dst_mask);
+
+private:
+    struct Input {
+        cv::Rect roi;
+        std::uint64_t offset;   // Offset of the first row in the spill file
+        RunMask mask;
+    };
+
+    void readArea(const Input& input, cv::Rect area, Image& image);
+    void closeSpill();
+
+    int num_bands;
+    std::size_t memory_limit;
+    std::vector<Input> inputs;
+    Filename spill_name;
+    std::fstream spill;
+};
+
+// Block gain compensation of cv::detail::BlocksGainCompensator, with the overlap
+// statistics of the block pairs gathered in parallel
+class BlockGainCompensator : public cv::detail::ExposureCompensator {
+public:
+    explicit BlockGainCompensator(int block_size = 32) : block_size(block_size) {}
+
+    using cv::detail::ExposureCompensator::feed;
+    void feed(const std::vector<cv::Point>& corners, const std::vector<cv::UMat>& images,
+              const std::vector<std::pair<cv::UMat, uchar>>& masks) CV_OVERRIDE;
+    void apply(int index, cv::Point corner, cv::InputOutputArray image, cv::InputArray mask) CV_OVERRIDE;
+    void getMatGains(std::vector<cv::Mat>& gains) CV_OVERRIDE;
+    void setMatGains(std::vector<cv::Mat>& gains) CV_OVERRIDE;
+
+private:
+    int block_size;
+    std::vector<cv::Mat> gain_maps;
+};
+
+// Low resolution gain map over the warped footprint of an image, applied while warping
+struct GainField {
+    cv::Mat map;            // CV_32F gains with one or three channels
+    cv::Rect footprint;     // Warped footprint the map is stretched over
+};
+
+// Gains of a gain field interpolated along the rows of an area of the panorama
+// surface, with pixel centres as in cv::resize() of the map to the footprint
+class GainRows {
+public:
+    GainRows(const GainField& field, cv::Rect area);
+
+    void row(int v, float* gain) const;
+    int channels() const { return field.map.channels(); }
+
+private:
+    const GainField& field;
+    cv::Rect area;
+    std::vector<int> x0, x1;
+    std::vector<float> wx;
+};
+
+// Source coordinates of one row of a warped footprint, rows relative to the footprint
+typedef std::function<void(int v, float* x, float* y)> RowCoordinates;
+
+// Max-flow graph of one seam cut, the same Boykov-Kolmogorov search as
+// cv::detail::GCGraph<float>. Resetting keeps the storage of the vertices and
+// edges, so one graph serves every cut of a worker without reallocating
+class SeamGraph {
+public:
+    void reset(int vertex_count, int edge_count);
+    int addVertex();
+    void addEdges(int i, int j, float weight, float reverse_weight);
+    void addTermWeights(int i, float source_weight, float sink_weight);
+    float maxFlow();
+    bool inSourceSegment(int i) const;
+
+private:
+    struct Vertex {
+        Vertex* next;   // Active list, only used by maxFlow()
+        int parent;
+        int first;
+        int ts;
+        int dist;
+        float weight;
+        uchar t;
+    };
+
+    struct Edge {
+        int dst;
+        int next;
+        float weight;
+    };
+
+    std::vector<Vertex> vertices;
+    std::vector<Edge> edges;
+    std::vector<Vertex*> orphans;
+    float flow = 0;
+};
+
+// Scratch memory of one seam worker, reused by every pair it cuts
+struct SeamArena {
+    SeamGraph graph;
+    std::vector<cv::Point3f> pixels[2];
+    std::vector<uchar> masks[2];
+};
+
+// Streams an uncompressed, tiled 8-bit RGB BigTIFF to disk one tile at a time
+class TiledTiffWriter {
+public:
+    bool open(const Filename& filename, cv::Size size, int tile_size);
+    bool write(int index, const Image& tile);
+    bool writeEmpty(int index);
+    bool close();
+
+private:
+    void writeEntry(std::uint16_t tag, std::uint16_t type, std::uint64_t count, std::uint64_t value);
+    void writeBytes(std::uint64_t value, int bytes);
+
+    std::ofstream file;
+    cv::Size size;
+    int tile_size;
+    std::vector<std::uint64_t> offsets;
+    std::vector<std::uint64_t> byte_counts;
+    int empty_tile = -1;
+};
+
+// Sparse tile map of the panorama canvas. Each tile lists the images whose seam masks
+// reach it, guard band included; tiles no image reaches are empty and never blended
+class TileMap {
+public:
+    TileMap(cv::Rect canvas, int tile_size, int guard);
+
+    void cover(int image, const cv::Mat& seam_mask, cv::Rect footprint);
+    void cover(int image, const RunMask& mask);
+    const std::vector<int>& images(int index) const { return tile_images[index]; }
+    bool occupied(int index) const { return ! tile_images[index].empty(); }
+    cv::Rect tile(int index) const;
+    cv::Rect guarded(int index) const;
+    int columns() const { return tiles_x; }
+    int rows() const { return tiles_y; }
+
+private:
+    cv::Rect canvas;
+    int tile_size;
+    int guard;
+    int tiles_x;
+    int tiles_y;
+    std::vector<std::vector<int>> tile_images;
+};
+
 // Terminal text colors
 const Color YELLOW = "\e[93m";
 const Color GREEN  = "\e[32m";
@@ -43,14 +574,124 @@ const Color RED    = "\e[31m";
 const int RETURN = 13;
 const int ESCAPE = 27;
 
-Status parseArgs(int argc, char* argv[], std::vector<Image>& images);
+Status parseArgs(int argc, char* argv[], std::vector<Image>& images, Settings& settings);
 void runDemo(std::vector<Image>& images, std::size_t demo);
 void cameraCapture(std::vector<Image>& images);
-void fileSelectGUI(std::vector<Image>& images);
-void uploadImages(std::vector<Image>& images, const std::vector<Filename>& files);
+void fileSelectGUI(std::vector<Image>& images, std::vector<double>* focal_priors = nullptr);
+void uploadImages(std::vector<Image>& images, const std::vector<Filename>& files, std::vector<double>* focal_priors = nullptr);
+double readExifFocal(const std::vector<uchar>& data, cv::Size size);
+bool readCalibration(const Filename& filename, const std::vector<Image>& images, std::vector<double>& focal_priors);
+bool readPosePriors(const Filename& filename, const std::vector<Filename>& files, std::size_t num_images, std::vector<cv::Vec3d>& pose_priors);
 void videoCapture(std::vector<Image>& images, const Filename& video, double frequency = 0.1);
-void createPanorama(const std::vector<Image>& images);
-void promptSaveImage(const Image& image);
+void runBenchmark(const std::string& benchmark, const Settings& settings);
+void benchmarkWarp();
+void benchmarkFeatures(const Settings& settings);
+void benchmarkMatcher(const Settings& settings);
+void benchmarkRotation();
+void runRig(const std::vector<std::string>& sources, const Settings& settings, const Filename& output);
+bool readFrameSet(std::vector<cv::VideoCapture>& feeds, std::vector<Image>& frames);
+bool calibrateRig(const std::vector<Image>& frames, const Settings& settings, RigCompositor& rig);
+void stitchFrameSet(const std::vector<Image>& frames, const RigCompositor& rig, Image& panorama);
+void runPanningVideo(const Filename& video, const Settings& settings, const Filename& output);
+bool trackCamera(const cv::detail::ImageFeatures& previous, const cv::detail::ImageFeatures& current,
+                 double work_scale, const Settings& settings, cv::detail::FeaturesMatcher& matcher,
+                 cv::detail::CameraParams& camera);
+void createPanorama(const std::vector<Image>& images, const Settings& settings);
+bool registerPanorama(const std::vector<Image>& images, const Settings& settings, Registration& registration);
+bool registerImages(const std::vector<Image>& images, const Settings& settings, Registration& registration);
+bool registerHierarchical(const std::vector<Image>& images, const Settings& settings, Registration& registration);
+bool registerCoarseToFine(const std::vector<Image>& images, const Settings& settings, Registration& registration);
+bool registerPosePrior(const std::vector<Image>& images, const Settings& settings, Registration& registration);
+cv::Matx33d poseRotation(const cv::Vec3d& pose);
+bool registerPhaseCorrelation(const std::vector<Image>& images, const Settings& settings, Registration& registration);
+double correlatePair(const Image& image1, const Image& image2, cv::Point2d& shift);
+double overlapCorrelation(const Image& image1, const Image& image2, cv::Point d);
+bool translationMatches(cv::detail::ImageFeatures& features1, cv::detail::ImageFeatures& features2,
+                        cv::Point2d shift, cv::detail::MatchesInfo& matches_info);
+void findFeatures(const std::vector<Image>& images, double work_scale, const Settings& settings,
+                  std::vector<cv::detail::ImageFeatures>& features, const std::vector<Image>& masks = std::vector<Image>());
+cv::Ptr<cv::Feature2D> createFeatureFinder(const Settings& settings, int budget);
+int keypointBudget(const Settings& settings, cv::Size size);
+void bucketKeypoints(std::vector<cv::KeyPoint>& keypoints, cv::Size size, int grid, int budget);
+void predictOverlaps(const std::vector<cv::detail::MatchesInfo>& coarse_matches, const std::vector<Image>& images,
+                     double coarse_scale, double work_scale, float conf_thresh, std::vector<Image>& masks);
+void guidedMatch(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                 const cv::Mat& H, float radius, std::vector<cv::DMatch>& matches);
+bool verifyMatches(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                   const std::vector<cv::DMatch>& matches, cv::detail::MatchesInfo& matches_info,
+                   const RansacParams& params = RansacParams());
+cv::Mat findHomographyProsac(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points,
+                             const RansacParams& params, std::vector<uchar>& inliers_mask);
+cv::Mat findRotationProsac(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points,
+                           const RansacParams& params, std::vector<uchar>& inliers_mask);
+bool prosac(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points, const RansacParams& params,
+            int sample_size, const MinimalSolver& solve, cv::Matx33f& best_model, std::vector<uchar>& inliers_mask);
+void solveRotationFocal(const cv::Point2f* src, const cv::Point2f* dst, std::vector<cv::Matx33d>& models);
+double rotationFocal(const cv::Matx33d& H);
+cv::Matx33d fitRotation(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points, double focal);
+bool estimateRotations(const std::vector<cv::detail::ImageFeatures>& features, const std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                       double conf_thresh, double focal_prior, std::vector<cv::detail::CameraParams>& cameras);
+void fillDualMatches(std::vector<cv::detail::MatchesInfo>& pairwise_matches, int i, int j, int num_images);
+cv::Ptr<cv::detail::FeaturesMatcher> createMatcher(const Settings& settings);
+void hammingMatch(const cv::Mat& descriptors1, const cv::Mat& descriptors2, std::vector<cv::DMatch>& matches);
+const HammingKernel& hammingKernel();
+bool estimateCameras(std::vector<cv::detail::ImageFeatures>& features, std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                     double work_scale, const Settings& settings, Registration& registration,
+                     const std::vector<int>& image_indices = std::vector<int>());
+bool affineExplains(const std::vector<cv::detail::ImageFeatures>& features,
+                    const std::vector<cv::detail::MatchesInfo>& pairwise_matches, float conf_thresh);
+void fitAffineMatches(const std::vector<cv::detail::ImageFeatures>& features,
+                      std::vector<cv::detail::MatchesInfo>& pairwise_matches);
+bool estimateAffineCameras(std::vector<cv::detail::ImageFeatures>& features, std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                           double work_scale, const Settings& settings, Registration& registration);
+std::vector<std::vector<int>> partitionMatchGraph(const std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                                                  int num_images, const Settings& settings);
+bool alignClusters(const std::vector<Registration>& clusters, const std::vector<std::vector<int>>& members,
+                   Registration& registration);
+void waveCorrect(Registration& registration);
+void estimateSeams(const std::vector<Image>& images, const Registration& registration,
+                   const Settings& settings, Seams& seams);
+void findPairwiseSeams(const std::vector<cv::UMat>& images, const std::vector<cv::Point>& corners,
+                       std::vector<cv::UMat>& masks);
+void findLowResSeams(const std::vector<cv::UMat>& images, const std::vector<cv::Point>& corners,
+                     std::vector<cv::UMat>& masks);
+void cutSeam(const cv::Mat& image1, const cv::Mat& image2, cv::Point tl1, cv::Point tl2, cv::Rect roi,
+             cv::Mat& mask1, cv::Mat& mask2, SeamArena& arena);
+bool compositePanorama(const std::vector<Image>& images, const Registration& registration,
+                       const Settings& settings, TileCanvas& panorama, const WarpTables* tables = nullptr);
+bool compositeTiled(const std::vector<Image>& images, const Registration& registration,
+                    const Settings& settings, const Filename& filename);
+void buildWarpTables(const std::vector<Image>& images, const Registration& registration,
+                     const Settings& settings, WarpTables& tables);
+bool saveWarpTables(const Filename& filename, const WarpTables& tables);
+bool loadWarpTables(const Filename& filename, const std::vector<Image>& images,
+                    const Settings& settings, WarpTables& tables);
+void resampleArea(const cv::Mat& map, cv::Rect footprint, cv::Rect area, int interpolation, cv::Mat& result);
+void seamArea(const cv::UMat& seam_mask, cv::Rect footprint, cv::Rect area, cv::Mat& result);
+cv::Rect autoCrop(const Seams& seams, double compose_scale);
+cv::Rect largestInscribedRect(const cv::Mat& mask);
+cv::Ptr<cv::detail::Blender> createBlender(const Settings& settings);
+cv::Ptr<cv::WarperCreator> createWarper(const Settings& settings);
+const RowKernel& rowKernel();
+void projectRow(const RowCoefficients& row, const float* sin_u, const float* cos_u, int width, float* x, float* y);
+void warpArea(const cv::Mat& src, const SurfaceProjector& projector, cv::Rect area,
+              int interp_mode, int border_mode, cv::Mat& dst, cv::Mat* mask = nullptr,
+              const GainField* gains = nullptr);
+void applyGains(const cv::Mat& gains, cv::Mat& image);
+RowCoordinates projectorCoordinates(const SurfaceProjector& projector, cv::Rect area);
+RowCoordinates tableCoordinates(const cv::Mat& map, const cv::Mat& weights);
+void warpMask(cv::Size src_size, const RowCoordinates& coordinates, cv::Size size, cv::Mat& mask);
+void featherArea(const cv::Mat& src, const RowCoordinates& coordinates, cv::Rect area,
+                 const GainField& gains, const cv::Mat& weight, TileCanvas& canvas, TileCanvas& weight_sum);
+void scaleCameras(const Registration& registration, double scale, std::vector<cv::detail::CameraParams>& cameras);
+double compositingScale(const std::vector<Image>& images, const Registration& registration, const Settings& settings);
+double surfaceScale(const Registration& registration);
+void composeImage(const Image& image, double compose_scale, Image& result);
+cv::Size composedSize(const Image& image, double compose_scale);
+cv::Rect warpedRoi(const Image& image, const cv::detail::CameraParams& camera, double compose_scale,
+                   const cv::Ptr<cv::detail::RotationWarper>& warper);
+double scaleForResolution(const Image& image, double megapixels);
+void promptSaveImage(const TileCanvas& panorama);
 void showNotification(const std::string& message);
 void showError(const std::string& message);
 
@@ -62,12 +703,13 @@ void showError(const std::string& message);
  */
 int main(int argc, char* argv[]) {
     std::vector<Image> images;
+    Settings settings;
 
-    Status status = parseArgs(argc, argv, images);
+    Status status = parseArgs(argc, argv, images, settings);
 
     if ( status == Status::OK ) {
         if ( images.size() > 1 ) {
-            createPanorama(images);
+            createPanorama(images, settings);
         }
         else {
             showError("Not enough images provided");
@@ -84,10 +726,11 @@ int main(int argc, char* argv[]) {
  * @param argc main() CLI args
  * @param argv main() CLI args
  * @param images vector of images in which to read in images from desired source
+ * @param settings stitching pipeline settings adjusted by the optional arguments
  * 
  * @return Status code of argument parser, returns OK if arguments were accepted
  */
-Status parseArgs(int argc, char* argv[], std::vector<Image>& images) {
+Status parseArgs(int argc, char* argv[], std::vector<Image>& images, Settings& settings) {
     try {
         cxxopts::Options options(argv[0], "Panorama Stitcher");
 
@@ -102,6 +745,59 @@ Status parseArgs(int argc, char* argv[], std::vector<Image>& images) {
                 cxxopts::value<Filename>())
             ("d,demo",  "Try demo image sets [0..10]",
                 cxxopts::value<std::size_t>())
+            ("rig", "Stitch synchronised camera indices or video files in real time",
+                cxxopts::value<std::vector<std::string>>())
+            ("video-output", "Output video file of the streaming modes",
+                cxxopts::value<Filename>())
+            ("features", "Feature detector [orb, akaze, sift, brisk]",
+                cxxopts::value<std::string>())
+            ("keypoints", "Keypoint budget per image",
+                cxxopts::value<int>())
+            ("matcher", "Pairwise matcher [bestof2, hamming, ann]",
+                cxxopts::value<std::string>())
+            ("ann-recall", "Recall target of the ann matcher (0.9 by default)",
+                cxxopts::value<float>())
+            ("ransac-iters", "Iteration cap of pair verification (2000 by default)",
+                cxxopts::value<int>())
+            ("ransac-time", "Time cap of pair verification in milliseconds",
+                cxxopts::value<double>())
+            ("rotation-only", "Model images as rotations about the optical centre with a shared focal")
+            ("intrinsics", "Camera calibration file with the camera matrix, overrides EXIF focal lengths",
+                cxxopts::value<Filename>())
+            ("lock-intrinsics", "Keep the known focal lengths fixed in bundle adjustment")
+            ("pose-prior", "CSV of yaw, pitch and optional roll in degrees per image, optionally after its filename",
+                cxxopts::value<Filename>())
+            ("pose-tolerance", "Angular error of the pose priors in degrees (3 by default)",
+                cxxopts::value<double>())
+            ("keypoint-grid", "Spread keypoints over a grid of this many cells along the long side",
+                cxxopts::value<int>()->implicit_value("8"))
+            ("coarse-to-fine", "Predict overlaps on thumbnails before registering")
+            ("phase-correlation", "Register translational video and scans by phase correlation")
+            ("cluster-size", "Stitch hierarchically in clusters of this many images",
+                cxxopts::value<std::size_t>())
+            ("cluster-overlap", "Anchor images shared between clusters",
+                cxxopts::value<std::size_t>())
+            ("tiff", "Composite tile by tile into a BigTIFF file",
+                cxxopts::value<Filename>())
+            ("tile-size", "Tile size of the BigTIFF output",
+                cxxopts::value<int>())
+            ("blend", "Blender of the in-memory compositor [multiband, feather]",
+                cxxopts::value<std::string>())
+            ("crop", "Crop to the largest rectangle inside the images before compositing")
+            ("blend-memory", "Memory ceiling of multi-band blending in MB",
+                cxxopts::value<std::size_t>())
+            ("warp", "Panorama surface [spherical, cylindrical]",
+                cxxopts::value<std::string>())
+            ("scans", "Affine pipeline for flat scenes such as scans [auto, on, off] (off by default)",
+                cxxopts::value<std::string>())
+            ("seams", "Seam finder [voronoi, lowres, graphcut]",
+                cxxopts::value<std::string>())
+            ("preset", "Speed and quality trade-off of every stage [fast, balanced, quality]",
+                cxxopts::value<std::string>())
+            ("rig-cache", "Reuse cached warp tables of a fixed camera rig",
+                cxxopts::value<Filename>())
+            ("benchmark", "Run a benchmark on the demo image sets [warp, features, matcher, rotation]",
+                cxxopts::value<std::string>())
             ("h,help", "Print help");
 
         // Parse args and check results
@@ -112,17 +808,228 @@ Status parseArgs(int argc, char* argv[], std::vector<Image>& images) {
             std::cout << options.help() << std::endl;
             return Status::EXIT;
         }
-        else if ( result.count("demo")   ) {
+
+        // Pipeline settings, these may accompany any of the image sources below.
+        // Presets go first, so that the other options override them
+        if ( result.count("preset") ) {
+            std::string preset = result["preset"].as<std::string>();
+
+            if ( preset == "fast" ) {
+                settings.registration_resol    = 0.3;
+                settings.seam_estimation_resol = 0.05;
+                settings.matcher               = MatcherType::HAMMING;
+                settings.ransac.max_iters      = 500;
+                settings.seam_finder           = SeamType::VORONOI;
+                settings.blend                 = BlendType::FEATHER;
+            }
+            else if ( preset == "balanced" ) {
+                settings.matcher               = MatcherType::HAMMING;
+                settings.seam_finder           = SeamType::GRAPH_CUT_LOW_RES;
+            }
+            else if ( preset == "quality" ) {
+                settings.registration_resol    = 1.0;
+                settings.seam_estimation_resol = 0.2;
+                settings.seam_finder           = SeamType::GRAPH_CUT;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown preset: " << preset << std::endl;
+                return Status::ERROR;
+            }
+        }
+        if ( result.count("features") ) {
+            std::string features = result["features"].as<std::string>();
+
+            if ( features == "orb" ) {
+                settings.features = FeatureType::ORB;
+            }
+            else if ( features == "akaze" ) {
+                settings.features = FeatureType::AKAZE;
+            }
+            else if ( features == "sift" ) {
+                settings.features = FeatureType::SIFT;
+            }
+            else if ( features == "brisk" ) {
+                settings.features = FeatureType::BRISK;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown features: " << features << std::endl;
+                return Status::ERROR;
+            }
+        }
+        if ( result.count("keypoints") ) {
+            settings.keypoint_budget = std::max(0, result["keypoints"].as<int>());
+        }
+        if ( result.count("matcher") ) {
+            std::string matcher = result["matcher"].as<std::string>();
+
+            if ( matcher == "bestof2" ) {
+                settings.matcher = MatcherType::BEST_OF_2_NEAREST;
+            }
+            else if ( matcher == "hamming" ) {
+                settings.matcher = MatcherType::HAMMING;
+            }
+            else if ( matcher == "ann" ) {
+                settings.matcher = MatcherType::ANN;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown matcher: " << matcher << std::endl;
+                return Status::ERROR;
+            }
+        }
+        if ( result.count("ann-recall") ) {
+            settings.ann_recall = std::min(1.f, std::max(0.f, result["ann-recall"].as<float>()));
+        }
+        if ( result.count("ransac-iters") ) {
+            settings.ransac.max_iters = std::max(1, result["ransac-iters"].as<int>());
+        }
+        if ( result.count("ransac-time") ) {
+            settings.ransac.max_ms = std::max(0., result["ransac-time"].as<double>());
+        }
+        if ( result.count("rotation-only") ) {
+            settings.ransac.rotation_only = true;
+        }
+        if ( result.count("lock-intrinsics") ) {
+            settings.lock_intrinsics = true;
+        }
+        if ( result.count("pose-tolerance") ) {
+            settings.pose_tolerance = std::max(0.1, result["pose-tolerance"].as<double>());
+        }
+        if ( result.count("keypoint-grid") ) {
+            settings.keypoint_grid = std::max(1, result["keypoint-grid"].as<int>());
+        }
+        if ( result.count("phase-correlation") ) {
+            settings.phase_correlation = true;
+        }
+        if ( result.count("crop") ) {
+            settings.auto_crop = true;
+        }
+        if ( result.count("coarse-to-fine") ) {
+            settings.coarse_to_fine = true;
+        }
+        if ( result.count("cluster-size") ) {
+            settings.cluster_size = result["cluster-size"].as<std::size_t>();
+        }
+        if ( result.count("cluster-overlap") ) {
+            settings.cluster_overlap = result["cluster-overlap"].as<std::size_t>();
+        }
+        if ( result.count("tiff") ) {
+            settings.tiled_output = result["tiff"].as<Filename>();
+        }
+        if ( result.count("tile-size") ) {
+            // TIFF tiles must be a multiple of 16 pixels, blending tiles are kept
+            // aligned to the coarsest pyramid level as well
+            settings.tile_size = std::max(32, (result["tile-size"].as<int>() + 31) / 32 * 32);
+        }
+        if ( result.count("blend-memory") ) {
+            settings.blend_memory_mb = result["blend-memory"].as<std::size_t>();
+        }
+        if ( result.count("rig-cache") ) {
+            settings.rig_cache = result["rig-cache"].as<Filename>();
+        }
+        if ( result.count("warp") ) {
+            std::string warp = result["warp"].as<std::string>();
+
+            if ( warp == "spherical" ) {
+                settings.projection = Projection::SPHERICAL;
+            }
+            else if ( warp == "cylindrical" ) {
+                settings.projection = Projection::CYLINDRICAL;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown warp: " << warp << std::endl;
+                return Status::ERROR;
+            }
+        }
+        if ( result.count("scans") ) {
+            std::string scans = result["scans"].as<std::string>();
+
+            if ( scans == "auto" ) {
+                settings.scans = ScansMode::AUTO;
+            }
+            else if ( scans == "on" ) {
+                settings.scans = ScansMode::ON;
+            }
+            else if ( scans == "off" ) {
+                settings.scans = ScansMode::OFF;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown scans mode: " << scans << std::endl;
+                return Status::ERROR;
+            }
+        }
+        if ( result.count("seams") ) {
+            std::string seams = result["seams"].as<std::string>();
+
+            if ( seams == "voronoi" ) {
+                settings.seam_finder = SeamType::VORONOI;
+            }
+            else if ( seams == "lowres" ) {
+                settings.seam_finder = SeamType::GRAPH_CUT_LOW_RES;
+            }
+            else if ( seams == "graphcut" ) {
+                settings.seam_finder = SeamType::GRAPH_CUT;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown seam finder: " << seams << std::endl;
+                return Status::ERROR;
+            }
+        }
+        if ( result.count("blend") ) {
+            std::string blend = result["blend"].as<std::string>();
+
+            if ( blend == "multiband" ) {
+                settings.blend = BlendType::MULTI_BAND;
+            }
+            else if ( blend == "feather" ) {
+                settings.blend = BlendType::FEATHER;
+            }
+            else {
+                std::cout << RED;
+                std::cout << "Unknown blender: " << blend << std::endl;
+                return Status::ERROR;
+            }
+        }
+
+        // Clusters are registered from their own match graph, never coarse to fine
+        if ( settings.coarse_to_fine && settings.cluster_size > 0 ) {
+            std::cout << RED;
+            std::cout << "Coarse-to-fine registration can't be combined with clusters" << std::endl;
+            return Status::ERROR;
+        }
+
+        if ( result.count("benchmark") ) {
+            runBenchmark(result["benchmark"].as<std::string>(), settings);
+            return Status::EXIT;
+        }
+
+        // Streaming modes stitch until their sources run out, nothing is left to do after
+        if ( result.count("rig") ) {
+            Filename output = result.count("video-output") ? result["video-output"].as<Filename>() : Filename();
+            runRig(result["rig"].as<std::vector<std::string>>(), settings, output);
+            return Status::EXIT;
+        }
+        if ( result.count("video") && result.count("video-output") ) {
+            runPanningVideo(result["video"].as<Filename>(), settings, result["video-output"].as<Filename>());
+            return Status::EXIT;
+        }
+
+        if ( result.count("demo")   ) {
             runDemo(images, result["demo"].as<std::size_t>());
         }
         else if ( result.count("camera") ) {
             cameraCapture(images);
         }
         else if ( result.count("select") ) {
-            fileSelectGUI(images);
+            fileSelectGUI(images, &settings.focal_priors);
         }
         else if ( result.count("images") ) {
-            uploadImages(images, result["images"].as<std::vector<Filename>>());
+            uploadImages(images, result["images"].as<std::vector<Filename>>(), &settings.focal_priors);
         }
         else if ( result.count("video")  ) {
             videoCapture(images, result["video"].as<Filename>());
@@ -133,6 +1040,21 @@ Status parseArgs(int argc, char* argv[], std::vector<Image>& images) {
             return Status::EXIT;
         }
 
+        if ( result.count("intrinsics") && ! readCalibration(result["intrinsics"].as<Filename>(), images, settings.focal_priors) ) {
+            std::cout << RED;
+            std::cout << "Couldn't read camera calibration: " << result["intrinsics"].as<Filename>() << std::endl;
+            return Status::ERROR;
+        }
+        if ( result.count("pose-prior") ) {
+            std::vector<Filename> files = result.count("images") ? result["images"].as<std::vector<Filename>>() : std::vector<Filename>();
+
+            if ( ! readPosePriors(result["pose-prior"].as<Filename>(), files, images.size(), settings.pose_priors) ) {
+                std::cout << RED;
+                std::cout << "Pose priors don't cover every image: " << result["pose-prior"].as<Filename>() << std::endl;
+                return Status::ERROR;
+            }
+        }
+
         return Status::OK;
     }
     catch (const cxxopts::OptionException& e) {
@@ -255,8 +1177,9 @@ void cameraCapture(std::vector<Image>& images) {
  * as uploadImages(), but a bit nicer and easier to use.
  * 
  * @param images vector in which to read in images
+ * @param focal_priors optional vector in which to read in EXIF focal lengths
  */
-void fileSelectGUI(std::vector<Image>& images) {
+void fileSelectGUI(std::vector<Image>& images, std::vector<double>* focal_priors) {
     auto files =
         pfd::open_file(
             "Select images to create panorama of",
@@ -265,115 +1188,7447 @@ void fileSelectGUI(std::vector<Image>& images) {
             pfd::opt::multiselect
         );
 
-    uploadImages(images, files.result());
+    uploadImages(images, files.result(), focal_priors);
 }
 
 /**
  * Reads in images from a vector of images filenames. This is the vector which is
- * passed to the panorama stitcher.
+ * passed to the panorama stitcher. Each file is read once, and its EXIF focal
+ * length is parsed from the same bytes the image is decoded from.
  * 
  * @param images vector in which to read in images
  * @param files images filenames used to read in images
+ * @param focal_priors optional vector in which to read in EXIF focal lengths
  */
-void uploadImages(std::vector<Image>& images, const std::vector<Filename>& files) {
+void uploadImages(std::vector<Image>& images, const std::vector<Filename>& files, std::vector<double>* focal_priors) {
     for (const Filename & file : files) {
-        Image image = cv::imread( file );
+        std::ifstream stream(file, std::ios::binary);
+        std::vector<uchar> data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+        Image image = data.empty() ? Image() : cv::imdecode(data, cv::IMREAD_COLOR);
         images.push_back(image);
+
+        if ( focal_priors ) {
+            focal_priors->resize(images.size() - 1, 0.);
+            focal_priors->push_back(image.empty() ? 0. : readExifFocal(data, image.size()));
+        }
     }
 }
 
 /**
- * Can be passed a video filename which is parsed for frames to stitch together.
- * They key to this function is the frequency variable, which determines how
- * frequently frames will be taken from the video. The basic formula is fairly
- * obvious, as it's just:
- *      TOTAL_FRAMES * frequency
- * We then skip this number of frames on each iteration and capture whatever the
- * next frame is and store it into our image vector. Note that the frequency parameter
- * MUST be between 0 and 1, otherwise it just doesn't work. Default parameter is set
- * to 0.1, so 10 frames will be captured from the video. This worked fine for the short
- * test video I used, but longer videos might not have enough correspondence between
- * frames at this rate, so adjust as necessary.
+ * Reads the focal length of a JPEG from its EXIF data, in pixels of the decoded
+ * image. The 35 mm equivalent focal length is used when present, as it doesn't
+ * depend on the sensor size. Otherwise the focal length in millimetres is converted
+ * with the focal plane resolution of the sensor.
  * 
- * @param images vector in which to read in images
- * @param video filename for video from which to capture frames
- * @param frequency frequency to capture frames. 1/frequency = number of frames to be captured
+ * @param data contents of the image file
+ * @param size size of the decoded image
+ * 
+ * @return focal length in pixels, 0 if unknown
  */
-void videoCapture(std::vector<Image>& images, const Filename& video, double frequency) {
-    assert(0 < frequency && frequency < 1);
-
-    cv::VideoCapture feed;
-    
-    feed.open( video );
+double readExifFocal(const std::vector<uchar>& data, cv::Size size) {
+    const double diagonal_35mm = 43.2666;
 
-    std::size_t frame_position  = feed.get(cv::CAP_PROP_POS_FRAMES);
-    std::size_t frame_frequency = feed.get(cv::CAP_PROP_FRAME_COUNT) * frequency;
-    
-    for (;;) {
-        Image frame;
-        feed >> frame;
+    // Find the Exif APP1 segment, markers before the image data only
+    std::size_t tiff = 0;
 
-        if ( frame.data ) {
-            // Capture frame and increase frame position in video capture feed.
-            // This is more efficient since we don't have to read in all the frames
-            // that we're ignoring.
-            images.push_back(frame);
-            feed.set(cv::CAP_PROP_POS_FRAMES, frame_position + frame_frequency);
-            frame_position = feed.get(cv::CAP_PROP_POS_FRAMES);
+    for (std::size_t pos = 2; data.size() >= 4 && data[0] == 0xFF && data[1] == 0xD8 && pos + 4 <= data.size(); ) {
+        if ( data[pos] != 0xFF || data[pos + 1] == 0xDA ) {
+            break;
         }
-        else {
+
+        std::size_t length = (data[pos + 2] << 8) | data[pos + 3];
+
+        if ( data[pos + 1] == 0xE1 && pos + 10 <= data.size() && std::memcmp(&data[pos + 4], "Exif\0\0", 6) == 0 ) {
+            tiff = pos + 10;
             break;
         }
+
+        pos += 2 + length;
     }
 
-    feed.release();
-}
+    if ( tiff == 0 || tiff + 8 > data.size() ) {
+        return 0.;
+    }
 
-/**
- * This is the function which actually creates the panorama image. Accepts the vector
- * of images as a parameter and passes into the stitcher class. Note that reaching this
- * block of code doesn't guarantee that a panorama can be created from the images, despite
- * all the condition checking in the previous functions. If the set of images does not
- * have enough matching features, a panorama will not be generated. If the panorama is
- * successfully created, then the result is displayed visually to the user. On keypress,
- * the window will be begin to close, before which a dialog asking if they wish to save
- * the image. Once the user makes a decision, the window closes and the program terminates.
- * 
- * @param images vector of images which store the images to create a panorama from
- */
-void createPanorama(const std::vector<Image>& images) {
-    std::cout << GREEN;
-    std::cout << "Creating panorama..." << std::endl;
-    
-    Image panorama;
+    bool little_endian = data[tiff] == 'I';
 
-    cv::Ptr<cv::Stitcher> stitcher = cv::Stitcher::create( cv::Stitcher::PANORAMA );
-    cv::Stitcher::Status status    = stitcher->stitch( images, panorama );
-    
-    if ( status == cv::Stitcher::OK ) {
-        showNotification("Panorama successfully created!");
-        
-        cv::imshow( "Panorama", panorama );
-        cv::waitKey(0);
+    auto read = [&](std::size_t offset, int bytes) -> std::uint32_t {
+        if ( tiff + offset + bytes > data.size() ) {
+            return 0;
+        }
 
-        promptSaveImage(panorama);
+        std::uint32_t value = 0;
 
-        cv::destroyAllWindows();
+        for (int b = 0; b < bytes; ++b) {
+            int shift = little_endian ? 8 * b : 8 * (bytes - 1 - b);
+            value |= static_cast<std::uint32_t>(data[tiff + offset + b]) << shift;
+        }
+
+        return value;
+    };
+
+    // Value of a tag of an IFD, SHORT and LONG inline, RATIONAL through its offset
+    auto tag = [&](std::uint32_t ifd, std::uint16_t id) -> double {
+        std::uint32_t entries = read(ifd, 2);
+
+        for (std::uint32_t e = 0; e < entries; ++e) {
+            std::size_t entry = ifd + 2 + 12 * e;
+
+            if ( read(entry, 2) != id ) {
+                continue;
+            }
+
+            switch ( read(entry + 2, 2) ) {
+                case 3: return read(entry + 8, 2);
+                case 4: return read(entry + 8, 4);
+                case 5: {
+                    std::uint32_t offset = read(entry + 8, 4);
+                    std::uint32_t denominator = read(offset + 4, 4);
+                    return denominator ? static_cast<double>(read(offset, 4)) / denominator : 0.;
+                }
+                default: return 0.;
+            }
+        }
+
+        return 0.;
+    };
+
+    std::uint32_t exif = static_cast<std::uint32_t>(tag(read(4, 4), 0x8769));
+
+    if ( exif == 0 ) {
+        return 0.;
     }
-    else {
-        showError("Panorama could not be created.");
+
+    double focal_35mm = tag(exif, 0xA405);
+
+    if ( focal_35mm > 0 ) {
+        return focal_35mm / diagonal_35mm * std::hypot(size.width, size.height);
+    }
+
+    double focal_mm     = tag(exif, 0x920A);
+    double resolution   = tag(exif, 0xA20E);
+    double unit         = tag(exif, 0xA210);
+    double pixel_width  = tag(exif, 0xA002);
+    double pixel_height = tag(exif, 0xA003);
+
+    if ( focal_mm <= 0 || resolution <= 0 ) {
+        return 0.;
     }
+
+    // Resolution unit is inches unless given in centimetres
+    double pixels_per_mm = resolution / (unit == 3 ? 10. : 25.4);
+    double scale = pixel_width > 0 && pixel_height > 0 ?
+        std::max(size.width, size.height) / std::max(pixel_width, pixel_height) : 1.;
+
+    return focal_mm * pixels_per_mm * scale;
 }
 
 /**
- * Prompts the user if they wish to save the panorama. Dialog appears only
- * after the preview is marked to be closed. If they user chooses to save
- * the image, they can browse to the subdirectory using the GUI and name
- * the file whatever they want.
+ * Reads a camera calibration as written by OpenCV's calibration sample, the camera
+ * matrix along with the image size it was calibrated at, and sets the focal length
+ * prior of every image scaled to its size.
+ * 
+ * @param filename YAML, XML or JSON file, as supported by cv::FileStorage
+ * @param images input images
+ * @param focal_priors focal length priors of the images
  * 
- * @param image Panorama image to be saved
+ * @return true if the calibration was read
  */
-void promptSaveImage(const Image& image) {
+bool readCalibration(const Filename& filename, const std::vector<Image>& images, std::vector<double>& focal_priors) {
+    cv::Mat camera_matrix;
+    int image_width = 0, image_height = 0;
+
+    try {
+        cv::FileStorage fs(filename, cv::FileStorage::READ);
+
+        if ( ! fs.isOpened() ) {
+            return false;
+        }
+
+        fs["camera_matrix"] >> camera_matrix;
+        fs["image_width"] >> image_width;
+        fs["image_height"] >> image_height;
+    }
+    catch (const cv::Exception&) {
+        return false;
+    }
+
+    if ( camera_matrix.rows != 3 || camera_matrix.cols != 3 ) {
+        return false;
+    }
+
+    camera_matrix.convertTo(camera_matrix, CV_64F);
+    double focal = std::sqrt(camera_matrix.at<double>(0, 0) * camera_matrix.at<double>(1, 1));
+
+    focal_priors.resize(images.size());
+
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        // Rotated images are matched to the calibration by their long side
+        double scale = image_width > 0 && image_height > 0 ?
+            static_cast<double>(std::max(images[i].cols, images[i].rows)) / std::max(image_width, image_height) : 1.;
+        focal_priors[i] = focal * scale;
+    }
+
+    return true;
+}
+
+/**
+ * Reads the pose of every image from a CSV file, one image per line as yaw, pitch
+ * and optionally roll in degrees. Lines may start with the image filename, in
+ * which case they are matched to the input files by name, otherwise they follow
+ * the input order. A header line is skipped.
+ * 
+ * @param filename CSV file
+ * @param files input image filenames, empty when not known
+ * @param num_images number of input images
+ * @param pose_priors yaw, pitch and roll of each image
+ * 
+ * @return true if every image has a pose
+ */
+bool readPosePriors(const Filename& filename, const std::vector<Filename>& files, std::size_t num_images, std::vector<cv::Vec3d>& pose_priors) {
+    std::ifstream csv(filename);
+
+    if ( ! csv.is_open() ) {
+        return false;
+    }
+
+    auto basename = [](const Filename& path) {
+        std::size_t slash = path.find_last_of("/\\");
+        return slash == Filename::npos ? path : path.substr(slash + 1);
+    };
+
+    pose_priors.assign(num_images, cv::Vec3d());
+    std::vector<bool> found(num_images, false);
+    std::size_t row = 0;
+    std::string line;
+
+    while ( std::getline(csv, line) ) {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        std::string field;
+
+        while ( std::getline(stream, field, ',') ) {
+            fields.push_back(field);
+        }
+
+        if ( fields.empty() ) {
+            continue;
+        }
+
+        // Leading filename when the first field isn't a number
+        char* end = nullptr;
+        std::strtod(fields[0].c_str(), &end);
+        bool named = end == fields[0].c_str();
+
+        std::vector<double> angles;
+
+        for (std::size_t f = named ? 1 : 0; f < fields.size(); ++f) {
+            const char* begin = fields[f].c_str();
+            double value = std::strtod(begin, &end);
+
+            if ( end == begin ) {
+                break;
+            }
+
+            angles.push_back(value);
+        }
+
+        // Header line
+        if ( angles.size() < 2 ) {
+            continue;
+        }
+
+        std::size_t image = row++;
+
+        if ( named && ! files.empty() ) {
+            std::size_t first = fields[0].find_first_not_of(" \t");
+
+            // A blank filename can't be matched to any image
+            if ( first == std::string::npos ) {
+                showError("Pose prior without a filename: " + line);
+                continue;
+            }
+
+            Filename name = basename(fields[0].substr(first));
+            image = num_images;
+
+            for (std::size_t i = 0; i < files.size() && i < num_images; ++i) {
+                if ( basename(files[i]) == name ) {
+                    image = i;
+                }
+            }
+        }
+
+        if ( image < num_images ) {
+            pose_priors[image] = cv::Vec3d(angles[0], angles[1], angles.size() > 2 ? angles[2] : 0.);
+            found[image] = true;
+        }
+    }
+
+    return num_images > 0 && std::find(found.begin(), found.end(), false) == found.end();
+}
+
+/**
+ * Can be passed a video filename which is parsed for frames to stitch together.
+ * They key to this function is the frequency variable, which determines how
+ * frequently frames will be taken from the video. The basic formula is fairly
+ * obvious, as it's just:
+ *      TOTAL_FRAMES * frequency
+ * We then skip this number of frames on each iteration and capture whatever the
+ * next frame is and store it into our image vector. Note that the frequency parameter
+ * MUST be between 0 and 1, otherwise it just doesn't work. Default parameter is set
+ * to 0.1, so 10 frames will be captured from the video. This worked fine for the short
+ * test video I used, but longer videos might not have enough correspondence between
+ * frames at this rate, so adjust as necessary.
+ * 
+ * @param images vector in which to read in images
+ * @param video filename for video from which to capture frames
+ * @param frequency frequency to capture frames. 1/frequency = number of frames to be captured
+ */
+void videoCapture(std::vector<Image>& images, const Filename& video, double frequency) {
+    assert(0 < frequency && frequency < 1);
+
+    cv::VideoCapture feed;
+    
+    feed.open( video );
+
+    std::size_t frame_position  = feed.get(cv::CAP_PROP_POS_FRAMES);
+    std::size_t frame_frequency = feed.get(cv::CAP_PROP_FRAME_COUNT) * frequency;
+    
+    for (;;) {
+        Image frame;
+        feed >> frame;
+
+        if ( frame.data ) {
+            // Capture frame and increase frame position in video capture feed.
+            // This is more efficient since we don't have to read in all the frames
+            // that we're ignoring.
+            images.push_back(frame);
+            feed.set(cv::CAP_PROP_POS_FRAMES, frame_position + frame_frequency);
+            frame_position = feed.get(cv::CAP_PROP_POS_FRAMES);
+        }
+        else {
+            break;
+        }
+    }
+
+    feed.release();
+}
+
+/**
+ * Stitches synchronised video sources of a fixed camera rig in real time. The rig
+ * is calibrated once on the first frame set, after which every frame set is only
+ * looked up through the cached warp tables and blended with fixed seams and gains.
+ * Panoramic frames are written to a video file, or previewed when no file is given.
+ * 
+ * @param sources camera indices or video files, one per camera of the rig
+ * @param settings stitching pipeline settings
+ * @param output output video file, empty for a preview window
+ */
+void runRig(const std::vector<std::string>& sources, const Settings& settings, const Filename& output) {
+    if ( sources.size() < 2 ) {
+        showError("A rig needs at least two sources");
+        return;
+    }
+
+    std::vector<cv::VideoCapture> feeds(sources.size());
+
+    for (std::size_t i = 0; i < sources.size(); ++i) {
+        bool camera = ! sources[i].empty() && std::all_of(sources[i].begin(), sources[i].end(),
+                                                          [](unsigned char c) { return std::isdigit(c); });
+
+        if ( camera ) {
+            feeds[i].open( std::stoi(sources[i]) );
+        }
+        else {
+            feeds[i].open( sources[i] );
+        }
+
+        if ( ! feeds[i].isOpened() ) {
+            showError("Could not open rig source: " + sources[i]);
+            return;
+        }
+    }
+
+    std::vector<Image> frames;
+    RigCompositor rig;
+
+    std::cout << GREEN;
+    std::cout << "Calibrating rig..." << std::endl;
+
+    if ( ! readFrameSet(feeds, frames) || ! calibrateRig(frames, settings, rig) ) {
+        showError("Rig could not be calibrated.");
+        return;
+    }
+
+    cv::VideoWriter writer;
+
+    if ( ! output.empty() ) {
+        double fps = feeds[0].get(cv::CAP_PROP_FPS);
+        writer.open(output, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 30, rig.canvas.size());
+
+        if ( ! writer.isOpened() ) {
+            showError("Could not open video output: " + output);
+            return;
+        }
+    }
+
+    std::cout << CYAN;
+    std::cout << "Stitching rig, press ESC to stop..." << std::endl;
+
+    cv::TickMeter timer;
+    std::size_t frame_count = 0;
+
+    do {
+        Image panorama;
+
+        timer.start();
+        stitchFrameSet(frames, rig, panorama);
+        timer.stop();
+        ++frame_count;
+
+        if ( writer.isOpened() ) {
+            writer.write(panorama);
+        }
+        else {
+            cv::imshow("Rig panorama", panorama);
+
+            if ( cv::waitKey(1) == ESCAPE ) {
+                break;
+            }
+        }
+    } while ( readFrameSet(feeds, frames) );
+
+    writer.release();
+    cv::destroyAllWindows();
+
+    showNotification("Stitched " + std::to_string(frame_count) + " frames at "
+                     + std::to_string(static_cast<int>(frame_count / std::max(timer.getTimeSec(), 1e-9))) + " fps");
+}
+
+/**
+ * Reads one synchronised frame from every source. All sources are grabbed before
+ * any frame is decoded, so the frames are as close in time as the sources allow.
+ * 
+ * @param feeds opened rig sources
+ * @param frames one frame per source
+ * 
+ * @return true if every source delivered a frame
+ */
+bool readFrameSet(std::vector<cv::VideoCapture>& feeds, std::vector<Image>& frames) {
+    frames.resize(feeds.size());
+
+    for (cv::VideoCapture& feed : feeds) {
+        if ( ! feed.grab() ) {
+            return false;
+        }
+    }
+
+    for (std::size_t i = 0; i < feeds.size(); ++i) {
+        if ( ! feeds[i].retrieve(frames[i]) || frames[i].empty() ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Calibrates a rig on one frame set. Cameras, warp tables, seams and exposure gains
+ * come from the rig cache when it matches, and the fixed seams and gains are folded
+ * into a feather weight per camera, so that stitching a frame set is a lookup, a multiply
+ * and an add per pixel.
+ * 
+ * @param frames one frame per camera of the rig
+ * @param settings stitching pipeline settings
+ * @param rig calibrated rig
+ * 
+ * @return true if the rig was calibrated
+ */
+bool calibrateRig(const std::vector<Image>& frames, const Settings& settings, RigCompositor& rig) {
+    bool cached = ! settings.rig_cache.empty() && loadWarpTables(settings.rig_cache, frames, settings, rig.tables);
+
+    if ( ! cached ) {
+        Registration registration;
+
+        if ( ! registerPanorama(frames, settings, registration) ) {
+            return false;
+        }
+
+        buildWarpTables(frames, registration, settings, rig.tables);
+
+        if ( ! settings.rig_cache.empty() && ! saveWarpTables(settings.rig_cache, rig.tables) ) {
+            showError("Warp tables could not be saved at: " + settings.rig_cache);
+        }
+    }
+
+    const WarpTables& tables = rig.tables;
+    const Seams& seams       = tables.seams;
+    std::size_t num_images   = tables.registration.indices.size();
+
+    std::vector<cv::Mat> gain_maps;
+    seams.compensator->getMatGains(gain_maps);
+
+    // Warped masks cut along the fixed seams
+    std::vector<cv::UMat> masks(num_images), weight_maps;
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        Image mask_warped;
+        cv::UMat seam_mask;
+        tables.masks[i].decode(tables.masks[i].roi(), mask_warped);
+
+        cv::resize(seams.masks[i], seam_mask, mask_warped.size(), 0, 0, cv::INTER_LINEAR_EXACT);
+        cv::bitwise_and(seam_mask, mask_warped, masks[i]);
+    }
+
+    cv::detail::FeatherBlender feather;
+    rig.canvas = feather.createWeightMaps(masks, tables.corners, weight_maps);
+    rig.weights.resize(num_images);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        Image weight, gains;
+        cv::Mat feather_weight = weight_maps[i].getMat(cv::ACCESS_READ);
+        cv::Mat planes[] = { feather_weight, feather_weight, feather_weight };
+        cv::merge(planes, 3, weight);
+
+        cv::resize(gain_maps[i], gains, weight.size(), 0, 0, cv::INTER_LINEAR);
+
+        if ( gains.channels() == 1 ) {
+            cv::Mat gain_planes[] = { gains, gains, gains };
+            cv::merge(gain_planes, 3, gains);
+        }
+
+        cv::multiply(weight, gains, rig.weights[i]);
+    }
+
+    return ! rig.canvas.empty();
+}
+
+/**
+ * Stitches one frame set of a calibrated rig.
+ * 
+ * @param frames one frame per camera of the rig
+ * @param rig calibrated rig
+ * @param panorama resulting panoramic frame, the size of the rig canvas
+ */
+void stitchFrameSet(const std::vector<Image>& frames, const RigCompositor& rig, Image& panorama) {
+    const WarpTables& tables = rig.tables;
+
+    Image canvas(rig.canvas.size(), CV_32FC3, cv::Scalar::all(0));
+
+    for (std::size_t i = 0; i < tables.registration.indices.size(); ++i) {
+        Image image, image_warped, image_warped_f;
+        composeImage(frames[tables.registration.indices[i]], tables.compose_scale, image);
+
+        cv::remap(image, image_warped, tables.maps[i], tables.weights[i], cv::INTER_LINEAR, cv::BORDER_REFLECT);
+        image_warped.convertTo(image_warped_f, CV_32F);
+
+        cv::Rect roi(tables.corners[i] - rig.canvas.tl(), image_warped.size());
+        Image canvas_roi = canvas(roi);
+        cv::accumulateProduct(image_warped_f, rig.weights[i], canvas_roi);
+    }
+
+    canvas.convertTo(panorama, CV_8U);
+}
+
+/**
+ * Turns a panning video into a stabilised panoramic video. Keyframes sampled the
+ * same way as videoCapture() are registered and composited into a background
+ * panorama once. Every frame is then tracked incrementally against the previous
+ * one, re-anchored on keyframes to stop drift, and only the area the live frame
+ * covers is warped and pasted over the accumulated background.
+ * 
+ * @param video panning video file
+ * @param settings stitching pipeline settings
+ * @param output output video file
+ */
+void runPanningVideo(const Filename& video, const Settings& settings, const Filename& output) {
+    const double frequency = 0.1;
+
+    cv::VideoCapture feed;
+    feed.open( video );
+
+    if ( ! feed.isOpened() ) {
+        showError("Could not open video: " + video);
+        return;
+    }
+
+    // Keyframes at known positions, so that tracking can snap back onto them
+    int frame_count = static_cast<int>(feed.get(cv::CAP_PROP_FRAME_COUNT));
+    int step        = std::max(1, static_cast<int>(frame_count * frequency));
+
+    std::vector<Image> keyframes;
+    std::vector<int> keyframe_positions;
+
+    for (int position = 0; position < frame_count; position += step) {
+        Image frame;
+        feed.set(cv::CAP_PROP_POS_FRAMES, position);
+        feed >> frame;
+
+        if ( frame.data ) {
+            keyframes.push_back(frame);
+            keyframe_positions.push_back(position);
+        }
+    }
+
+    std::cout << GREEN;
+    std::cout << "Registering " << keyframes.size() << " keyframes..." << std::endl;
+
+    Registration registration;
+    Image background;
+
+    if ( keyframes.size() < 2 || ! registerPanorama(keyframes, settings, registration) ) {
+        showError("Panorama could not be created.");
+        return;
+    }
+
+    // The background has to cover every keyframe, so it is never cropped. Affine
+    // registrations are composited on the plane of cv::detail::AffineWarper
+    Settings surface = settings;
+    surface.auto_crop = false;
+
+    if ( registration.affine ) {
+        surface.projection = Projection::AFFINE;
+    }
+
+    TileCanvas background_tiles;
+
+    if ( ! compositePanorama(keyframes, registration, surface, background_tiles) ) {
+        showError("Panorama could not be created.");
+        return;
+    }
+
+    // Frames are pasted over the whole background, so it is made dense once here
+    background_tiles.copyTo(background);
+
+    // The background covers the union of the keyframe footprints
+    double compose_scale = compositingScale(keyframes, registration, settings);
+    double work_scale    = scaleForResolution(keyframes[0], settings.registration_resol);
+
+    cv::Ptr<cv::detail::RotationWarper> warper =
+        createWarper(surface)->create(static_cast<float>(surfaceScale(registration) * compose_scale));
+
+    std::vector<cv::detail::CameraParams> cameras;
+    scaleCameras(registration, compose_scale, cameras);
+
+    cv::Rect canvas;
+
+    for (std::size_t i = 0; i < cameras.size(); ++i) {
+        cv::Rect roi = warpedRoi(keyframes[registration.indices[i]], cameras[i], compose_scale, warper);
+        canvas = i == 0 ? roi : (canvas | roi);
+    }
+
+    // Frames are pasted by surface position, which needs the uncropped background
+    if ( background.size() != canvas.size() ) {
+        showError("Background panorama doesn't match the warped keyframes.");
+        return;
+    }
+
+    // Registered keyframes by video position
+    std::vector<std::pair<int, std::size_t>> anchors;
+
+    for (std::size_t i = 0; i < registration.indices.size(); ++i) {
+        anchors.push_back({keyframe_positions[registration.indices[i]], i});
+    }
+
+    std::sort(anchors.begin(), anchors.end());
+
+    cv::VideoWriter writer;
+    double fps = feed.get(cv::CAP_PROP_FPS);
+    writer.open(output, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 30, canvas.size());
+
+    if ( ! writer.isOpened() ) {
+        showError("Could not open video output: " + output);
+        return;
+    }
+
+    std::cout << CYAN;
+    std::cout << "Writing panoramic video..." << std::endl;
+
+    // Frames before the first registered keyframe have nothing to be tracked from
+    feed.set(cv::CAP_PROP_POS_FRAMES, anchors[0].first);
+
+    cv::detail::CameraParams camera = registration.cameras[anchors[0].second];
+    cv::detail::ImageFeatures previous;
+    cv::Ptr<cv::detail::FeaturesMatcher> matcher = createMatcher(settings);
+    std::size_t next_anchor = 0;
+    int written = 0;
+
+    for (int position = anchors[0].first; ; ++position) {
+        Image frame;
+        feed >> frame;
+
+        if ( ! frame.data ) {
+            break;
+        }
+
+        std::vector<cv::detail::ImageFeatures> features;
+        findFeatures({frame}, work_scale, settings, features);
+
+        if ( next_anchor < anchors.size() && anchors[next_anchor].first == position ) {
+            camera = registration.cameras[anchors[next_anchor].second];
+            ++next_anchor;
+        }
+        else {
+            trackCamera(previous, features[0], work_scale, surface, *matcher, camera);
+        }
+
+        previous = features[0];
+
+        // Warp the live frame only, clipped to the panorama
+        Image image, image_warped, mask_warped;
+        composeImage(frame, compose_scale, image);
+
+        cv::detail::CameraParams compose_camera = camera;
+        compose_camera.focal *= compose_scale;
+        compose_camera.ppx   *= compose_scale;
+        compose_camera.ppy   *= compose_scale;
+
+        cv::Mat K;
+        compose_camera.K().convertTo(K, CV_32F);
+
+        Image mask(image.size(), CV_8U, cv::Scalar::all(255));
+        cv::Point corner = warper->warp(image, K, compose_camera.R, cv::INTER_LINEAR, cv::BORDER_REFLECT, image_warped);
+        warper->warp(mask, K, compose_camera.R, cv::INTER_NEAREST, cv::BORDER_CONSTANT, mask_warped);
+
+        cv::Rect roi = cv::Rect(corner, image_warped.size()) & canvas;
+
+        if ( ! roi.empty() ) {
+            cv::Rect source(roi.tl() - corner, roi.size());
+            Image background_roi = background(roi - canvas.tl());
+            image_warped(source).copyTo(background_roi, mask_warped(source));
+        }
+
+        writer.write(background);
+        ++written;
+    }
+
+    matcher->collectGarbage();
+    writer.release();
+    feed.release();
+
+    showNotification("Panoramic video with " + std::to_string(written) + " frames saved at: " + output);
+}
+
+/**
+ * Tracks a pure rotation camera from one video frame to the next. The homography
+ * between the frames is estimated the same way as for registration and turned into
+ * a relative rotation, which is chained onto the camera. On the affine plane, a
+ * partial affine transform is fitted to the matches and chained instead.
+ * 
+ * @param previous features of the previous frame
+ * @param current features of the current frame
+ * @param work_scale scale at which the features were detected
+ * @param settings stitching pipeline settings, with the projection of the surface
+ * @param matcher matcher shared by all frames
+ * @param camera camera of the previous frame, updated to the current frame
+ * 
+ * @return true if the frames matched, otherwise the camera is left unchanged
+ */
+bool trackCamera(const cv::detail::ImageFeatures& previous, const cv::detail::ImageFeatures& current,
+                 double work_scale, const Settings& settings, cv::detail::FeaturesMatcher& matcher,
+                 cv::detail::CameraParams& camera) {
+    cv::detail::MatchesInfo matches;
+    matcher(previous, current, matches);
+
+    if ( matches.H.empty() || matches.confidence < settings.confidence_thresh ) {
+        return false;
+    }
+
+    if ( settings.projection == Projection::AFFINE ) {
+        // Affine cameras map the plane to uncentred pixels at registration resolution
+        std::vector<cv::Point2f> src_points, dst_points;
+
+        for (const cv::DMatch& match : matches.matches) {
+            src_points.push_back(previous.keypoints[match.queryIdx].pt);
+            dst_points.push_back(current.keypoints[match.trainIdx].pt);
+        }
+
+        cv::Mat A = cv::estimateAffinePartial2D(src_points, dst_points);
+
+        if ( A.empty() ) {
+            return false;
+        }
+
+        A.push_back(cv::Mat::zeros(1, 3, CV_64F));
+        A.at<double>(2, 2) = 1;
+
+        cv::Mat_<float> A_relative, R;
+        A.convertTo(A_relative, CV_32F);
+        camera.R.convertTo(R, CV_32F);
+        camera.R = A_relative * R;
+
+        return true;
+    }
+
+    // The matcher works in image centred coordinates at registration resolution
+    cv::Mat_<double> S = cv::Mat_<double>::eye(3, 3);
+    S(0, 0) = S(1, 1) = work_scale;
+
+    cv::Mat_<double> K = cv::Mat_<double>::eye(3, 3);
+    K(0, 0) = camera.focal;
+    K(1, 1) = camera.focal * camera.aspect;
+
+    cv::Mat_<double> H = S.inv() * matches.H * S;
+    cv::Mat_<double> R = K.inv() * H.inv() * K;
+
+    // Snap back onto the nearest rotation
+    cv::Mat u, w, vt;
+    cv::SVD::compute(R, w, u, vt);
+    R = u * vt;
+
+    if ( cv::determinant(R) < 0 ) {
+        return false;
+    }
+
+    cv::Mat_<float> R_relative;
+    R.convertTo(R_relative, CV_32F);
+    camera.R = camera.R * R_relative;
+
+    return true;
+}
+
+/**
+ * Runs one of the benchmarks on the demo image sets.
+ * 
+ * @param benchmark name of the benchmark
+ * @param settings stitching pipeline settings to benchmark with
+ */
+void runBenchmark(const std::string& benchmark, const Settings& settings) {
+    if ( benchmark == "warp" ) {
+        benchmarkWarp();
+    }
+    else if ( benchmark == "features" ) {
+        benchmarkFeatures(settings);
+    }
+    else if ( benchmark == "matcher" ) {
+        benchmarkMatcher(settings);
+    }
+    else if ( benchmark == "rotation" ) {
+        benchmarkRotation();
+    }
+    else {
+        showError("Unknown benchmark: " + benchmark);
+    }
+}
+
+/**
+ * Times the stock OpenCV spherical and cylindrical warpers against the fast
+ * warpers on the first image of every demo set, and reports the largest pixel
+ * difference between the two.
+ */
+void benchmarkWarp() {
+    const int runs = 5;
+
+    std::cout << CYAN;
+    std::cout << "Row kernel: " << rowKernel().name << std::endl;
+    std::cout << std::left << std::setw(14) << "demo" << std::setw(14) << "warp"
+              << std::right << std::setw(12) << "stock ms" << std::setw(12) << "fast ms"
+              << std::setw(10) << "speedup" << std::setw(10) << "max diff" << std::endl;
+
+    for (std::size_t demo = 0; demo <= 10; ++demo) {
+        std::vector<Image> images;
+        runDemo(images, demo);
+
+        if ( images.empty() ) {
+            continue;
+        }
+
+        const Image& image = images[0];
+
+        // Synthetic camera with a roughly 53 degree field of view
+        cv::Mat_<float> K = cv::Mat_<float>::eye(3, 3);
+        K(0, 0) = K(1, 1) = static_cast<float>(image.cols);
+        K(0, 2) = image.cols * 0.5f;
+        K(1, 2) = image.rows * 0.5f;
+        cv::Mat_<float> R = cv::Mat_<float>::eye(3, 3);
+
+        const std::vector<std::pair<std::string, Projection>> projections {
+            {"spherical", Projection::SPHERICAL}, {"cylindrical", Projection::CYLINDRICAL}
+        };
+
+        for (const auto& projection : projections) {
+            Settings settings;
+            settings.projection = projection.second;
+
+            cv::Ptr<cv::detail::RotationWarper> stock, fast;
+
+            if ( projection.second == Projection::SPHERICAL ) {
+                stock = cv::makePtr<cv::detail::SphericalWarper>(K(0, 0));
+            }
+            else {
+                stock = cv::makePtr<cv::detail::CylindricalWarper>(K(0, 0));
+            }
+
+            fast = createWarper(settings)->create(K(0, 0));
+
+            Image stock_warped, fast_warped;
+            cv::TickMeter stock_time, fast_time;
+
+            for (int run = 0; run < runs; ++run) {
+                stock_time.start();
+                stock->warp(image, K, R, cv::INTER_LINEAR, cv::BORDER_REFLECT, stock_warped);
+                stock_time.stop();
+
+                fast_time.start();
+                fast->warp(image, K, R, cv::INTER_LINEAR, cv::BORDER_REFLECT, fast_warped);
+                fast_time.stop();
+            }
+
+            double stock_ms = stock_time.getTimeMilli() / runs;
+            double fast_ms  = fast_time.getTimeMilli() / runs;
+            double diff     = stock_warped.size() == fast_warped.size()
+                ? cv::norm(stock_warped, fast_warped, cv::NORM_INF) : -1;
+
+            std::cout << std::left << std::setw(14) << demo
+                      << std::setw(14) << projection.first << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(12) << stock_ms << std::setw(12) << fast_ms
+                      << std::setw(9) << stock_ms / fast_ms << "x" << std::setw(10) << diff << std::endl;
+        }
+    }
+}
+
+/**
+ * Runs every feature detector over every demo set and reports keypoint counts,
+ * detection and matching time, and whether the whole set could be registered.
+ * 
+ * @param base_settings stitching pipeline settings, such as the keypoint budget
+ */
+void benchmarkFeatures(const Settings& base_settings) {
+    const std::vector<std::pair<std::string, FeatureType>> detectors {
+        {"orb", FeatureType::ORB}, {"akaze", FeatureType::AKAZE},
+        {"sift", FeatureType::SIFT}, {"brisk", FeatureType::BRISK}
+    };
+
+    std::cout << CYAN;
+    std::cout << std::left << std::setw(8) << "features" << std::setw(6) << "demo"
+              << std::right << std::setw(12) << "keypoints" << std::setw(12) << "detect ms"
+              << std::setw(12) << "match ms" << std::setw(12) << "registered" << std::endl;
+
+    for (const auto& detector : detectors) {
+        Settings settings = base_settings;
+        settings.features = detector.second;
+
+        double detect_total = 0, match_total = 0;
+        std::size_t keypoints_total = 0, images_total = 0, stitched = 0, demos = 0;
+
+        for (std::size_t demo = 0; demo <= 10; ++demo) {
+            std::vector<Image> images;
+            runDemo(images, demo);
+
+            if ( images.size() < 2 ) {
+                continue;
+            }
+
+            double work_scale = scaleForResolution(images[0], settings.registration_resol);
+
+            std::vector<cv::detail::ImageFeatures> features;
+            cv::TickMeter detect_time, match_time;
+
+            detect_time.start();
+            findFeatures(images, work_scale, settings, features);
+            detect_time.stop();
+
+            std::vector<cv::detail::MatchesInfo> pairwise_matches;
+            cv::Ptr<cv::detail::FeaturesMatcher> matcher = createMatcher(settings);
+
+            match_time.start();
+            (*matcher)(features, pairwise_matches);
+            match_time.stop();
+            matcher->collectGarbage();
+
+            std::size_t keypoints = 0;
+
+            for (const cv::detail::ImageFeatures& image_features : features) {
+                keypoints += image_features.keypoints.size();
+            }
+
+            Registration registration;
+            bool registered = estimateCameras(features, pairwise_matches, work_scale, settings, registration);
+            std::size_t num_registered = registered ? registration.indices.size() : 0;
+
+            std::cout << std::left << std::setw(8) << detector.first << std::setw(6) << demo << std::right
+                      << std::setw(12) << keypoints / images.size() << std::fixed << std::setprecision(1)
+                      << std::setw(12) << detect_time.getTimeMilli() << std::setw(12) << match_time.getTimeMilli()
+                      << std::setw(8) << num_registered << "/" << std::left << std::setw(3) << images.size()
+                      << std::right << std::endl;
+
+            detect_total    += detect_time.getTimeMilli();
+            match_total     += match_time.getTimeMilli();
+            keypoints_total += keypoints;
+            images_total    += images.size();
+            stitched        += num_registered == images.size() ? 1 : 0;
+            ++demos;
+        }
+
+        if ( demos > 0 ) {
+            std::cout << GREEN;
+            std::cout << detector.first << ": " << keypoints_total / images_total << " keypoints per image, "
+                      << detect_total << " ms detecting, " << match_total << " ms matching, "
+                      << stitched << " of " << demos << " sets fully registered" << std::endl;
+            std::cout << CYAN;
+        }
+    }
+}
+
+/**
+ * Times the pairwise matcher used by cv::Stitcher against the Hamming matcher on the
+ * ORB features of every demo set, and compares the number of confident pairs each
+ * of them finds.
+ * 
+ * @param base_settings stitching pipeline settings, such as the keypoint budget
+ */
+void benchmarkMatcher(const Settings& base_settings) {
+    Settings settings = base_settings;
+    settings.features = FeatureType::ORB;
+
+    std::cout << CYAN;
+    std::cout << "Hamming kernel: " << hammingKernel().name << std::endl;
+    std::cout << std::left << std::setw(6) << "demo" << std::right << std::setw(8) << "images"
+              << std::setw(12) << "stock ms" << std::setw(12) << "hamming ms" << std::setw(10) << "speedup"
+              << std::setw(14) << "stock pairs" << std::setw(14) << "hamming pairs" << std::endl;
+
+    for (std::size_t demo = 0; demo <= 10; ++demo) {
+        std::vector<Image> images;
+        runDemo(images, demo);
+
+        if ( images.size() < 2 ) {
+            continue;
+        }
+
+        std::vector<cv::detail::ImageFeatures> features;
+        findFeatures(images, scaleForResolution(images[0], settings.registration_resol), settings, features);
+
+        std::vector<cv::detail::MatchesInfo> stock_matches, hamming_matches;
+        cv::detail::BestOf2NearestMatcher stock(false);
+        HammingMatcher hamming;
+        cv::TickMeter stock_time, hamming_time;
+
+        stock_time.start();
+        stock(features, stock_matches);
+        stock_time.stop();
+
+        hamming_time.start();
+        hamming(features, hamming_matches);
+        hamming_time.stop();
+
+        auto confident = [&settings](const std::vector<cv::detail::MatchesInfo>& pairwise_matches) {
+            return std::count_if(pairwise_matches.begin(), pairwise_matches.end(), [&settings](const cv::detail::MatchesInfo& m) {
+                return m.src_img_idx < m.dst_img_idx && m.confidence > settings.confidence_thresh;
+            });
+        };
+
+        std::cout << std::left << std::setw(6) << demo << std::right << std::setw(8) << images.size()
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(12) << stock_time.getTimeMilli() << std::setw(12) << hamming_time.getTimeMilli()
+                  << std::setw(9) << stock_time.getTimeMilli() / hamming_time.getTimeMilli() << "x"
+                  << std::setw(14) << confident(stock_matches) << std::setw(14) << confident(hamming_matches) << std::endl;
+    }
+}
+
+/**
+ * Checks the rotation only verifier on synthetic correspondences. Points are mapped
+ * through K R K^-1 for a range of focal lengths and rotations, with pixel noise and
+ * a share of outliers, and the focal length of the fitted model is compared with the
+ * true one.
+ */
+void benchmarkRotation() {
+    const cv::Size size(1200, 800);
+    const int num_points     = 300;
+    const double outliers    = 0.2;
+    const double noise       = 0.5;
+
+    const std::vector<double> focals {400, 1000, 2500};
+    const std::vector<cv::Vec3d> poses {{10, 0, 0}, {20, 5, 2}, {5, -12, 8}};
+
+    RansacParams params;
+    params.rotation_only = true;
+
+    cv::RNG rng(0x5eed);
+
+    std::cout << CYAN;
+    std::cout << std::right << std::setw(8) << "focal" << std::setw(20) << "yaw pitch roll"
+              << std::setw(12) << "fitted" << std::setw(10) << "error %"
+              << std::setw(10) << "inliers" << std::setw(10) << "ms" << std::endl;
+
+    for (double focal : focals) {
+        cv::Matx33d K(focal, 0, 0, 0, focal, 0, 0, 0, 1);
+        cv::Matx33d K_inv(1. / focal, 0, 0, 0, 1. / focal, 0, 0, 0, 1);
+
+        for (const cv::Vec3d& pose : poses) {
+            cv::Matx33d H = K * poseRotation(pose) * K_inv;
+            std::vector<cv::Point2f> src_points, dst_points;
+
+            // Image centred points that stay in front of and inside the second image
+            while ( static_cast<int>(src_points.size()) < num_points ) {
+                cv::Point2d src(rng.uniform(-0.5, 0.5) * size.width, rng.uniform(-0.5, 0.5) * size.height);
+                cv::Point3d dst = H * cv::Point3d(src.x, src.y, 1.);
+
+                if ( dst.z <= 0 || std::abs(dst.x / dst.z) > size.width * 0.5 || std::abs(dst.y / dst.z) > size.height * 0.5 ) {
+                    continue;
+                }
+
+                cv::Point2d projected(dst.x / dst.z + rng.gaussian(noise), dst.y / dst.z + rng.gaussian(noise));
+
+                if ( rng.uniform(0., 1.) < outliers ) {
+                    projected = cv::Point2d(rng.uniform(-0.5, 0.5) * size.width, rng.uniform(-0.5, 0.5) * size.height);
+                }
+
+                src_points.push_back(cv::Point2f(src));
+                dst_points.push_back(cv::Point2f(projected));
+            }
+
+            std::vector<uchar> inliers_mask;
+            cv::TickMeter time;
+
+            time.start();
+            cv::Mat fitted = findRotationProsac(src_points, dst_points, params, inliers_mask);
+            time.stop();
+
+            double fitted_focal = fitted.empty() ? 0. : rotationFocal(cv::Matx33d(fitted));
+
+            std::ostringstream angles;
+            angles << pose[0] << " " << pose[1] << " " << pose[2];
+
+            std::cout << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(8) << focal << std::setw(20) << angles.str()
+                      << std::setw(12) << fitted_focal << std::setw(10) << 100. * std::abs(fitted_focal - focal) / focal
+                      << std::setw(10) << cv::countNonZero(inliers_mask) << std::setw(10) << time.getTimeMilli() << std::endl;
+        }
+    }
+}
+
+/**
+ * This is the function which actually creates the panorama image. Accepts the vector
+ * of images as a parameter, registers the cameras of every image and then composites
+ * the panorama from them. Note that reaching this block of code doesn't guarantee that
+ * a panorama can be created from the images, despite all the condition checking in the
+ * previous functions. If the set of images does not have enough matching features, a
+ * panorama will not be generated. If the panorama is successfully created, then the
+ * result is displayed visually to the user. On keypress, the window will be begin to
+ * close, before which a dialog asking if they wish to save the image. Once the user
+ * makes a decision, the window closes and the program terminates.
+ * 
+ * Large sets can be stitched hierarchically by passing a cluster size, in which case
+ * the match graph is partitioned into overlapping clusters that are registered in
+ * parallel and aligned afterwards through their shared anchor images. Panoramas too
+ * large to hold in memory can be composited tile by tile straight to a BigTIFF.
+ * 
+ * @param images vector of images which store the images to create a panorama from
+ * @param settings stitching pipeline settings
+ */
+void createPanorama(const std::vector<Image>& images, const Settings& settings) {
+    std::cout << GREEN;
+    std::cout << "Creating panorama..." << std::endl;
+    
+    TileCanvas panorama;
+    Registration registration;
+    WarpTables tables;
+
+    // A fixed rig skips registration and warping once its tables are cached
+    bool cached     = ! settings.rig_cache.empty() && loadWarpTables(settings.rig_cache, images, settings, tables);
+    bool registered = cached;
+
+    // Affine registrations are composited on the plane of cv::detail::AffineWarper
+    Settings surface = settings;
+
+    if ( cached ) {
+        registration = tables.registration;
+    }
+    else {
+        registered = registerPanorama(images, settings, registration);
+    }
+
+    if ( registration.affine ) {
+        surface.projection = Projection::AFFINE;
+    }
+
+    // Tiled output warps per tile and never looks the tables up
+    if ( registered && ! cached && ! settings.rig_cache.empty() && settings.tiled_output.empty() ) {
+        buildWarpTables(images, registration, surface, tables);
+        cached = true;
+
+        if ( ! saveWarpTables(settings.rig_cache, tables) ) {
+            showError("Warp tables could not be saved at: " + settings.rig_cache);
+        }
+    }
+
+    if ( registered && ! settings.tiled_output.empty() ) {
+        if ( compositeTiled(images, registration, surface, settings.tiled_output) ) {
+            showNotification("Panorama saved at: " + settings.tiled_output);
+        }
+        else {
+            showError("Panorama could not be written.");
+        }
+    }
+    else if ( registered && compositePanorama(images, registration, surface, panorama, cached ? &tables : nullptr) ) {
+        showNotification("Panorama successfully created!");
+        
+        // The preview is the only dense copy, and is dropped before saving
+        Image preview;
+        panorama.copyTo(preview);
+
+        cv::imshow( "Panorama", preview );
+        cv::waitKey(0);
+
+        preview.release();
+
+        promptSaveImage(panorama);
+
+        cv::destroyAllWindows();
+    }
+    else {
+        showError("Panorama could not be created.");
+    }
+}
+
+/**
+ * Registers the images, from pose priors when given or hierarchically for large
+ * sets when enabled, and applies wave correction. Forced scans are always
+ * registered flat, the affine pipeline only works on the full match graph.
+ * 
+ * @param images input images
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest connected set of images
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool registerPanorama(const std::vector<Image>& images, const Settings& settings, Registration& registration) {
+    bool hierarchical = settings.cluster_size > 0 && images.size() > settings.cluster_size;
+    bool registered   = false;
+
+    if ( ! settings.pose_priors.empty() ) {
+        registered = registerPosePrior(images, settings, registration);
+    }
+    else if ( settings.scans == ScansMode::ON ) {
+        registered = registerImages(images, settings, registration);
+    }
+    else if ( hierarchical ) {
+        registered = registerHierarchical(images, settings, registration);
+    }
+    else if ( settings.phase_correlation ) {
+        registered = registerPhaseCorrelation(images, settings, registration);
+    }
+    else if ( settings.coarse_to_fine ) {
+        registered = registerCoarseToFine(images, settings, registration);
+    }
+    else {
+        registered = registerImages(images, settings, registration);
+    }
+
+    // Affine cameras have no horizon to straighten
+    if ( registered && settings.wave_correction && ! registration.affine ) {
+        waveCorrect(registration);
+    }
+
+    return registered;
+}
+
+/**
+ * Registers every image against every other image in a single flat pass. This is
+ * the same registration cv::Stitcher performs: features at registration resolution,
+ * best of two nearest matching over all pairs, homography based camera estimation
+ * and ray bundle adjustment. With scans detection on, sets whose pairs are explained
+ * by affine transforms, such as flatbed scans and orthographic drone strips, go
+ * through the affine pipeline of cv::Stitcher::SCANS instead.
+ * 
+ * @param images input images
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest connected set of images
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool registerImages(const std::vector<Image>& images, const Settings& settings, Registration& registration) {
+    double work_scale = scaleForResolution(images[0], settings.registration_resol);
+
+    std::vector<cv::detail::ImageFeatures> features;
+    findFeatures(images, work_scale, settings, features);
+
+    std::vector<cv::detail::MatchesInfo> pairwise_matches;
+    cv::Ptr<cv::detail::FeaturesMatcher> matcher = createMatcher(settings);
+    (*matcher)(features, pairwise_matches);
+    matcher->collectGarbage();
+
+    float conf_thresh = static_cast<float>(settings.confidence_thresh);
+
+    bool affine = settings.scans == ScansMode::ON
+               || ( settings.scans == ScansMode::AUTO && affineExplains(features, pairwise_matches, conf_thresh) );
+
+    if ( affine ) {
+        std::cout << CYAN;
+        std::cout << "Pairwise transforms are affine, stitching as scans" << std::endl;
+
+        fitAffineMatches(features, pairwise_matches);
+
+        return estimateAffineCameras(features, pairwise_matches, work_scale, settings, registration);
+    }
+
+    return estimateCameras(features, pairwise_matches, work_scale, settings, registration);
+}
+
+/**
+ * Divide and conquer registration for very large sets. All pairs are first matched
+ * at thumbnail resolution, and only the pairs which overlap there are matched at
+ * registration resolution, which keeps the match graph sparse whatever the capture
+ * order. The graph is then partitioned into clusters that share a few anchor images
+ * with each other. Each cluster runs camera estimation and bundle adjustment on its
+ * own, in parallel, and the clusters are rotated into one common frame using their
+ * anchors. A final ray bundle adjustment over all matches of the aligned images,
+ * those between clusters included, spreads the remaining alignment error.
+ * 
+ * @param images input images
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest aligned set of clusters
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool registerHierarchical(const std::vector<Image>& images, const Settings& settings, Registration& registration) {
+    double work_scale   = scaleForResolution(images[0], settings.registration_resol);
+    double coarse_scale = std::min(work_scale, scaleForResolution(images[0], settings.coarse_resol));
+    float conf_thresh   = static_cast<float>(settings.confidence_thresh);
+    int num_images      = static_cast<int>(images.size());
+
+    // All pairs at thumbnail resolution, to find which images overlap
+    std::vector<cv::detail::ImageFeatures> coarse_features;
+    findFeatures(images, coarse_scale, settings, coarse_features);
+
+    std::vector<cv::detail::MatchesInfo> coarse_matches;
+    cv::Ptr<cv::detail::FeaturesMatcher> matcher = createMatcher(settings);
+    (*matcher)(coarse_features, coarse_matches);
+
+    cv::Mat match_mask = cv::Mat::zeros(num_images, num_images, CV_8U);
+    int num_pairs = 0;
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images; ++j) {
+            if ( coarse_matches[i * num_images + j].confidence > conf_thresh ) {
+                match_mask.at<uchar>(i, j) = 1;
+                ++num_pairs;
+            }
+        }
+    }
+
+    coarse_features.clear();
+    coarse_matches.clear();
+
+    std::cout << CYAN;
+    std::cout << "Matching " << num_pairs << " of " << num_images * (num_images - 1) / 2
+              << " pairs overlapping in the thumbnails..." << std::endl;
+
+    std::vector<cv::detail::ImageFeatures> features;
+    findFeatures(images, work_scale, settings, features);
+
+    std::vector<cv::detail::MatchesInfo> pairwise_matches;
+    (*matcher)(features, pairwise_matches, match_mask.getUMat(cv::ACCESS_READ));
+    matcher->collectGarbage();
+
+    // Subgraph of the given images, renumbered in their order
+    auto subgraph = [&](const std::vector<int>& members, std::vector<cv::detail::ImageFeatures>& sub_features,
+                        std::vector<cv::detail::MatchesInfo>& sub_matches) {
+        int size = static_cast<int>(members.size());
+
+        sub_features.assign(size, cv::detail::ImageFeatures());
+        sub_matches.assign(size * size, cv::detail::MatchesInfo());
+
+        for (int i = 0; i < size; ++i) {
+            sub_features[i] = features[members[i]];
+            sub_features[i].img_idx = i;
+
+            for (int j = 0; j < size; ++j) {
+                if ( i != j ) {
+                    sub_matches[i * size + j] = pairwise_matches[members[i] * num_images + members[j]];
+                    sub_matches[i * size + j].src_img_idx = i;
+                    sub_matches[i * size + j].dst_img_idx = j;
+                }
+            }
+        }
+    };
+
+    std::vector<std::vector<int>> clusters = partitionMatchGraph(pairwise_matches, num_images, settings);
+    std::vector<Registration> registrations(clusters.size());
+
+    std::cout << CYAN;
+    std::cout << "Registering " << clusters.size() << " clusters..." << std::endl;
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(clusters.size())), [&](const cv::Range& range) {
+        for (int c = range.start; c < range.end; ++c) {
+            const std::vector<int>& members = clusters[c];
+
+            if ( members.size() < 2 ) {
+                continue;
+            }
+
+            std::vector<cv::detail::ImageFeatures> sub_features;
+            std::vector<cv::detail::MatchesInfo> sub_matches;
+            subgraph(members, sub_features, sub_matches);
+
+            if ( estimateCameras(sub_features, sub_matches, work_scale, settings, registrations[c], members) ) {
+                for (int& index : registrations[c].indices) {
+                    index = members[index];
+                }
+            }
+            else {
+                registrations[c] = Registration();
+            }
+        }
+    });
+
+    if ( ! alignClusters(registrations, clusters, registration) ) {
+        return false;
+    }
+
+    // One global pass over every match of the aligned images, at registration scale
+    std::vector<cv::detail::ImageFeatures> sub_features;
+    std::vector<cv::detail::MatchesInfo> sub_matches;
+    subgraph(registration.indices, sub_features, sub_matches);
+
+    std::vector<cv::detail::CameraParams> cameras = registration.cameras;
+
+    for (cv::detail::CameraParams& camera : cameras) {
+        camera.R      = camera.R.clone();
+        camera.focal *= work_scale;
+        camera.ppx   *= work_scale;
+        camera.ppy   *= work_scale;
+    }
+
+    // Known focal lengths stay locked as they were in the clusters
+    std::vector<bool> locked;
+
+    for (int image : registration.indices) {
+        locked.push_back(settings.lock_intrinsics && static_cast<std::size_t>(image) < settings.focal_priors.size()
+                         && settings.focal_priors[image] > 0);
+    }
+
+    LockedRayAdjuster adjuster(locked);
+    adjuster.setConfThresh(conf_thresh);
+
+    if ( adjuster(sub_features, sub_matches, cameras) ) {
+        for (cv::detail::CameraParams& camera : cameras) {
+            camera.R.convertTo(camera.R, CV_32F);
+            camera.focal /= work_scale;
+            camera.ppx   /= work_scale;
+            camera.ppy   /= work_scale;
+        }
+
+        registration.cameras = cameras;
+    }
+    else {
+        showNotification("Global bundle adjustment failed, keeping the aligned clusters");
+    }
+
+    return true;
+}
+
+/**
+ * Computes the keypoint budget of an image at registration scale. An explicit budget
+ * always applies. With a grid and no explicit budget, the budget follows the area of
+ * the image, about as many keypoints as ORB keeps by default at 0.6 MP.
+ * 
+ * @param settings stitching pipeline settings
+ * @param size size of the image at registration scale
+ * 
+ * @return keypoint budget, 0 for no budget
+ */
+int keypointBudget(const Settings& settings, cv::Size size) {
+    if ( settings.keypoint_budget > 0 ) {
+        return settings.keypoint_budget;
+    }
+
+    if ( settings.keypoint_grid > 0 ) {
+        return std::max(100, cvRound(500.0 * size.area() / 0.6e6));
+    }
+
+    return 0;
+}
+
+/**
+ * Spreads a keypoint budget over a grid of cells. Cells share the budget evenly,
+ * and the share a sparse cell can't use is handed on to the busier cells, so
+ * textured areas can't crowd out the rest and featureless ones waste nothing.
+ * The strongest keypoints of each cell are kept.
+ * 
+ * @param keypoints detected keypoints, reduced to at most the budget
+ * @param size size of the image
+ * @param grid number of cells along the long side of the image
+ * @param budget number of keypoints to keep
+ */
+void bucketKeypoints(std::vector<cv::KeyPoint>& keypoints, cv::Size size, int grid, int budget) {
+    if ( static_cast<int>(keypoints.size()) <= budget ) {
+        return;
+    }
+
+    float cell = static_cast<float>(std::max(size.width, size.height)) / grid;
+    int cols   = std::max(1, static_cast<int>(std::ceil(size.width  / cell)));
+    int rows   = std::max(1, static_cast<int>(std::ceil(size.height / cell)));
+
+    std::vector<std::vector<cv::KeyPoint>> cells(cols * rows);
+
+    for (const cv::KeyPoint& keypoint : keypoints) {
+        int cx = std::min(cols - 1, std::max(0, static_cast<int>(keypoint.pt.x / cell)));
+        int cy = std::min(rows - 1, std::max(0, static_cast<int>(keypoint.pt.y / cell)));
+        cells[cy * cols + cx].push_back(keypoint);
+    }
+
+    // Fill the sparsest cells first, each takes at most an even share of what is left
+    std::sort(cells.begin(), cells.end(), [](const std::vector<cv::KeyPoint>& a, const std::vector<cv::KeyPoint>& b) {
+        return a.size() < b.size();
+    });
+
+    keypoints.clear();
+
+    int remaining = budget;
+
+    for (std::size_t c = 0; c < cells.size(); ++c) {
+        int share = remaining / static_cast<int>(cells.size() - c);
+        int take  = std::min(static_cast<int>(cells[c].size()), share);
+
+        cv::KeyPointsFilter::retainBest(cells[c], take);
+        cells[c].resize(std::min(cells[c].size(), static_cast<std::size_t>(take)));
+        keypoints.insert(keypoints.end(), cells[c].begin(), cells[c].end());
+
+        remaining -= static_cast<int>(cells[c].size());
+    }
+}
+
+/**
+ * Registers the images coarse to fine. Thumbnails of about 0.05 MP are matched
+ * first to find which images overlap and roughly how. Features at registration
+ * resolution are then only detected inside the predicted overlaps and only matched
+ * against keypoints near their predicted position, so most of the detection and
+ * matching work of a flat registration never happens.
+ * 
+ * @param images input images
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest connected set of images
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool registerCoarseToFine(const std::vector<Image>& images, const Settings& settings, Registration& registration) {
+    int num_images      = static_cast<int>(images.size());
+    double work_scale   = scaleForResolution(images[0], settings.registration_resol);
+    double coarse_scale = std::min(work_scale, scaleForResolution(images[0], settings.coarse_resol));
+    float conf_thresh   = static_cast<float>(settings.confidence_thresh);
+
+    std::vector<cv::detail::ImageFeatures> coarse_features;
+    findFeatures(images, coarse_scale, settings, coarse_features);
+
+    std::vector<cv::detail::MatchesInfo> coarse_matches;
+    cv::Ptr<cv::detail::FeaturesMatcher> coarse_matcher = createMatcher(settings);
+    (*coarse_matcher)(coarse_features, coarse_matches);
+    coarse_matcher->collectGarbage();
+
+    std::vector<Image> masks;
+    predictOverlaps(coarse_matches, images, coarse_scale, work_scale, conf_thresh, masks);
+
+    double searched = 0;
+
+    for (const Image& mask : masks) {
+        searched += static_cast<double>(cv::countNonZero(mask)) / mask.total();
+    }
+
+    std::cout << CYAN;
+    std::cout << "Detecting features in " << cvRound(100 * searched / num_images) << "% of the image area..." << std::endl;
+
+    std::vector<cv::detail::ImageFeatures> features;
+    findFeatures(images, work_scale, settings, features, masks);
+
+    // Guided matching of the pairs which overlap at coarse scale
+    std::vector<cv::detail::MatchesInfo> pairwise_matches(num_images * num_images);
+    std::vector<std::pair<int, int>> pairs;
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = 0; j < num_images; ++j) {
+            pairwise_matches[i * num_images + j].src_img_idx = i;
+            pairwise_matches[i * num_images + j].dst_img_idx = j;
+
+            if ( i < j && coarse_matches[i * num_images + j].confidence > conf_thresh ) {
+                pairs.push_back({i, j});
+            }
+        }
+    }
+
+    float radius  = static_cast<float>(0.02 * std::hypot(images[0].cols, images[0].rows) * work_scale);
+    double refine = work_scale / coarse_scale;
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(pairs.size())), [&](const cv::Range& range) {
+        for (int p = range.start; p < range.end; ++p) {
+            int i = pairs[p].first, j = pairs[p].second;
+
+            // Homographies are in image centred coordinates, which scale linearly
+            cv::Mat_<double> S = cv::Mat_<double>::eye(3, 3);
+            S(0, 0) = S(1, 1) = refine;
+            cv::Mat H = S * coarse_matches[i * num_images + j].H * S.inv();
+
+            std::vector<cv::DMatch> matches;
+            guidedMatch(features[i], features[j], H, radius, matches);
+
+            if ( verifyMatches(features[i], features[j], matches, pairwise_matches[i * num_images + j], settings.ransac) ) {
+                fillDualMatches(pairwise_matches, i, j, num_images);
+            }
+        }
+    });
+
+    return estimateCameras(features, pairwise_matches, work_scale, settings, registration);
+}
+
+/**
+ * Registers images whose rotations are known from a pan head or IMU. The poses
+ * predict which images overlap and by which homography, so only the overlapping
+ * pairs are matched, features are only detected inside the predicted overlaps,
+ * and keypoints are only compared within the pose tolerance of their predicted
+ * position. The poses also seed camera estimation. Without a known focal length,
+ * neighbouring shots are assumed to overlap by half.
+ * 
+ * @param images input images
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest connected set of images
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool registerPosePrior(const std::vector<Image>& images, const Settings& settings, Registration& registration) {
+    int num_images    = static_cast<int>(images.size());
+    double work_scale = scaleForResolution(images[0], settings.registration_resol);
+    float conf_thresh = static_cast<float>(settings.confidence_thresh);
+
+    std::vector<cv::Matx33d> rotations;
+
+    for (const cv::Vec3d& pose : settings.pose_priors) {
+        rotations.push_back(poseRotation(pose));
+    }
+
+    // Focal length at registration scale
+    std::vector<double> known;
+
+    for (double prior : settings.focal_priors) {
+        if ( prior > 0 ) {
+            known.push_back(prior * work_scale);
+        }
+    }
+
+    double focal = 0;
+
+    if ( ! known.empty() ) {
+        std::nth_element(known.begin(), known.begin() + known.size() / 2, known.end());
+        focal = known[known.size() / 2];
+    }
+    else {
+        // Median angle to the nearest shot spans half the field of view
+        std::vector<double> spacing;
+
+        for (int i = 0; i < num_images; ++i) {
+            double nearest = CV_PI;
+
+            for (int j = 0; j < num_images; ++j) {
+                cv::Matx33d relative = rotations[i].t() * rotations[j];
+                double angle = std::acos(std::min(1., std::max(-1., relative(2, 2))));
+
+                if ( i != j && angle > 1e-3 ) {
+                    nearest = std::min(nearest, angle);
+                }
+            }
+
+            spacing.push_back(nearest);
+        }
+
+        std::nth_element(spacing.begin(), spacing.begin() + spacing.size() / 2, spacing.end());
+        double fov = std::min(0.9 * CV_PI, 2 * spacing[spacing.size() / 2]);
+        focal = 0.5 * std::max(images[0].cols, images[0].rows) * work_scale / std::tan(0.5 * fov);
+    }
+
+    cv::Matx33d K(focal, 0, 0, 0, focal, 0, 0, 0, 1);
+    cv::Matx33d K_inv(1. / focal, 0, 0, 0, 1. / focal, 0, 0, 0, 1);
+
+    // Predicted homographies of the pairs whose footprints overlap, image centred
+    std::vector<cv::detail::MatchesInfo> predicted(num_images * num_images);
+    std::vector<std::pair<int, int>> pairs;
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images; ++j) {
+            cv::Matx33d H = K * rotations[j].t() * rotations[i] * K_inv;
+
+            cv::Size2f half_i(images[i].cols * work_scale * 0.5f, images[i].rows * work_scale * 0.5f);
+            cv::Size2f half_j(images[j].cols * work_scale * 0.5f, images[j].rows * work_scale * 0.5f);
+            std::vector<cv::Point2f> footprint, frame {
+                {-half_j.width, -half_j.height}, {half_j.width, -half_j.height},
+                {half_j.width, half_j.height}, {-half_j.width, half_j.height}
+            };
+
+            // Corners behind camera j mean the images face apart
+            bool visible = true;
+
+            for (float y : {-half_i.height, half_i.height}) {
+                for (float x : {-half_i.width, half_i.width}) {
+                    cv::Point3d p = H * cv::Point3d(x, y, 1.);
+                    visible &= p.z > 0;
+                    footprint.push_back(cv::Point2f(static_cast<float>(p.x / p.z), static_cast<float>(p.y / p.z)));
+                }
+            }
+
+            std::swap(footprint[2], footprint[3]);
+            std::vector<cv::Point2f> overlap;
+
+            if ( ! visible || cv::intersectConvexConvex(footprint, frame, overlap) <= 0 ) {
+                continue;
+            }
+
+            pairs.push_back({i, j});
+
+            predicted[i * num_images + j].H = cv::Mat(H);
+            predicted[j * num_images + i].H = cv::Mat(H.inv());
+            predicted[i * num_images + j].confidence = predicted[j * num_images + i].confidence = conf_thresh + 1;
+        }
+    }
+
+    std::cout << CYAN;
+    std::cout << "Matching " << pairs.size() << " of " << num_images * (num_images - 1) / 2
+              << " pairs predicted to overlap..." << std::endl;
+
+    std::vector<Image> masks;
+    predictOverlaps(predicted, images, work_scale, work_scale, conf_thresh, masks);
+
+    std::vector<cv::detail::ImageFeatures> features;
+    findFeatures(images, work_scale, settings, features, masks);
+
+    std::vector<cv::detail::MatchesInfo> pairwise_matches(num_images * num_images);
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = 0; j < num_images; ++j) {
+            pairwise_matches[i * num_images + j].src_img_idx = i;
+            pairwise_matches[i * num_images + j].dst_img_idx = j;
+        }
+    }
+
+    // Pose errors move keypoints by about focal * tan(tolerance)
+    float radius = static_cast<float>(std::max(3., focal * std::tan(settings.pose_tolerance * CV_PI / 180.)));
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(pairs.size())), [&](const cv::Range& range) {
+        for (int p = range.start; p < range.end; ++p) {
+            int i = pairs[p].first, j = pairs[p].second;
+
+            std::vector<cv::DMatch> matches;
+            guidedMatch(features[i], features[j], predicted[i * num_images + j].H, radius, matches);
+
+            if ( verifyMatches(features[i], features[j], matches, pairwise_matches[i * num_images + j], settings.ransac) ) {
+                fillDualMatches(pairwise_matches, i, j, num_images);
+            }
+        }
+    });
+
+    return estimateCameras(features, pairwise_matches, work_scale, settings, registration);
+}
+
+/**
+ * Rotation of a camera from its pose, yaw to the right, then pitch up, then roll,
+ * in the camera convention of the stitching module (x right, y down, z forward).
+ * 
+ * @param pose yaw, pitch and roll in degrees
+ * 
+ * @return camera rotation
+ */
+cv::Matx33d poseRotation(const cv::Vec3d& pose) {
+    double yaw = pose[0] * CV_PI / 180., pitch = pose[1] * CV_PI / 180., roll = pose[2] * CV_PI / 180.;
+
+    cv::Matx33d R_yaw(std::cos(yaw), 0, std::sin(yaw), 0, 1, 0, -std::sin(yaw), 0, std::cos(yaw));
+    cv::Matx33d R_pitch(1, 0, 0, 0, std::cos(pitch), -std::sin(pitch), 0, std::sin(pitch), std::cos(pitch));
+    cv::Matx33d R_roll(std::cos(roll), -std::sin(roll), 0, std::sin(roll), std::cos(roll), 0, 0, 0, 1);
+
+    return R_yaw * R_pitch * R_roll;
+}
+
+/**
+ * Registers mostly translational inputs, such as tripod pans and flatbed scans, by
+ * phase correlation. Neighbouring images in capture order are correlated at
+ * registration resolution, and every confident shift is turned into a grid of exact
+ * correspondences over the overlap. Features are only detected and matched for the
+ * pairs whose correlation peak is too weak. Cameras are then estimated and bundle
+ * adjusted as usual.
+ * 
+ * @param images input images
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest connected set of images
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool registerPhaseCorrelation(const std::vector<Image>& images, const Settings& settings, Registration& registration) {
+    int num_images    = static_cast<int>(images.size());
+    double work_scale = scaleForResolution(images[0], settings.registration_resol);
+
+    std::vector<Image> work_images(num_images);
+    std::vector<cv::detail::ImageFeatures> features(num_images);
+
+    for (int i = 0; i < num_images; ++i) {
+        Image gray;
+        cv::cvtColor(images[i], gray, cv::COLOR_BGR2GRAY);
+        cv::resize(gray, gray, cv::Size(), work_scale, work_scale, cv::INTER_AREA);
+        gray.convertTo(work_images[i], CV_32F);
+
+        features[i].img_idx  = i;
+        features[i].img_size = work_images[i].size();
+    }
+
+    std::vector<std::pair<int, int>> pairs;
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images && j - i <= settings.match_range; ++j) {
+            pairs.push_back({i, j});
+        }
+    }
+
+    std::vector<cv::Point2d> shifts(pairs.size());
+    std::vector<double> responses(pairs.size());
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(pairs.size())), [&](const cv::Range& range) {
+        for (int p = range.start; p < range.end; ++p) {
+            responses[p] = correlatePair(work_images[pairs[p].first], work_images[pairs[p].second], shifts[p]);
+        }
+    });
+
+    std::vector<cv::detail::MatchesInfo> pairwise_matches(num_images * num_images);
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = 0; j < num_images; ++j) {
+            pairwise_matches[i * num_images + j].src_img_idx = i;
+            pairwise_matches[i * num_images + j].dst_img_idx = j;
+        }
+    }
+
+    // Weak peaks mean rotation, scale or parallax, those pairs fall back to features
+    std::vector<std::size_t> fallback;
+
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        if ( responses[p] < settings.phase_response_thresh ) {
+            fallback.push_back(p);
+        }
+    }
+
+    std::cout << CYAN;
+    std::cout << pairs.size() - fallback.size() << " of " << pairs.size()
+              << " pairs registered by phase correlation" << std::endl;
+
+    if ( ! fallback.empty() ) {
+        std::vector<cv::detail::ImageFeatures> detected;
+        findFeatures(images, work_scale, settings, detected);
+
+        cv::Ptr<cv::detail::FeaturesMatcher> matcher = createMatcher(settings);
+
+        for (std::size_t p : fallback) {
+            int i = pairs[p].first, j = pairs[p].second;
+            (*matcher)(detected[i], detected[j], pairwise_matches[i * num_images + j]);
+            pairwise_matches[i * num_images + j].src_img_idx = i;
+            pairwise_matches[i * num_images + j].dst_img_idx = j;
+            fillDualMatches(pairwise_matches, i, j, num_images);
+        }
+
+        matcher->collectGarbage();
+
+        // Correspondences from phase correlation are appended after the detected keypoints
+        for (int i = 0; i < num_images; ++i) {
+            features[i].keypoints = detected[i].keypoints;
+        }
+    }
+
+    for (std::size_t p = 0; p < pairs.size(); ++p) {
+        int i = pairs[p].first, j = pairs[p].second;
+
+        if ( responses[p] >= settings.phase_response_thresh
+          && translationMatches(features[i], features[j], shifts[p], pairwise_matches[i * num_images + j]) ) {
+            fillDualMatches(pairwise_matches, i, j, num_images);
+        }
+    }
+
+    return estimateCameras(features, pairwise_matches, work_scale, settings, registration);
+}
+
+/**
+ * Phase correlates two grayscale images with a Hann window and sub-pixel peak
+ * refinement. Images of different sizes are zero padded to a common size. The peak
+ * only gives the shift modulo that size, so a pan overlapping by less than half an
+ * image would wrap around to a small shift with a large overlap. Every wrap of the
+ * peak is therefore checked, and the one whose overlap correlates best is kept.
+ * 
+ * @param image1 first CV_32F image
+ * @param image2 second CV_32F image
+ * @param shift shift d such that image1(p) matches image2(p + d)
+ * 
+ * @return response of the correlation peak, from 0 for no match to 1
+ */
+double correlatePair(const Image& image1, const Image& image2, cv::Point2d& shift) {
+    cv::Size size(std::max(image1.cols, image2.cols), std::max(image1.rows, image2.rows));
+
+    Image padded1, padded2, window;
+    cv::copyMakeBorder(image1, padded1, 0, size.height - image1.rows, 0, size.width - image1.cols, cv::BORDER_CONSTANT);
+    cv::copyMakeBorder(image2, padded2, 0, size.height - image2.rows, 0, size.width - image2.cols, cv::BORDER_CONSTANT);
+    cv::createHanningWindow(window, size, CV_32F);
+
+    double response = 0;
+    cv::Point2d peak = cv::phaseCorrelate(padded1, padded2, window, &response);
+
+    // Overlaps below the area translationMatches() accepts are never picked
+    double min_area = 0.1 * std::min(image1.size().area(), image2.size().area());
+    double best     = -1;
+    shift = peak;
+
+    for (int wy = -1; wy <= 1; ++wy) {
+        for (int wx = -1; wx <= 1; ++wx) {
+            cv::Point2d candidate(peak.x + wx * size.width, peak.y + wy * size.height);
+            cv::Point d(cvRound(candidate.x), cvRound(candidate.y));
+
+            cv::Rect overlap = cv::Rect(cv::Point(), image1.size()) & cv::Rect(-d, image2.size());
+
+            if ( overlap.area() < min_area ) {
+                continue;
+            }
+
+            double ncc = overlapCorrelation(image1, image2, d);
+
+            if ( ncc > best ) {
+                best  = ncc;
+                shift = candidate;
+            }
+        }
+    }
+
+    return best > 0 ? response : 0;
+}
+
+/**
+ * Normalised cross correlation of two images over their overlap under a shift.
+ * 
+ * @param image1 first CV_32F image
+ * @param image2 second CV_32F image
+ * @param d shift such that image1(p) matches image2(p + d)
+ * 
+ * @return correlation of the overlapping pixels, from -1 to 1, 0 without overlap
+ */
+double overlapCorrelation(const Image& image1, const Image& image2, cv::Point d) {
+    cv::Rect overlap = cv::Rect(cv::Point(), image1.size()) & cv::Rect(-d, image2.size());
+
+    if ( overlap.empty() ) {
+        return 0;
+    }
+
+    cv::Mat a = image1(overlap), b = image2(overlap + d);
+    cv::Scalar mean_a, stddev_a, mean_b, stddev_b;
+    cv::meanStdDev(a, mean_a, stddev_a);
+    cv::meanStdDev(b, mean_b, stddev_b);
+
+    if ( stddev_a[0] <= 0 || stddev_b[0] <= 0 ) {
+        return 0;
+    }
+
+    Image centred_a, centred_b;
+    cv::subtract(a, mean_a, centred_a);
+    cv::subtract(b, mean_b, centred_b);
+
+    return centred_a.dot(centred_b) / (overlap.area() * stddev_a[0] * stddev_b[0]);
+}
+
+/**
+ * Turns a translation between two images into a grid of exact correspondences over
+ * their overlap. The keypoints are appended to both images, and the matches carry
+ * the translation as their homography in image centred coordinates, so that camera
+ * estimation and bundle adjustment treat them like verified feature matches.
+ * 
+ * @param features1 features of the first image, keypoints are appended
+ * @param features2 features of the second image, keypoints are appended
+ * @param shift shift d such that image1(p) matches image2(p + d)
+ * @param matches_info matches from the first to the second image
+ * 
+ * @return false if the images overlap too little for the shift to be trusted
+ */
+bool translationMatches(cv::detail::ImageFeatures& features1, cv::detail::ImageFeatures& features2,
+                        cv::Point2d shift, cv::detail::MatchesInfo& matches_info) {
+    const int grid = 10;
+
+    cv::Point2f d(static_cast<float>(shift.x), static_cast<float>(shift.y));
+    cv::Rect2f overlap = cv::Rect2f(cv::Point2f(0, 0), cv::Size2f(features1.img_size))
+                       & cv::Rect2f(-d, cv::Size2f(features2.img_size));
+
+    double min_area = 0.1 * std::min(features1.img_size.area(), features2.img_size.area());
+
+    if ( overlap.area() < min_area ) {
+        return false;
+    }
+
+    matches_info.matches.clear();
+    matches_info.inliers_mask.clear();
+
+    for (int y = 0; y < grid; ++y) {
+        for (int x = 0; x < grid; ++x) {
+            cv::Point2f p1(overlap.x + overlap.width  * (x + 0.5f) / grid,
+                           overlap.y + overlap.height * (y + 0.5f) / grid);
+
+            matches_info.matches.push_back(cv::DMatch(static_cast<int>(features1.keypoints.size()),
+                                                      static_cast<int>(features2.keypoints.size()), 0.f));
+            matches_info.inliers_mask.push_back(1);
+
+            features1.keypoints.push_back(cv::KeyPoint(p1, 1.f));
+            features2.keypoints.push_back(cv::KeyPoint(p1 + d, 1.f));
+        }
+    }
+
+    cv::Point2f centre1(features1.img_size.width * 0.5f, features1.img_size.height * 0.5f);
+    cv::Point2f centre2(features2.img_size.width * 0.5f, features2.img_size.height * 0.5f);
+    cv::Point2f t = d + centre1 - centre2;
+
+    matches_info.H = (cv::Mat_<double>(3, 3) << 1, 0, t.x, 0, 1, t.y, 0, 0, 1);
+    matches_info.num_inliers = grid * grid;
+    matches_info.confidence  = matches_info.num_inliers / (8 + 0.3 * matches_info.matches.size());
+
+    return true;
+}
+
+/**
+ * Predicts where every image overlaps the others from coarse pairwise homographies.
+ * The outline of each overlapping image is projected into the image and filled,
+ * with a margin for the error of the coarse estimate.
+ * 
+ * @param coarse_matches pairwise matches at coarse scale
+ * @param images input images
+ * @param coarse_scale scale of the coarse matches
+ * @param work_scale registration scale of the masks
+ * @param conf_thresh confidence above which a pair is considered overlapping
+ * @param masks detection masks at registration scale, one per image
+ */
+void predictOverlaps(const std::vector<cv::detail::MatchesInfo>& coarse_matches, const std::vector<Image>& images,
+                     double coarse_scale, double work_scale, float conf_thresh, std::vector<Image>& masks) {
+    int num_images = static_cast<int>(images.size());
+    double refine  = work_scale / coarse_scale;
+
+    masks.resize(num_images);
+
+    for (int i = 0; i < num_images; ++i) {
+        cv::Size size(cvRound(images[i].cols * work_scale), cvRound(images[i].rows * work_scale));
+        masks[i] = Image::zeros(size, CV_8U);
+
+        for (int j = 0; j < num_images; ++j) {
+            const cv::detail::MatchesInfo& matches = coarse_matches[j * num_images + i];
+
+            if ( i == j || matches.confidence <= conf_thresh || matches.H.empty() ) {
+                continue;
+            }
+
+            // Corners of image j in centred coarse coordinates, projected into image i
+            cv::Size2f half(images[j].cols * coarse_scale * 0.5f, images[j].rows * coarse_scale * 0.5f);
+            std::vector<cv::Point2f> corners {
+                {-half.width, -half.height}, {half.width, -half.height},
+                {half.width, half.height}, {-half.width, half.height}
+            };
+            std::vector<cv::Point2f> projected;
+            cv::perspectiveTransform(corners, projected, matches.H);
+
+            std::vector<cv::Point> outline;
+
+            for (const cv::Point2f& corner : projected) {
+                outline.push_back(cv::Point(cvRound(corner.x * refine + size.width * 0.5),
+                                            cvRound(corner.y * refine + size.height * 0.5)));
+            }
+
+            cv::fillConvexPoly(masks[i], outline, cv::Scalar::all(255));
+        }
+
+        int margin = std::max(3, cvRound(0.05 * std::max(size.width, size.height)));
+        cv::dilate(masks[i], masks[i], cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * margin + 1, 2 * margin + 1)));
+    }
+}
+
+/**
+ * Matches the descriptors of two images, guided by a predicted homography. Each
+ * keypoint of the first image is only compared with the keypoints of the second
+ * image within a radius of its predicted position, and kept if it passes the same
+ * nearest neighbour ratio test as cv::detail::BestOf2NearestMatcher.
+ * 
+ * @param features1 features of the first image
+ * @param features2 features of the second image
+ * @param H predicted homography from the first to the second image, image centred
+ * @param radius search radius around the predicted position
+ * @param matches resulting matches, query indices refer to the first image
+ */
+void guidedMatch(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                 const cv::Mat& H, float radius, std::vector<cv::DMatch>& matches) {
+    const float match_conf = 0.3f;
+
+    matches.clear();
+
+    if ( features1.keypoints.empty() || features2.keypoints.empty() ) {
+        return;
+    }
+
+    cv::Mat descriptors1 = features1.descriptors.getMat(cv::ACCESS_READ);
+    cv::Mat descriptors2 = features2.descriptors.getMat(cv::ACCESS_READ);
+    bool binary = descriptors1.depth() == CV_8U;
+
+    // Bucket the keypoints of the second image in cells of the search radius
+    int cols = static_cast<int>(features2.img_size.width / radius) + 1;
+    int rows = static_cast<int>(features2.img_size.height / radius) + 1;
+    std::vector<std::vector<int>> cells(cols * rows);
+
+    for (std::size_t k = 0; k < features2.keypoints.size(); ++k) {
+        const cv::Point2f& point = features2.keypoints[k].pt;
+        int cx = std::min(cols - 1, std::max(0, static_cast<int>(point.x / radius)));
+        int cy = std::min(rows - 1, std::max(0, static_cast<int>(point.y / radius)));
+        cells[cy * cols + cx].push_back(static_cast<int>(k));
+    }
+
+    std::vector<cv::Point2f> points, predicted;
+
+    for (const cv::KeyPoint& keypoint : features1.keypoints) {
+        points.push_back(cv::Point2f(keypoint.pt.x - features1.img_size.width * 0.5f,
+                                     keypoint.pt.y - features1.img_size.height * 0.5f));
+    }
+
+    cv::perspectiveTransform(points, predicted, H);
+
+    for (std::size_t q = 0; q < predicted.size(); ++q) {
+        cv::Point2f target(predicted[q].x + features2.img_size.width * 0.5f,
+                           predicted[q].y + features2.img_size.height * 0.5f);
+
+        int cx = static_cast<int>(std::floor(target.x / radius));
+        int cy = static_cast<int>(std::floor(target.y / radius));
+
+        int best = -1;
+        float best_distance = FLT_MAX, second_distance = FLT_MAX;
+
+        for (int y = std::max(0, cy - 1); y <= std::min(rows - 1, cy + 1); ++y) {
+            for (int x = std::max(0, cx - 1); x <= std::min(cols - 1, cx + 1); ++x) {
+                for (int t : cells[y * cols + x]) {
+                    cv::Point2f offset = features2.keypoints[t].pt - target;
+
+                    if ( offset.dot(offset) > radius * radius ) {
+                        continue;
+                    }
+
+                    float distance = binary
+                        ? static_cast<float>(cv::hal::normHamming(descriptors1.ptr<uchar>(static_cast<int>(q)),
+                                                                  descriptors2.ptr<uchar>(t), descriptors1.cols))
+                        : static_cast<float>(cv::norm(descriptors1.row(static_cast<int>(q)), descriptors2.row(t), cv::NORM_L2));
+
+                    if ( distance < best_distance ) {
+                        second_distance = best_distance;
+                        best_distance   = distance;
+                        best            = t;
+                    }
+                    else if ( distance < second_distance ) {
+                        second_distance = distance;
+                    }
+                }
+            }
+        }
+
+        if ( best >= 0 && (second_distance == FLT_MAX || best_distance < (1.f - match_conf) * second_distance) ) {
+            matches.push_back(cv::DMatch(static_cast<int>(q), best, best_distance));
+        }
+    }
+}
+
+/**
+ * Verifies putative matches between two images with a RANSAC homography, the same
+ * way cv::detail::BestOf2NearestMatcher does: image centred coordinates, confidence
+ * of inliers / (8 + 0.3 * matches), and a final homography over the inliers only.
+ * The RANSAC stage samples matches in order of descriptor distance (PROSAC). With
+ * a rotation only model the homography is the one induced by the camera rotation.
+ * 
+ * @param features1 features of the first image
+ * @param features2 features of the second image
+ * @param matches putative matches, query indices refer to the first image
+ * @param matches_info verified matches from the first to the second image
+ * @param params model and limits of the RANSAC stage
+ * 
+ * @return true if a homography was found
+ */
+bool verifyMatches(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                   const std::vector<cv::DMatch>& matches, cv::detail::MatchesInfo& matches_info,
+                   const RansacParams& params) {
+    const std::size_t min_matches = 6;
+
+    matches_info.matches = matches;
+    matches_info.num_inliers = 0;
+    matches_info.confidence  = 0;
+    matches_info.inliers_mask.clear();
+    matches_info.H.release();
+
+    if ( matches.size() < min_matches ) {
+        return false;
+    }
+
+    // Best matches first, so PROSAC draws its early samples from them
+    std::vector<int> order(matches.size());
+
+    for (std::size_t m = 0; m < matches.size(); ++m) {
+        order[m] = static_cast<int>(m);
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&matches](int a, int b) {
+        return matches[a].distance < matches[b].distance;
+    });
+
+    std::vector<cv::Point2f> src_points(matches.size()), dst_points(matches.size());
+    std::vector<cv::Point2f> src_sorted(matches.size()), dst_sorted(matches.size());
+
+    for (std::size_t m = 0; m < matches.size(); ++m) {
+        cv::Point2f p1 = features1.keypoints[matches[m].queryIdx].pt;
+        cv::Point2f p2 = features2.keypoints[matches[m].trainIdx].pt;
+        src_points[m] = cv::Point2f(p1.x - features1.img_size.width * 0.5f, p1.y - features1.img_size.height * 0.5f);
+        dst_points[m] = cv::Point2f(p2.x - features2.img_size.width * 0.5f, p2.y - features2.img_size.height * 0.5f);
+    }
+
+    for (std::size_t m = 0; m < matches.size(); ++m) {
+        src_sorted[m] = src_points[order[m]];
+        dst_sorted[m] = dst_points[order[m]];
+    }
+
+    std::vector<uchar> sorted_mask;
+    matches_info.H = params.rotation_only ? findRotationProsac(src_sorted, dst_sorted, params, sorted_mask)
+                                          : findHomographyProsac(src_sorted, dst_sorted, params, sorted_mask);
+    matches_info.inliers_mask.assign(matches.size(), 0);
+
+    for (std::size_t m = 0; m < sorted_mask.size(); ++m) {
+        matches_info.inliers_mask[order[m]] = sorted_mask[m];
+    }
+
+    if ( matches_info.H.empty() || std::abs(cv::determinant(matches_info.H)) < std::numeric_limits<double>::epsilon() ) {
+        matches_info.H.release();
+        return false;
+    }
+
+    matches_info.num_inliers = cv::countNonZero(matches_info.inliers_mask);
+
+    // Too high a confidence means the images are nearly identical
+    matches_info.confidence = matches_info.num_inliers / (8 + 0.3 * matches.size());
+    matches_info.confidence = matches_info.confidence > 3. ? 0. : matches_info.confidence;
+
+    // Rotations are already refined over their inliers
+    if ( static_cast<std::size_t>(matches_info.num_inliers) < min_matches || params.rotation_only ) {
+        return true;
+    }
+
+    std::vector<cv::Point2f> src_inliers, dst_inliers;
+
+    for (std::size_t m = 0; m < matches.size(); ++m) {
+        if ( matches_info.inliers_mask[m] ) {
+            src_inliers.push_back(src_points[m]);
+            dst_inliers.push_back(dst_points[m]);
+        }
+    }
+
+    matches_info.H = cv::findHomography(src_inliers, dst_inliers, cv::RANSAC);
+
+    return ! matches_info.H.empty();
+}
+
+/**
+ * Counts the correspondences a homography maps within the reprojection threshold.
+ * Points are scored in batches of SIMD lanes, and scoring stops as soon as the
+ * remaining points can no longer beat the best model so far.
+ * 
+ * @param H homography from the source to the destination points
+ * @param x1 source x coordinates
+ * @param y1 source y coordinates
+ * @param x2 destination x coordinates
+ * @param y2 destination y coordinates
+ * @param count number of correspondences
+ * @param threshold reprojection threshold in pixels
+ * @param to_beat inlier count of the best model so far
+ * 
+ * @return number of inliers, or -1 once the model can't beat to_beat
+ */
+static int countInliers(const cv::Matx33f& H, const float* x1, const float* y1, const float* x2, const float* y2,
+                        int count, float threshold, int to_beat) {
+    const int batch = 64;
+    float threshold2 = threshold * threshold;
+    int inliers = 0;
+
+    for (int start = 0; start < count; start += batch) {
+        int end = std::min(count, start + batch), i = start;
+
+        // Even if every remaining point were an inlier
+        if ( inliers + count - start <= to_beat ) {
+            return -1;
+        }
+
+#if CV_SIMD || CV_SIMD_SCALABLE
+        const int lanes = cv::VTraits<cv::v_float32>::vlanes();
+
+        cv::v_float32 h0 = cv::vx_setall_f32(H(0, 0)), h1 = cv::vx_setall_f32(H(0, 1)), h2 = cv::vx_setall_f32(H(0, 2));
+        cv::v_float32 h3 = cv::vx_setall_f32(H(1, 0)), h4 = cv::vx_setall_f32(H(1, 1)), h5 = cv::vx_setall_f32(H(1, 2));
+        cv::v_float32 h6 = cv::vx_setall_f32(H(2, 0)), h7 = cv::vx_setall_f32(H(2, 1)), h8 = cv::vx_setall_f32(H(2, 2));
+        cv::v_float32 limit = cv::vx_setall_f32(threshold2), one = cv::vx_setall_f32(1.f), zero = cv::vx_setzero_f32();
+        cv::v_float32 sum = zero;
+
+        for (; i + lanes <= end; i += lanes) {
+            cv::v_float32 x = cv::vx_load(x1 + i), y = cv::vx_load(y1 + i);
+            cv::v_float32 w = cv::v_muladd(h6, x, cv::v_muladd(h7, y, h8));
+            cv::v_float32 dx = cv::v_sub(cv::v_div(cv::v_muladd(h0, x, cv::v_muladd(h1, y, h2)), w), cv::vx_load(x2 + i));
+            cv::v_float32 dy = cv::v_sub(cv::v_div(cv::v_muladd(h3, x, cv::v_muladd(h4, y, h5)), w), cv::vx_load(y2 + i));
+            sum = cv::v_add(sum, cv::v_select(cv::v_le(cv::v_muladd(dx, dx, cv::v_mul(dy, dy)), limit), one, zero));
+        }
+
+        inliers += cv::saturate_cast<int>(cv::v_reduce_sum(sum));
+#endif
+
+        for (; i < end; ++i) {
+            float w  = H(2, 0) * x1[i] + H(2, 1) * y1[i] + H(2, 2);
+            float dx = (H(0, 0) * x1[i] + H(0, 1) * y1[i] + H(0, 2)) / w - x2[i];
+            float dy = (H(1, 0) * x1[i] + H(1, 1) * y1[i] + H(1, 2)) / w - y2[i];
+            inliers += dx * dx + dy * dy <= threshold2;
+        }
+    }
+
+    return inliers;
+}
+
+/**
+ * Runs PROSAC over correspondences sorted best first. Minimal samples are drawn
+ * from a growing set of the top correspondences, so a good model is usually found
+ * within the first few iterations when the best matches are reliable, and the
+ * sampling becomes plain RANSAC once the set covers all of them. Iterations stop as
+ * soon as the inlier ratio of the best model makes a better one unlikely at 99.5%
+ * confidence, as in cv::findHomography, or when the iteration or time cap is reached.
+ * 
+ * @param src_points source points, best correspondences first
+ * @param dst_points destination points
+ * @param params iteration and time caps
+ * @param sample_size number of correspondences the solver needs
+ * @param solve minimal solver, any number of models per sample
+ * @param best_model homography of the best model
+ * @param inliers_mask inlier flag of each correspondence under the best model
+ * 
+ * @return true if a model was found
+ */
+bool prosac(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points, const RansacParams& params,
+            int sample_size, const MinimalSolver& solve, cv::Matx33f& best_model, std::vector<uchar>& inliers_mask) {
+    const double confidence = 0.995;
+    const float threshold   = 3.f;
+
+    int count = static_cast<int>(src_points.size());
+    inliers_mask.assign(count, 0);
+
+    if ( count < sample_size ) {
+        return false;
+    }
+
+    // Struct of arrays for vectorised scoring
+    std::vector<float> x1(count), y1(count), x2(count), y2(count);
+
+    for (int i = 0; i < count; ++i) {
+        x1[i] = src_points[i].x;
+        y1[i] = src_points[i].y;
+        x2[i] = dst_points[i].x;
+        y2[i] = dst_points[i].y;
+    }
+
+    // PROSAC growth function, T_n is the expected number of samples drawn only
+    // from the top n correspondences out of max_iters standard RANSAC samples
+    int n = sample_size;
+    double T_n = params.max_iters;
+
+    for (int i = 0; i < sample_size; ++i) {
+        T_n *= static_cast<double>(n - i) / (count - i);
+    }
+
+    int T_n_prime = 1;
+    int max_iters = params.max_iters;
+    int best_inliers = std::max(sample_size, 4) - 1;
+    bool found = false;
+
+    std::vector<int> sample(sample_size);
+    std::vector<cv::Point2f> src(sample_size), dst(sample_size);
+    std::vector<cv::Matx33d> models;
+
+    cv::RNG rng;
+    std::int64_t start = cv::getTickCount();
+
+    for (int t = 1; t <= max_iters; ++t) {
+        if ( params.max_ms > 0 && (cv::getTickCount() - start) * 1000. / cv::getTickFrequency() > params.max_ms ) {
+            break;
+        }
+
+        if ( t > T_n_prime && n < count ) {
+            double T_n_next = T_n * (n + 1) / (n + 1 - sample_size);
+            T_n_prime += static_cast<int>(std::ceil(T_n_next - T_n));
+            T_n = T_n_next;
+            ++n;
+        }
+
+        // Either n-th correspondence plus the rest from the top n - 1, or all from the top n
+        int drawn = 0, pool = n;
+
+        if ( T_n_prime >= t ) {
+            sample[drawn++] = n - 1;
+            pool = n - 1;
+        }
+
+        while ( drawn < sample_size ) {
+            int candidate = rng.uniform(0, pool);
+
+            if ( std::find(sample.begin(), sample.begin() + drawn, candidate) == sample.begin() + drawn ) {
+                sample[drawn++] = candidate;
+            }
+        }
+
+        for (int k = 0; k < sample_size; ++k) {
+            src[k] = src_points[sample[k]];
+            dst[k] = dst_points[sample[k]];
+        }
+
+        models.clear();
+        solve(src.data(), dst.data(), models);
+
+        for (const cv::Matx33d& model : models) {
+            cv::Matx33f H = model;
+            int inliers = countInliers(H, x1.data(), y1.data(), x2.data(), y2.data(), count, threshold, best_inliers);
+
+            if ( inliers > best_inliers ) {
+                best_inliers = inliers;
+                best_model = H;
+                found = true;
+
+                // Iterations needed to draw one all inlier sample with the given confidence
+                double w = std::pow(static_cast<double>(inliers) / count, sample_size);
+                double needed = w >= 1. ? 0. : std::log(1. - confidence) / std::log(1. - w);
+                max_iters = std::min(max_iters, static_cast<int>(std::ceil(std::max(needed, 0.))));
+            }
+        }
+    }
+
+    if ( ! found ) {
+        return false;
+    }
+
+    float threshold2 = threshold * threshold;
+
+    for (int i = 0; i < count; ++i) {
+        cv::Point3f p = best_model * cv::Point3f(x1[i], y1[i], 1.f);
+        float dx = p.x / p.z - x2[i], dy = p.y / p.z - y2[i];
+        inliers_mask[i] = dx * dx + dy * dy <= threshold2;
+    }
+
+    return true;
+}
+
+/**
+ * Estimates a general homography with PROSAC over 4 point samples, and refines it
+ * by least squares over the inliers of the best model.
+ * 
+ * @param src_points source points, best correspondences first
+ * @param dst_points destination points
+ * @param params iteration and time caps
+ * @param inliers_mask inlier flag of each correspondence
+ * 
+ * @return homography, empty if none was found
+ */
+cv::Mat findHomographyProsac(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points,
+                             const RansacParams& params, std::vector<uchar>& inliers_mask) {
+    auto solve = [](const cv::Point2f* src, const cv::Point2f* dst, std::vector<cv::Matx33d>& models) {
+        // Every triangle of the sample must keep its orientation under a homography
+        for (int a = 0; a < 4; ++a) {
+            int b = (a + 1) % 4, c = (a + 2) % 4;
+
+            if ( (src[b] - src[a]).cross(src[c] - src[a]) * (dst[b] - dst[a]).cross(dst[c] - dst[a]) <= 0 ) {
+                return;
+            }
+        }
+
+        models.push_back(cv::getPerspectiveTransform(src, dst));
+    };
+
+    cv::Matx33f best;
+
+    if ( ! prosac(src_points, dst_points, params, 4, solve, best, inliers_mask) ) {
+        return cv::Mat();
+    }
+
+    std::vector<cv::Point2f> src_inliers, dst_inliers;
+
+    for (std::size_t i = 0; i < inliers_mask.size(); ++i) {
+        if ( inliers_mask[i] ) {
+            src_inliers.push_back(src_points[i]);
+            dst_inliers.push_back(dst_points[i]);
+        }
+    }
+
+    cv::Mat H = cv::findHomography(src_inliers, dst_inliers, 0);
+
+    return H.empty() ? cv::Mat(cv::Matx33d(best)) : H;
+}
+
+/**
+ * Estimates the homography induced by a pure rotation with a shared focal length,
+ * H = K R K^-1 in image centred coordinates, with PROSAC over 2 point samples. The
+ * focal length of the best model is then refined by a golden section search, with
+ * the rotation fitted to all inliers for every focal length tried.
+ * 
+ * @param src_points source points, best correspondences first
+ * @param dst_points destination points
+ * @param params iteration and time caps
+ * @param inliers_mask inlier flag of each correspondence
+ * 
+ * @return rotation homography, empty if none was found
+ */
+cv::Mat findRotationProsac(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points,
+                           const RansacParams& params, std::vector<uchar>& inliers_mask) {
+    cv::Matx33f best;
+
+    if ( ! prosac(src_points, dst_points, params, 2, solveRotationFocal, best, inliers_mask) ) {
+        return cv::Mat();
+    }
+
+    std::vector<cv::Point2f> src_inliers, dst_inliers;
+
+    for (std::size_t i = 0; i < inliers_mask.size(); ++i) {
+        if ( inliers_mask[i] ) {
+            src_inliers.push_back(src_points[i]);
+            dst_inliers.push_back(dst_points[i]);
+        }
+    }
+
+    double focal = rotationFocal(cv::Matx33d(best));
+
+    // A rotation about the optical axis alone says nothing about the focal length
+    if ( focal <= 0 ) {
+        return cv::Mat(cv::Matx33d(best));
+    }
+
+    auto error = [&](double f) {
+        cv::Matx33d H = fitRotation(src_inliers, dst_inliers, f);
+        double sum = 0;
+
+        for (std::size_t i = 0; i < src_inliers.size(); ++i) {
+            cv::Point3d p = H * cv::Point3d(src_inliers[i].x, src_inliers[i].y, 1.);
+            sum += std::pow(p.x / p.z - dst_inliers[i].x, 2) + std::pow(p.y / p.z - dst_inliers[i].y, 2);
+        }
+
+        return sum;
+    };
+
+    const double golden = (std::sqrt(5.) - 1.) / 2.;
+    double low = 0.8 * focal, high = 1.25 * focal;
+
+    for (int iteration = 0; iteration < 25; ++iteration) {
+        double a = high - golden * (high - low), b = low + golden * (high - low);
+
+        if ( error(a) < error(b) ) {
+            high = b;
+        }
+        else {
+            low = a;
+        }
+    }
+
+    return cv::Mat(fitRotation(src_inliers, dst_inliers, (low + high) / 2.));
+}
+
+/**
+ * Minimal solver for a rotation about the optical centre with an unknown focal
+ * length shared by both images, from two correspondences. Rotations preserve the
+ * angle between the two rays, which gives a cubic in the squared focal length, and
+ * every positive root gives one rotation.
+ * 
+ * @param src two image centred points of the first image
+ * @param dst two image centred points of the second image
+ * @param models rotation homographies K R K^-1, one per focal length
+ */
+void solveRotationFocal(const cv::Point2f* src, const cv::Point2f* dst, std::vector<cv::Matx33d>& models) {
+    typedef std::array<double, 5> Polynomial;
+
+    // (p + u)^2 (q + u) (r + u) in u = f^2, lowest order first
+    auto expand = [](double p, double q, double r) {
+        Polynomial square = {p * p, 2 * p, 1, 0, 0}, result = {};
+        double linear[3] = {q * r, q + r, 1};
+
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                result[i + j] += square[i] * linear[j];
+            }
+        }
+
+        return result;
+    };
+
+    double ab = src[0].dot(src[1]), cd = dst[0].dot(dst[1]);
+    Polynomial left  = expand(ab, dst[0].dot(dst[0]), dst[1].dot(dst[1]));
+    Polynomial right = expand(cd, src[0].dot(src[0]), src[1].dot(src[1]));
+
+    cv::Mat roots;
+    int num_roots = cv::solveCubic(cv::Vec4d(left[3] - right[3], left[2] - right[2], left[1] - right[1], left[0] - right[0]), roots);
+
+    for (int r = 0; r < num_roots; ++r) {
+        double u = roots.at<double>(r);
+
+        // Squaring also admits supplementary angles
+        if ( u <= 0 || (ab + u) * (cd + u) <= 0 ) {
+            continue;
+        }
+
+        std::vector<cv::Point2f> src_pair(src, src + 2), dst_pair(dst, dst + 2);
+        models.push_back(fitRotation(src_pair, dst_pair, std::sqrt(u)));
+    }
+}
+
+/**
+ * Focal length of a rotation homography H = K R K^-1 with K = diag(f, f, 1). Since
+ * H(0, 2) = f R(0, 2) and H(2, 0) = R(2, 0) / f, and R(0, 2)^2 + R(1, 2)^2 equals
+ * R(2, 0)^2 + R(2, 1)^2 = 1 - R(2, 2)^2 for a rotation, the ratio of the two sums is f^4.
+ * 
+ * @param H rotation homography in image centred coordinates
+ * 
+ * @return focal length, 0 for a rotation about the optical axis only
+ */
+double rotationFocal(const cv::Matx33d& H) {
+    double top    = H(0, 2) * H(0, 2) + H(1, 2) * H(1, 2);
+    double bottom = H(2, 0) * H(2, 0) + H(2, 1) * H(2, 1);
+
+    if ( top <= 0 || bottom <= 0 ) {
+        return 0;
+    }
+
+    return std::pow(top / bottom, 0.25);
+}
+
+/**
+ * Fits the rotation that best maps the rays of the source points onto the rays of
+ * the destination points for a given focal length, by orthogonal Procrustes. Two
+ * point fits also align the normals of the planes the rays span.
+ * 
+ * @param src_points image centred points of the first image
+ * @param dst_points image centred points of the second image
+ * @param focal focal length shared by both images
+ * 
+ * @return rotation homography K R K^-1
+ */
+cv::Matx33d fitRotation(const std::vector<cv::Point2f>& src_points, const std::vector<cv::Point2f>& dst_points, double focal) {
+    cv::Matx33d M = cv::Matx33d::zeros();
+    std::vector<cv::Vec3d> src_rays, dst_rays;
+
+    for (std::size_t i = 0; i < src_points.size(); ++i) {
+        src_rays.push_back(cv::normalize(cv::Vec3d(src_points[i].x, src_points[i].y, focal)));
+        dst_rays.push_back(cv::normalize(cv::Vec3d(dst_points[i].x, dst_points[i].y, focal)));
+        M += dst_rays.back() * src_rays.back().t();
+    }
+
+    if ( src_points.size() == 2 ) {
+        M += dst_rays[0].cross(dst_rays[1]) * src_rays[0].cross(src_rays[1]).t();
+    }
+
+    cv::Matx33d U, Vt;
+    cv::Matx31d w;
+    cv::SVD::compute(M, w, U, Vt);
+
+    cv::Matx33d D = cv::Matx33d::eye();
+    D(2, 2) = cv::determinant(U * Vt) < 0 ? -1 : 1;
+
+    cv::Matx33d K(focal, 0, 0, 0, focal, 0, 0, 0, 1);
+    cv::Matx33d K_inv(1. / focal, 0, 0, 0, 1. / focal, 0, 0, 0, 1);
+
+    return K * (U * D * Vt) * K_inv;
+}
+
+/**
+ * Initial cameras for rotation only pairs. All cameras share the focal length prior,
+ * or else the median focal length of the pairwise rotations, and rotations are
+ * chained from the best connected image along a maximum spanning tree of the match
+ * confidences. Every relative rotation is orthonormalised, which gives bundle
+ * adjustment a cleaner start than cv::detail::HomographyBasedEstimator.
+ * 
+ * @param features features of the images
+ * @param pairwise_matches pairwise matches with rotation homographies
+ * @param conf_thresh confidence above which pairs are used
+ * @param focal_prior known focal length, estimated when 0
+ * @param cameras estimated cameras
+ * 
+ * @return true if every image could be reached
+ */
+bool estimateRotations(const std::vector<cv::detail::ImageFeatures>& features, const std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                       double conf_thresh, double focal_prior, std::vector<cv::detail::CameraParams>& cameras) {
+    typedef std::tuple<double, int, int> Edge;
+
+    int num_images = static_cast<int>(features.size());
+    std::vector<double> focals;
+    std::vector<double> degree(num_images, 0.);
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = 0; j < num_images; ++j) {
+            const cv::detail::MatchesInfo& matches_info = pairwise_matches[i * num_images + j];
+
+            if ( i == j || matches_info.H.empty() || matches_info.confidence < conf_thresh ) {
+                continue;
+            }
+
+            degree[i] += matches_info.confidence;
+
+            double f0, f1;
+            bool f0_ok, f1_ok;
+            cv::detail::focalsFromHomography(matches_info.H, f0, f1, f0_ok, f1_ok);
+
+            if ( f0_ok && f1_ok ) {
+                focals.push_back(std::sqrt(f0 * f1));
+            }
+        }
+    }
+
+    if ( focals.empty() && focal_prior <= 0 ) {
+        return false;
+    }
+
+    double focal = focal_prior;
+
+    if ( focal <= 0 ) {
+        std::nth_element(focals.begin(), focals.begin() + focals.size() / 2, focals.end());
+        focal = focals[focals.size() / 2];
+    }
+
+    cv::Matx33d K(focal, 0, 0, 0, focal, 0, 0, 0, 1);
+    cv::Matx33d K_inv(1. / focal, 0, 0, 0, 1. / focal, 0, 0, 0, 1);
+
+    cameras.assign(num_images, cv::detail::CameraParams());
+    std::vector<bool> placed(num_images, false);
+    std::priority_queue<Edge> frontier;
+
+    int center = static_cast<int>(std::max_element(degree.begin(), degree.end()) - degree.begin());
+    cameras[center].R = cv::Mat::eye(3, 3, CV_64F);
+    frontier.push(Edge(0., -1, center));
+
+    while ( ! frontier.empty() ) {
+        int from = std::get<1>(frontier.top()), to = std::get<2>(frontier.top());
+        frontier.pop();
+
+        if ( placed[to] ) {
+            continue;
+        }
+
+        if ( from >= 0 ) {
+            // Rays of image to = R_rel * rays of image from, orthonormalised
+            cv::Matx33d relative = K_inv * cv::Matx33d(pairwise_matches[from * num_images + to].H) * K;
+            cv::Matx33d U, Vt;
+            cv::Matx31d w;
+            cv::SVD::compute(relative, w, U, Vt);
+
+            cv::Matx33d R = U * Vt;
+
+            if ( cv::determinant(R) < 0 ) {
+                R = -R;
+            }
+
+            cameras[to].R = cv::Mat(cv::Matx33d(cameras[from].R) * R.t());
+        }
+
+        placed[to] = true;
+
+        for (int j = 0; j < num_images; ++j) {
+            const cv::detail::MatchesInfo& matches_info = pairwise_matches[to * num_images + j];
+
+            if ( ! placed[j] && ! matches_info.H.empty() && matches_info.confidence >= conf_thresh ) {
+                frontier.push(Edge(matches_info.confidence, to, j));
+            }
+        }
+    }
+
+    for (int i = 0; i < num_images; ++i) {
+        if ( ! placed[i] ) {
+            return false;
+        }
+
+        cameras[i].focal  = focal;
+        cameras[i].aspect = 1.;
+        cameras[i].ppx    = features[i].img_size.width * 0.5;
+        cameras[i].ppy    = features[i].img_size.height * 0.5;
+    }
+
+    return true;
+}
+
+/**
+ * Fills the matches from image j to image i as the inverse of the matches from
+ * image i to image j, as cv::detail::FeaturesMatcher does for every pair.
+ * 
+ * @param pairwise_matches pairwise matches of all images, row major
+ * @param i first image
+ * @param j second image
+ * @param num_images number of images
+ */
+void fillDualMatches(std::vector<cv::detail::MatchesInfo>& pairwise_matches, int i, int j, int num_images) {
+    const cv::detail::MatchesInfo& forward = pairwise_matches[i * num_images + j];
+    cv::detail::MatchesInfo& dual = pairwise_matches[j * num_images + i];
+
+    dual = forward;
+    dual.src_img_idx = j;
+    dual.dst_img_idx = i;
+
+    if ( ! forward.H.empty() ) {
+        dual.H = forward.H.inv();
+    }
+
+    for (cv::DMatch& match : dual.matches) {
+        std::swap(match.queryIdx, match.trainIdx);
+    }
+}
+
+/**
+ * Creates the configured pairwise matcher.
+ * 
+ * @param settings stitching pipeline settings
+ * 
+ * @return pairwise matcher
+ */
+cv::Ptr<cv::detail::FeaturesMatcher> createMatcher(const Settings& settings) {
+    if ( settings.matcher == MatcherType::HAMMING ) {
+        return cv::makePtr<HammingMatcher>(settings.ransac);
+    }
+    if ( settings.matcher == MatcherType::ANN ) {
+        return cv::makePtr<AnnMatcher>(settings.ann_recall, settings.ransac);
+    }
+    if ( settings.ransac.rotation_only ) {
+        return cv::makePtr<RotationMatcher>(settings.ransac);
+    }
+
+    return cv::makePtr<cv::detail::BestOf2NearestMatcher>(false);
+}
+
+/**
+ * Creates a best of two nearest matcher verified by the rotation only model. The
+ * stock matcher is thread safe, so image pairs are matched in parallel.
+ * 
+ * @param params limits of the verification of each pair
+ */
+RotationMatcher::RotationMatcher(const RansacParams& params)
+    : cv::detail::FeaturesMatcher(true), matcher(false), params(params) {}
+
+/**
+ * Matches one pair of images with the stock matcher and verifies its putative
+ * matches again with the rotation only model.
+ * 
+ * @param features1 features of the first image
+ * @param features2 features of the second image
+ * @param matches_info verified matches from the first to the second image
+ */
+void RotationMatcher::match(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                            cv::detail::MatchesInfo& matches_info) {
+    matcher(features1, features2, matches_info);
+
+    std::vector<cv::DMatch> matches = matches_info.matches;
+    verifyMatches(features1, features2, matches, matches_info, params);
+}
+
+/**
+ * Creates a Hamming matcher. It is thread safe, so image pairs are matched in parallel.
+ * 
+ * @param params limits of the verification of each pair
+ */
+HammingMatcher::HammingMatcher(const RansacParams& params)
+    : cv::detail::FeaturesMatcher(true), float_matcher(false), params(params) {}
+
+/**
+ * Matches and verifies one pair of images.
+ * 
+ * @param features1 features of the first image
+ * @param features2 features of the second image
+ * @param matches_info verified matches from the first to the second image
+ */
+void HammingMatcher::match(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                           cv::detail::MatchesInfo& matches_info) {
+    cv::Mat descriptors1 = features1.descriptors.getMat(cv::ACCESS_READ);
+    cv::Mat descriptors2 = features2.descriptors.getMat(cv::ACCESS_READ);
+
+    if ( descriptors1.depth() != CV_8U || descriptors2.depth() != CV_8U ) {
+        float_matcher(features1, features2, matches_info);
+
+        if ( params.rotation_only ) {
+            std::vector<cv::DMatch> matches = matches_info.matches;
+            verifyMatches(features1, features2, matches, matches_info, params);
+        }
+
+        return;
+    }
+
+    std::vector<cv::DMatch> matches;
+    hammingMatch(descriptors1, descriptors2, matches);
+    verifyMatches(features1, features2, matches, matches_info, params);
+}
+
+/**
+ * Brute force 2-nearest neighbour matching of binary descriptors in both directions
+ * at once. Descriptors are packed into zero padded 64-bit words, and distances are
+ * computed in blocks of queries against blocks of train descriptors that stay in
+ * cache. The best two distances of every query and every train descriptor are
+ * tracked from the same distances. A match is kept when the two descriptors are
+ * each other's nearest neighbour and either direction passes the ratio test of
+ * cv::detail::BestOf2NearestMatcher.
+ * 
+ * @param descriptors1 CV_8U descriptors of the first image, one per row
+ * @param descriptors2 CV_8U descriptors of the second image, one per row
+ * @param matches resulting matches, query indices refer to the first image
+ */
+void hammingMatch(const cv::Mat& descriptors1, const cv::Mat& descriptors2, std::vector<cv::DMatch>& matches) {
+    const float match_conf = 0.3f;
+    const int query_block  = 32;
+    const int train_block  = 512;
+
+    matches.clear();
+
+    int rows1 = descriptors1.rows, rows2 = descriptors2.rows;
+
+    if ( rows1 == 0 || rows2 == 0 || descriptors1.cols != descriptors2.cols ) {
+        return;
+    }
+
+    // Whole 256 bit chunks, so the vector kernels need no tail handling
+    int words = (descriptors1.cols + 31) / 32 * 4;
+
+    auto pack = [words](const cv::Mat& descriptors, std::vector<std::uint64_t>& packed) {
+        packed.assign(static_cast<std::size_t>(descriptors.rows) * words, 0);
+
+        for (int r = 0; r < descriptors.rows; ++r) {
+            std::memcpy(&packed[static_cast<std::size_t>(r) * words], descriptors.ptr<uchar>(r), descriptors.cols);
+        }
+    };
+
+    std::vector<std::uint64_t> packed1, packed2;
+    pack(descriptors1, packed1);
+    pack(descriptors2, packed2);
+
+    // Best two distances and the nearest neighbour in each direction
+    std::vector<int> best1(rows1, INT_MAX), second1(rows1, INT_MAX), nearest1(rows1, -1);
+    std::vector<int> best2(rows2, INT_MAX), second2(rows2, INT_MAX), nearest2(rows2, -1);
+    std::vector<int> distances(train_block);
+
+    HammingRowKernel kernel = hammingKernel().function;
+
+    for (int q0 = 0; q0 < rows1; q0 += query_block) {
+        for (int t0 = 0; t0 < rows2; t0 += train_block) {
+            int count = std::min(train_block, rows2 - t0);
+
+            for (int q = q0; q < std::min(q0 + query_block, rows1); ++q) {
+                kernel(&packed1[static_cast<std::size_t>(q) * words], &packed2[static_cast<std::size_t>(t0) * words],
+                       words, count, distances.data());
+
+                for (int k = 0; k < count; ++k) {
+                    int distance = distances[k], t = t0 + k;
+
+                    if ( distance < best1[q] ) {
+                        second1[q]  = best1[q];
+                        best1[q]    = distance;
+                        nearest1[q] = t;
+                    }
+                    else if ( distance < second1[q] ) {
+                        second1[q] = distance;
+                    }
+
+                    if ( distance < best2[t] ) {
+                        second2[t]  = best2[t];
+                        best2[t]    = distance;
+                        nearest2[t] = q;
+                    }
+                    else if ( distance < second2[t] ) {
+                        second2[t] = distance;
+                    }
+                }
+            }
+        }
+    }
+
+    for (int q = 0; q < rows1; ++q) {
+        int t = nearest1[q];
+
+        if ( t < 0 || nearest2[t] != q ) {
+            continue;
+        }
+
+        bool forward = second1[q] == INT_MAX || best1[q] < (1.f - match_conf) * second1[q];
+        bool reverse = second2[t] == INT_MAX || best2[t] < (1.f - match_conf) * second2[t];
+
+        if ( forward || reverse ) {
+            matches.push_back(cv::DMatch(q, t, static_cast<float>(best1[q])));
+        }
+    }
+}
+
+/**
+ * Creates an ANN matcher.
+ * 
+ * @param recall fraction of sampled queries whose exact nearest neighbour the index must find
+ * @param params limits of the verification of each pair
+ */
+AnnMatcher::AnnMatcher(float recall, const RansacParams& params)
+    : cv::detail::FeaturesMatcher(false), recall(recall), params(params) {}
+
+/**
+ * Matches and verifies one pair of images through an index over just the two.
+ * 
+ * @param features1 features of the first image
+ * @param features2 features of the second image
+ * @param matches_info verified matches from the first to the second image
+ */
+void AnnMatcher::match(const cv::detail::ImageFeatures& features1, const cv::detail::ImageFeatures& features2,
+                       cv::detail::MatchesInfo& matches_info) {
+    std::vector<cv::detail::ImageFeatures> features = {features1, features2};
+    std::vector<cv::detail::MatchesInfo> pairwise_matches;
+
+    match(features, pairwise_matches);
+    matches_info = pairwise_matches[1];
+}
+
+/**
+ * Matches all images at once. Every descriptor of the set goes into a single index,
+ * and each one queries its nearest neighbours across all other images in the same
+ * search. The best two neighbours found in another image give the ratio test of
+ * cv::detail::BestOf2NearestMatcher, matches from both directions are pooled per
+ * pair, and pairs with enough putative matches are verified in parallel.
+ * 
+ * @param features features of all images
+ * @param pairwise_matches verified matches of all pairs, row major
+ * @param mask optional CV_8U matrix of the pairs to match, as for the stock matchers
+ */
+void AnnMatcher::match(const std::vector<cv::detail::ImageFeatures>& features, std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                       const cv::UMat& mask) {
+    const float match_conf = 0.3f;
+    const int neighbours   = 12;
+    const int max_level    = 5;
+    const int recall_queries = 100;
+
+    int num_images = static_cast<int>(features.size());
+    pairwise_matches.assign(num_images * num_images, cv::detail::MatchesInfo());
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = 0; j < num_images; ++j) {
+            pairwise_matches[i * num_images + j].src_img_idx = i;
+            pairwise_matches[i * num_images + j].dst_img_idx = j;
+        }
+    }
+
+    // Stack the descriptors of all images, offsets map rows back to images
+    std::vector<cv::Mat> descriptors;
+    std::vector<int> offsets(1, 0);
+
+    for (const cv::detail::ImageFeatures& image_features : features) {
+        cv::Mat image_descriptors = image_features.descriptors.getMat(cv::ACCESS_READ);
+
+        if ( ! image_descriptors.empty() ) {
+            descriptors.push_back(image_descriptors);
+        }
+
+        offsets.push_back(offsets.back() + image_descriptors.rows);
+    }
+
+    if ( num_images < 2 || descriptors.empty() || offsets.back() < 2 ) {
+        return;
+    }
+
+    cv::Mat all;
+    cv::vconcat(descriptors, all);
+
+    bool binary = all.depth() == CV_8U;
+
+    if ( ! binary ) {
+        all.convertTo(all, CV_32F);
+    }
+
+    int total = all.rows;
+    int k = std::min(neighbours, total);
+
+    auto imageOf = [&offsets](int row) {
+        return static_cast<int>(std::upper_bound(offsets.begin(), offsets.end(), row) - offsets.begin()) - 1;
+    };
+
+    // Exact nearest neighbour in another image for an evenly spaced sample of queries
+    std::vector<int> samples, truth;
+
+    for (int s = 0; s < std::min(recall_queries, total); ++s) {
+        int row = static_cast<int>(static_cast<long long>(s) * total / std::min(recall_queries, total));
+
+        cv::Mat distances;
+        cv::batchDistance(all.row(row), all, distances, binary ? CV_32S : CV_32F, cv::noArray(),
+                          binary ? cv::NORM_HAMMING : cv::NORM_L2);
+        distances.convertTo(distances, CV_32F);
+
+        int image = imageOf(row), nearest = -1;
+        float best = FLT_MAX;
+
+        for (int c = 0; c < total; ++c) {
+            if ( distances.at<float>(c) < best && (c < offsets[image] || c >= offsets[image + 1]) ) {
+                best = distances.at<float>(c);
+                nearest = c;
+            }
+        }
+
+        if ( nearest >= 0 ) {
+            samples.push_back(row);
+            truth.push_back(nearest);
+        }
+    }
+
+    // Widens the search one level at a time, more probes for LSH or more leaves
+    // checked in the k-means tree, until the sample reaches the recall target
+    cv::flann::Index index;
+    cv::Mat indices, distances;
+    int level = 0;
+
+    // cv::flann::Index keeps search state in the index itself, so all queries go
+    // through one batched search and only the filtering below runs in parallel
+    auto search = [&](const cv::Mat& queries, cv::Mat& found, cv::Mat& found_distances) {
+        index.knnSearch(queries, found, found_distances, k, cv::flann::SearchParams(binary ? 32 : 32 << level));
+        found_distances.convertTo(found_distances, CV_32F);
+    };
+
+    for (level = 0; level <= max_level; ++level) {
+        if ( binary && level <= 2 ) {
+            index.build(all, cv::flann::LshIndexParams(12, 20, level), cvflann::FLANN_DIST_HAMMING);
+        }
+        else if ( ! binary && level == 0 ) {
+            index.build(all, cv::flann::KMeansIndexParams(32, 11), cvflann::FLANN_DIST_L2);
+        }
+        else if ( binary ) {
+            break;
+        }
+
+        if ( samples.empty() ) {
+            break;
+        }
+
+        cv::Mat sample_queries(static_cast<int>(samples.size()), all.cols, all.type());
+
+        for (std::size_t s = 0; s < samples.size(); ++s) {
+            all.row(samples[s]).copyTo(sample_queries.row(static_cast<int>(s)));
+        }
+
+        search(sample_queries, indices, distances);
+
+        int found = 0;
+
+        for (std::size_t s = 0; s < samples.size(); ++s) {
+            const int* row = indices.ptr<int>(static_cast<int>(s));
+            found += std::find(row, row + k, truth[s]) != row + k;
+        }
+
+        if ( found >= recall * samples.size() ) {
+            break;
+        }
+    }
+
+    level = std::min(level, binary ? 2 : max_level);
+    search(all, indices, distances);
+
+    // Ratio test per query and other image. An image holding only one of the k
+    // neighbours has its second best no closer than the farthest neighbour
+    cv::Mat match_mask = mask.getMat(cv::ACCESS_READ);
+    float ratio = binary ? 1.f - match_conf : (1.f - match_conf) * (1.f - match_conf);
+    std::vector<std::vector<cv::DMatch>> putative(num_images * num_images);
+
+    // Queries are filtered in fixed chunks, each collecting its own matches by pair
+    int num_chunks = std::max(1, std::min(total, 4 * cv::getNumThreads()));
+    std::vector<std::vector<std::pair<int, cv::DMatch>>> chunk_matches(num_chunks);
+
+    cv::parallel_for_(cv::Range(0, num_chunks), [&](const cv::Range& range) {
+        for (int chunk = range.start; chunk < range.end; ++chunk) {
+            int end = static_cast<int>(static_cast<long long>(chunk + 1) * total / num_chunks);
+
+            for (int q = static_cast<int>(static_cast<long long>(chunk) * total / num_chunks); q < end; ++q) {
+                const int* found = indices.ptr<int>(q);
+                const float* found_distances = distances.ptr<float>(q);
+                int image = imageOf(q);
+
+                for (int n = 0; n < k; ++n) {
+                    int t = found[n];
+
+                    if ( t < 0 || t >= total ) {
+                        continue;
+                    }
+
+                    int other = imageOf(t);
+
+                    if ( other == image ) {
+                        continue;
+                    }
+
+                    // Only the nearest neighbour in each image is a candidate
+                    bool seen = false;
+
+                    for (int m = 0; m < n; ++m) {
+                        seen |= found[m] >= 0 && found[m] < total && imageOf(found[m]) == other;
+                    }
+
+                    if ( seen ) {
+                        continue;
+                    }
+
+                    float second = k < total && found[k - 1] >= 0 ? found_distances[k - 1] : FLT_MAX;
+
+                    for (int m = n + 1; m < k; ++m) {
+                        if ( found[m] >= 0 && found[m] < total && imageOf(found[m]) == other ) {
+                            second = found_distances[m];
+                            break;
+                        }
+                    }
+
+                    if ( found_distances[n] >= ratio * second ) {
+                        continue;
+                    }
+
+                    int i = std::min(image, other), j = std::max(image, other);
+
+                    if ( ! match_mask.empty() && ! match_mask.at<uchar>(i, j) ) {
+                        continue;
+                    }
+
+                    float distance = binary ? found_distances[n] : std::sqrt(found_distances[n]);
+                    int query = image == i ? q - offsets[i] : t - offsets[i];
+                    int train = image == i ? t - offsets[j] : q - offsets[j];
+
+                    chunk_matches[chunk].push_back({i * num_images + j, cv::DMatch(query, train, distance)});
+                }
+            }
+        }
+    });
+
+    for (const std::vector<std::pair<int, cv::DMatch>>& matches : chunk_matches) {
+        for (const std::pair<int, cv::DMatch>& match : matches) {
+            putative[match.first].push_back(match.second);
+        }
+    }
+
+    std::vector<std::pair<int, int>> pairs;
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images; ++j) {
+            std::vector<cv::DMatch>& matches = putative[i * num_images + j];
+
+            // Both directions may find the same match
+            std::sort(matches.begin(), matches.end(), [](const cv::DMatch& a, const cv::DMatch& b) {
+                return a.queryIdx != b.queryIdx ? a.queryIdx < b.queryIdx : a.trainIdx < b.trainIdx;
+            });
+            matches.erase(std::unique(matches.begin(), matches.end(), [](const cv::DMatch& a, const cv::DMatch& b) {
+                return a.queryIdx == b.queryIdx && a.trainIdx == b.trainIdx;
+            }), matches.end());
+
+            if ( matches.size() >= 6 ) {
+                pairs.push_back({i, j});
+            }
+        }
+    }
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(pairs.size())), [&](const cv::Range& range) {
+        for (int p = range.start; p < range.end; ++p) {
+            int i = pairs[p].first, j = pairs[p].second;
+
+            if ( verifyMatches(features[i], features[j], putative[i * num_images + j], pairwise_matches[i * num_images + j], params) ) {
+                fillDualMatches(pairwise_matches, i, j, num_images);
+            }
+        }
+    });
+}
+
+/**
+ * Detects features in every image at the given registration scale. Image indices
+ * of the features refer to the position of the image in the input vector. With a
+ * keypoint budget only the strongest keypoints are described, spread over a grid
+ * when one is set.
+ * 
+ * @param images input images
+ * @param work_scale scale at which features are detected
+ * @param settings stitching pipeline settings
+ * @param features detected features, one entry per image
+ * @param masks optional detection masks at registration scale, one per image
+ */
+void findFeatures(const std::vector<Image>& images, double work_scale, const Settings& settings,
+                  std::vector<cv::detail::ImageFeatures>& features, const std::vector<Image>& masks) {
+    features.resize(images.size());
+
+    // Images of a set mostly share a size, the finder is only recreated when the budget changes
+    cv::Ptr<cv::Feature2D> finder;
+    int finder_budget = -1;
+
+    for (std::size_t i = 0; i < images.size(); ++i) {
+        Image image;
+        cv::resize(images[i], image, cv::Size(), work_scale, work_scale, cv::INTER_LINEAR_EXACT);
+
+        cv::_InputArray mask = masks.empty() ? cv::noArray() : cv::_InputArray(masks[i]);
+
+        // The grid needs spare keypoints to fill the cells the strongest ones miss
+        int budget = keypointBudget(settings, image.size());
+
+        if ( budget != finder_budget ) {
+            finder = createFeatureFinder(settings, settings.keypoint_grid > 0 ? 4 * budget : budget);
+            finder_budget = budget;
+        }
+
+        if ( budget > 0 ) {
+            features[i].img_size = image.size();
+            finder->detect(image, features[i].keypoints, mask);
+
+            if ( settings.keypoint_grid > 0 ) {
+                bucketKeypoints(features[i].keypoints, image.size(), settings.keypoint_grid, budget);
+            }
+            else {
+                cv::KeyPointsFilter::retainBest(features[i].keypoints, budget);
+            }
+
+            finder->compute(image, features[i].keypoints, features[i].descriptors);
+        }
+        else {
+            cv::detail::computeImageFeatures(finder, image, features[i], mask);
+        }
+
+        features[i].img_idx = static_cast<int>(i);
+    }
+}
+
+/**
+ * Creates the configured feature detector. ORB and SIFT are asked for the keypoint
+ * budget directly, AKAZE and BRISK have no such option and are trimmed afterwards.
+ * 
+ * @param settings stitching pipeline settings
+ * @param budget number of keypoints to detect, 0 for the detector default
+ * 
+ * @return feature detector and descriptor extractor
+ */
+cv::Ptr<cv::Feature2D> createFeatureFinder(const Settings& settings, int budget) {
+    switch ( settings.features ) {
+        case FeatureType::AKAZE:
+            return cv::AKAZE::create();
+        case FeatureType::BRISK:
+            return cv::BRISK::create();
+        case FeatureType::SIFT:
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 4)
+            return cv::SIFT::create(budget);
+#elif defined(HAVE_OPENCV_XFEATURES2D)
+            return cv::xfeatures2d::SIFT::create(budget);
+#else
+            showError("SIFT needs OpenCV 4.4 or the xfeatures2d module, using ORB");
+            break;
+#endif
+        case FeatureType::ORB:
+            break;
+    }
+
+    return budget > 0 ? cv::ORB::create(budget) : cv::ORB::create();
+}
+
+/**
+ * Creates a ray adjuster with the same solver settings as cv::detail::BundleAdjusterRay.
+ * 
+ * @param locked whether the focal length of each camera is held fixed
+ */
+LockedRayAdjuster::LockedRayAdjuster(const std::vector<bool>& locked)
+    : cv::detail::BundleAdjusterBase(4, 3), locked(locked) {
+    setRefinementMask(cv::Mat::ones(3, 3, CV_8U));
+    setConfThresh(1.);
+    setTermCriteria(cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 1000, DBL_EPSILON));
+}
+
+/**
+ * Packs focal length and rotation vector of every camera, 4 parameters each.
+ * 
+ * @param cameras initial cameras
+ */
+void LockedRayAdjuster::setUpInitialCameraParams(const std::vector<cv::detail::CameraParams>& cameras) {
+    cam_params_.create(num_images_ * 4, 1, CV_64F);
+
+    for (int i = 0; i < num_images_; ++i) {
+        cam_params_.at<double>(i * 4, 0) = cameras[i].focal;
+
+        // Closest proper rotation to the initial camera
+        cv::Mat R, w, u, vt, rvec;
+        cameras[i].R.convertTo(R, CV_64F);
+        cv::SVD::compute(R, w, u, vt, cv::SVD::FULL_UV);
+        R = u * vt;
+
+        if ( cv::determinant(R) < 0 ) {
+            R *= -1;
+        }
+
+        cv::Rodrigues(R, rvec);
+
+        for (int k = 0; k < 3; ++k) {
+            cam_params_.at<double>(i * 4 + 1 + k, 0) = rvec.at<double>(k, 0);
+        }
+    }
+}
+
+/**
+ * Unpacks the refined parameters into the cameras.
+ * 
+ * @param cameras cameras to update
+ */
+void LockedRayAdjuster::obtainRefinedCameraParams(std::vector<cv::detail::CameraParams>& cameras) const {
+    for (int i = 0; i < num_images_; ++i) {
+        cameras[i].focal = cam_params_.at<double>(i * 4, 0);
+
+        cv::Mat rvec = cam_params_.rowRange(i * 4 + 1, i * 4 + 4).clone(), R;
+        cv::Rodrigues(rvec, R);
+        R.convertTo(cameras[i].R, CV_32F);
+    }
+}
+
+/**
+ * Distance between the rays of every inlier match on the unit sphere, scaled by
+ * the focal lengths of both cameras, as cv::detail::BundleAdjusterRay measures it.
+ * 
+ * @param err residuals, 3 per inlier match
+ */
+void LockedRayAdjuster::calcError(cv::Mat& err) {
+    err.create(total_num_matches_ * 3, 1, CV_64F);
+    int match_idx = 0;
+
+    for (const std::pair<int, int>& edge : edges_) {
+        int i = edge.first, j = edge.second;
+        cv::Matx33d H[2];
+
+        for (int c = 0; c < 2; ++c) {
+            int image = c == 0 ? i : j;
+            double f = cam_params_.at<double>(image * 4, 0);
+
+            cv::Mat R;
+            cv::Rodrigues(cam_params_.rowRange(image * 4 + 1, image * 4 + 4).clone(), R);
+
+            cv::Matx33d K_inv(1. / f, 0, -features_[image].img_size.width * 0.5 / f,
+                              0, 1. / f, -features_[image].img_size.height * 0.5 / f,
+                              0, 0, 1);
+            H[c] = cv::Matx33d(R) * K_inv;
+        }
+
+        double mult = std::sqrt(cam_params_.at<double>(i * 4, 0) * cam_params_.at<double>(j * 4, 0));
+        const cv::detail::MatchesInfo& matches_info = pairwise_matches_[i * num_images_ + j];
+
+        for (std::size_t k = 0; k < matches_info.matches.size(); ++k) {
+            if ( ! matches_info.inliers_mask[k] ) {
+                continue;
+            }
+
+            const cv::DMatch& m = matches_info.matches[k];
+            const cv::Point2f& p1 = features_[i].keypoints[m.queryIdx].pt;
+            const cv::Point2f& p2 = features_[j].keypoints[m.trainIdx].pt;
+
+            cv::Vec3d ray1 = cv::normalize(cv::Vec3d(H[0] * cv::Vec3d(p1.x, p1.y, 1.)));
+            cv::Vec3d ray2 = cv::normalize(cv::Vec3d(H[1] * cv::Vec3d(p2.x, p2.y, 1.)));
+
+            for (int d = 0; d < 3; ++d) {
+                err.at<double>(3 * match_idx + d, 0) = mult * (ray1[d] - ray2[d]);
+            }
+
+            ++match_idx;
+        }
+    }
+}
+
+/**
+ * Numerical Jacobian with central differences, as cv::detail::BundleAdjusterRay
+ * computes it. Columns of locked focal lengths stay zero, so the solver never
+ * moves them.
+ * 
+ * @param jac Jacobian of the residuals by camera parameter
+ */
+void LockedRayAdjuster::calcJacobian(cv::Mat& jac) {
+    const double step = 1e-3;
+
+    jac.create(total_num_matches_ * 3, num_images_ * 4, CV_64F);
+    jac.setTo(cv::Scalar::all(0));
+
+    for (int i = 0; i < num_images_; ++i) {
+        for (int p = locked[i] ? 1 : 0; p < 4; ++p) {
+            double& param = cam_params_.at<double>(i * 4 + p, 0);
+            double value  = param;
+
+            param = value - step;
+            calcError(err1);
+            param = value + step;
+            calcError(err2);
+            param = value;
+
+            cv::Mat column = jac.col(i * 4 + p);
+            cv::Mat((err2 - err1) / (2 * step)).copyTo(column);
+        }
+    }
+}
+
+/**
+ * Estimates the cameras of the biggest connected component of the match graph.
+ * Initial cameras come from the pairwise homographies, or the pairwise rotations
+ * with a rotation only model, or the pose priors, and are refined by bundle
+ * adjustment. Known focal lengths replace the focal estimation from homographies,
+ * and images without one take the median of the others. Resulting cameras are scaled from registration
+ * resolution back up to full resolution pixel units.
+ * 
+ * @param features features of the images, trimmed to the biggest component
+ * @param pairwise_matches pairwise matches, trimmed to the biggest component
+ * @param work_scale scale at which the features were detected
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras, indices refer to the features vector
+ * @param image_indices input image of each feature, for focal priors, identity if empty
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool estimateCameras(std::vector<cv::detail::ImageFeatures>& features, std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                     double work_scale, const Settings& settings, Registration& registration,
+                     const std::vector<int>& image_indices) {
+    float conf_thresh = static_cast<float>(settings.confidence_thresh);
+
+    registration.indices = cv::detail::leaveBiggestComponent(features, pairwise_matches, conf_thresh);
+
+    if ( registration.indices.size() < 2 ) {
+        return false;
+    }
+
+    // Focal length priors of the component at registration scale
+    std::vector<double> priors, known;
+
+    std::vector<std::size_t> images;
+
+    for (int index : registration.indices) {
+        std::size_t image = image_indices.empty() ? index : image_indices[index];
+        double prior = image < settings.focal_priors.size() ? settings.focal_priors[image] * work_scale : 0.;
+
+        images.push_back(image);
+        priors.push_back(prior);
+
+        if ( prior > 0 ) {
+            known.push_back(prior);
+        }
+    }
+
+    double median_prior = 0.;
+
+    if ( ! known.empty() ) {
+        std::nth_element(known.begin(), known.begin() + known.size() / 2, known.end());
+        median_prior = known[known.size() / 2];
+    }
+
+    bool posed = ! settings.pose_priors.empty();
+
+    for (std::size_t image : images) {
+        posed &= image < settings.pose_priors.size();
+    }
+
+    if ( posed ) {
+        // Rotations straight from the poses, focal lengths as known or from the homographies
+        double focal = median_prior;
+
+        if ( focal <= 0 ) {
+            std::vector<double> focals;
+            cv::detail::estimateFocal(features, pairwise_matches, focals);
+            std::nth_element(focals.begin(), focals.begin() + focals.size() / 2, focals.end());
+            focal = focals[focals.size() / 2];
+        }
+
+        registration.cameras.assign(features.size(), cv::detail::CameraParams());
+
+        for (std::size_t i = 0; i < features.size(); ++i) {
+            registration.cameras[i].focal = priors[i] > 0 ? priors[i] : focal;
+            registration.cameras[i].ppx   = features[i].img_size.width * 0.5;
+            registration.cameras[i].ppy   = features[i].img_size.height * 0.5;
+            registration.cameras[i].R     = cv::Mat(poseRotation(settings.pose_priors[images[i]]));
+        }
+    }
+    else if ( settings.ransac.rotation_only ) {
+        if ( ! estimateRotations(features, pairwise_matches, conf_thresh, median_prior, registration.cameras) ) {
+            return false;
+        }
+    }
+    else {
+        cv::detail::HomographyBasedEstimator estimator(median_prior > 0);
+
+        if ( median_prior > 0 ) {
+            registration.cameras.assign(features.size(), cv::detail::CameraParams());
+
+            for (std::size_t i = 0; i < features.size(); ++i) {
+                registration.cameras[i].focal = priors[i] > 0 ? priors[i] : median_prior;
+                registration.cameras[i].ppx   = features[i].img_size.width * 0.5;
+                registration.cameras[i].ppy   = features[i].img_size.height * 0.5;
+            }
+        }
+
+        if ( ! estimator(features, pairwise_matches, registration.cameras) ) {
+            return false;
+        }
+    }
+
+    for (cv::detail::CameraParams& camera : registration.cameras) {
+        camera.R.convertTo(camera.R, CV_32F);
+    }
+
+    // Only the cameras with a known focal length are locked, the others are refined
+    cv::Ptr<cv::detail::BundleAdjusterBase> adjuster;
+
+    if ( settings.lock_intrinsics && median_prior > 0 ) {
+        std::vector<bool> locked;
+
+        for (double prior : priors) {
+            locked.push_back(prior > 0);
+        }
+
+        adjuster = cv::makePtr<LockedRayAdjuster>(locked);
+    }
+    else {
+        adjuster = cv::makePtr<cv::detail::BundleAdjusterRay>();
+    }
+
+    adjuster->setConfThresh(conf_thresh);
+
+    if ( ! (*adjuster)(features, pairwise_matches, registration.cameras) ) {
+        return false;
+    }
+
+    for (cv::detail::CameraParams& camera : registration.cameras) {
+        camera.focal /= work_scale;
+        camera.ppx   /= work_scale;
+        camera.ppy   /= work_scale;
+    }
+
+    return true;
+}
+
+/**
+ * Tests whether the pairwise matches are explained by the partial affine model of
+ * cv::Stitcher::SCANS. For every confident pair a similarity transform is fitted to
+ * the homography inliers, and the pair counts as affine when nearly all of them
+ * land within the RANSAC threshold. Rotating cameras only pass with long lenses,
+ * where the plane of the affine pipeline is as good a surface as any.
+ * 
+ * @param features features of all images
+ * @param pairwise_matches verified pairwise matches of all images
+ * @param conf_thresh confidence threshold of the pairs to test
+ * 
+ * @return true if the affine model explains the matches of most pairs
+ */
+bool affineExplains(const std::vector<cv::detail::ImageFeatures>& features,
+                    const std::vector<cv::detail::MatchesInfo>& pairwise_matches, float conf_thresh) {
+    const double threshold   = 3.0;     // RANSAC threshold of pair verification in pixels
+    const double min_fitted  = 0.95;    // Inliers the affine model has to explain per pair
+    const double min_pairs   = 0.9;     // Pairs the affine model has to explain
+
+    int num_images = static_cast<int>(features.size());
+    int pairs      = 0;
+    int explained  = 0;
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images; ++j) {
+            const cv::detail::MatchesInfo& info = pairwise_matches[i * num_images + j];
+
+            if ( info.confidence < conf_thresh || info.num_inliers < 6 ) {
+                continue;
+            }
+
+            std::vector<cv::Point2f> src_points, dst_points;
+
+            for (std::size_t k = 0; k < info.matches.size() && k < info.inliers_mask.size(); ++k) {
+                if ( info.inliers_mask[k] ) {
+                    src_points.push_back(features[i].keypoints[info.matches[k].queryIdx].pt);
+                    dst_points.push_back(features[j].keypoints[info.matches[k].trainIdx].pt);
+                }
+            }
+
+            ++pairs;
+
+            cv::Mat affine = cv::estimateAffinePartial2D(src_points, dst_points, cv::noArray(), cv::RANSAC, threshold);
+
+            if ( affine.empty() ) {
+                continue;
+            }
+
+            cv::Matx23d A = affine;
+            std::size_t fitted = 0;
+
+            for (std::size_t k = 0; k < src_points.size(); ++k) {
+                cv::Vec2d p = A * cv::Vec3d(src_points[k].x, src_points[k].y, 1.);
+
+                if ( std::hypot(p[0] - dst_points[k].x, p[1] - dst_points[k].y) <= threshold ) {
+                    ++fitted;
+                }
+            }
+
+            if ( fitted >= min_fitted * src_points.size() ) {
+                ++explained;
+            }
+        }
+    }
+
+    return pairs > 0 && explained >= min_pairs * pairs;
+}
+
+/**
+ * Replaces the homography of every pair by a partial affine transform fitted to
+ * all of its matches, with the inliers and confidence computed the same way as
+ * cv::detail::AffineBestOf2NearestMatcher does. Transforms are in uncentred pixel
+ * coordinates, as cv::detail::AffineBasedEstimator expects.
+ * 
+ * @param features features of all images
+ * @param pairwise_matches pairwise matches of all images, refitted in place
+ */
+void fitAffineMatches(const std::vector<cv::detail::ImageFeatures>& features,
+                      std::vector<cv::detail::MatchesInfo>& pairwise_matches) {
+    int num_images = static_cast<int>(features.size());
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images; ++j) {
+            cv::detail::MatchesInfo& info = pairwise_matches[i * num_images + j];
+
+            info.H.release();
+            info.inliers_mask.clear();
+            info.num_inliers = 0;
+            info.confidence  = 0;
+
+            if ( info.matches.size() >= 6 ) {
+                std::vector<cv::Point2f> src_points, dst_points;
+
+                for (const cv::DMatch& match : info.matches) {
+                    src_points.push_back(features[i].keypoints[match.queryIdx].pt);
+                    dst_points.push_back(features[j].keypoints[match.trainIdx].pt);
+                }
+
+                cv::Mat H = cv::estimateAffinePartial2D(src_points, dst_points, info.inliers_mask);
+
+                if ( ! H.empty() ) {
+                    info.num_inliers = cv::countNonZero(info.inliers_mask);
+                    info.confidence  = info.num_inliers / (8 + 0.3 * info.matches.size());
+
+                    // Extend to a linear transform in homogeneous coordinates
+                    H.push_back(cv::Mat::zeros(1, 3, CV_64F));
+                    H.at<double>(2, 2) = 1;
+                    info.H = H;
+                }
+            }
+
+            fillDualMatches(pairwise_matches, i, j, num_images);
+        }
+    }
+}
+
+/**
+ * Estimates the affine cameras of the biggest connected set of images, the same way
+ * cv::Stitcher::SCANS does: transforms chained along the maximum spanning tree of
+ * the match graph, refined by the partial affine bundle adjuster. Cameras keep unit
+ * focal length at registration resolution and are scaled to full resolution like
+ * rotation cameras, which leaves the plane of the panorama in full resolution pixels.
+ * 
+ * @param features features of all images
+ * @param pairwise_matches pairwise affine matches of all images
+ * @param work_scale scale of the registration resolution
+ * @param settings stitching pipeline settings
+ * @param registration estimated cameras of the biggest connected set of images
+ * 
+ * @return true if the cameras could be estimated
+ */
+bool estimateAffineCameras(std::vector<cv::detail::ImageFeatures>& features, std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                           double work_scale, const Settings& settings, Registration& registration) {
+    float conf_thresh = static_cast<float>(settings.confidence_thresh);
+
+    registration.indices = cv::detail::leaveBiggestComponent(features, pairwise_matches, conf_thresh);
+    registration.affine  = true;
+
+    if ( registration.indices.size() < 2 ) {
+        return false;
+    }
+
+    cv::detail::AffineBasedEstimator estimator;
+
+    if ( ! estimator(features, pairwise_matches, registration.cameras) ) {
+        return false;
+    }
+
+    for (cv::detail::CameraParams& camera : registration.cameras) {
+        camera.R.convertTo(camera.R, CV_32F);
+    }
+
+    cv::detail::BundleAdjusterAffinePartial adjuster;
+    adjuster.setConfThresh(conf_thresh);
+
+    if ( ! adjuster(features, pairwise_matches, registration.cameras) ) {
+        return false;
+    }
+
+    for (cv::detail::CameraParams& camera : registration.cameras) {
+        camera.R.convertTo(camera.R, CV_32F);
+        camera.focal /= work_scale;
+        camera.ppx   /= work_scale;
+        camera.ppy   /= work_scale;
+    }
+
+    return true;
+}
+
+/**
+ * Partitions the match graph into clusters of connected images. Clusters are grown
+ * from the lowest unassigned image, always adding the neighbour with the strongest
+ * match first. Once a cluster is full, the images of earlier clusters it matches
+ * best are added to it as anchors, which are later used to align the clusters.
+ * 
+ * @param pairwise_matches pairwise matches of all images
+ * @param num_images number of images in the set
+ * @param settings stitching pipeline settings
+ * 
+ * @return image indices of each cluster, anchors included
+ */
+std::vector<std::vector<int>> partitionMatchGraph(const std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                                                  int num_images, const Settings& settings) {
+    typedef std::pair<double, int> Edge;
+
+    std::vector<std::vector<int>> clusters;
+    std::vector<int> owner(num_images, -1);
+
+    auto confidence = [&](int i, int j) {
+        return pairwise_matches[i * num_images + j].confidence;
+    };
+
+    for (int seed = 0; seed < num_images; ++seed) {
+        if ( owner[seed] != -1 ) {
+            continue;
+        }
+
+        int cluster = static_cast<int>(clusters.size());
+        std::vector<int> members;
+        std::priority_queue<Edge> frontier;
+        frontier.push({0.0, seed});
+
+        // Grow cluster along the strongest matches
+        while ( ! frontier.empty() && members.size() < settings.cluster_size ) {
+            int image = frontier.top().second;
+            frontier.pop();
+
+            if ( owner[image] != -1 ) {
+                continue;
+            }
+
+            owner[image] = cluster;
+            members.push_back(image);
+
+            for (int j = 0; j < num_images; ++j) {
+                if ( owner[j] == -1 && confidence(image, j) > settings.confidence_thresh ) {
+                    frontier.push({confidence(image, j), j});
+                }
+            }
+        }
+
+        // Anchors, best matching images which already belong to earlier clusters
+        std::vector<Edge> anchors;
+
+        for (int j = 0; j < num_images; ++j) {
+            if ( owner[j] == -1 || owner[j] == cluster ) {
+                continue;
+            }
+
+            double best = 0.0;
+
+            for (int image : members) {
+                best = std::max(best, confidence(image, j));
+            }
+
+            if ( best > settings.confidence_thresh ) {
+                anchors.push_back({best, j});
+            }
+        }
+
+        std::sort(anchors.rbegin(), anchors.rend());
+
+        for (std::size_t a = 0; a < anchors.size() && a < settings.cluster_overlap; ++a) {
+            members.push_back(anchors[a].second);
+        }
+
+        clusters.push_back(members);
+    }
+
+    return clusters;
+}
+
+/**
+ * Brings independently registered clusters into one common frame. Starting from
+ * the largest cluster, each neighbouring cluster is rotated so that the anchor
+ * images it shares with an aligned cluster line up, using the average of the
+ * anchor rotations. Focal lengths are rescaled by the median anchor focal ratio.
+ * Clusters that can't be reached through anchors are left out of the panorama.
+ * 
+ * @param clusters registration of each cluster, empty if it failed
+ * @param members image indices of each cluster, anchors included
+ * @param registration cameras of all aligned images
+ * 
+ * @return true if at least two images could be aligned
+ */
+bool alignClusters(const std::vector<Registration>& clusters, const std::vector<std::vector<int>>& members,
+                   Registration& registration) {
+    int num_clusters = static_cast<int>(clusters.size());
+    std::vector<std::vector<cv::detail::CameraParams>> cameras(num_clusters);
+    std::vector<std::vector<int>> positions(num_clusters);
+
+    // Position of every image in each cluster registration, -1 if not registered
+    for (int c = 0; c < num_clusters; ++c) {
+        cameras[c] = clusters[c].cameras;
+
+        for (std::size_t i = 0; i < clusters[c].indices.size(); ++i) {
+            int image = clusters[c].indices[i];
+
+            if ( static_cast<int>(positions[c].size()) <= image ) {
+                positions[c].resize(image + 1, -1);
+            }
+
+            positions[c][image] = static_cast<int>(i);
+        }
+    }
+
+    auto position = [&](int c, int image) {
+        return image < static_cast<int>(positions[c].size()) ? positions[c][image] : -1;
+    };
+
+    if ( clusters.empty() ) {
+        return false;
+    }
+
+    // Start from the largest registered cluster
+    int root = 0;
+
+    for (int c = 1; c < num_clusters; ++c) {
+        if ( clusters[c].indices.size() > clusters[root].indices.size() ) {
+            root = c;
+        }
+    }
+
+    if ( clusters[root].indices.size() < 2 ) {
+        return false;
+    }
+
+    std::vector<bool> aligned(num_clusters, false);
+    std::queue<int> queue;
+    aligned[root] = true;
+    queue.push(root);
+
+    while ( ! queue.empty() ) {
+        int c = queue.front();
+        queue.pop();
+
+        for (int d = 0; d < num_clusters; ++d) {
+            if ( aligned[d] || clusters[d].indices.size() < 2 ) {
+                continue;
+            }
+
+            cv::Mat_<double> sum = cv::Mat_<double>::zeros(3, 3);
+            std::vector<double> focal_ratios;
+
+            for (int image : clusters[d].indices) {
+                int pc = position(c, image);
+                int pd = position(d, image);
+
+                if ( pc == -1 ) {
+                    continue;
+                }
+
+                cv::Mat_<double> Rc, Rd;
+                cameras[c][pc].R.convertTo(Rc, CV_64F);
+                cameras[d][pd].R.convertTo(Rd, CV_64F);
+
+                sum += Rc * Rd.t();
+                focal_ratios.push_back(cameras[c][pc].focal / cameras[d][pd].focal);
+            }
+
+            if ( focal_ratios.empty() ) {
+                continue;
+            }
+
+            // Closest rotation to the summed anchor rotations
+            cv::Mat_<double> w, u, vt;
+            cv::SVD::compute(sum, w, u, vt);
+
+            if ( cv::determinant(u * vt) < 0 ) {
+                cv::Mat column = u.col(2);
+                column *= -1;
+            }
+
+            cv::Mat_<double> G = u * vt;
+
+            std::nth_element(focal_ratios.begin(), focal_ratios.begin() + focal_ratios.size() / 2, focal_ratios.end());
+            double focal_ratio = focal_ratios[focal_ratios.size() / 2];
+
+            for (cv::detail::CameraParams& camera : cameras[d]) {
+                cv::Mat_<double> R;
+                camera.R.convertTo(R, CV_64F);
+                cv::Mat(G * R).convertTo(camera.R, CV_32F);
+                camera.focal *= focal_ratio;
+            }
+
+            aligned[d] = true;
+            queue.push(d);
+        }
+    }
+
+    // Every image takes its camera from the cluster which owns it. Anchors always
+    // come from earlier clusters, so the owner is the first cluster containing the
+    // image and later clusters are only used if the owner couldn't be aligned
+    int num_images = 0;
+
+    for (const std::vector<int>& cluster : members) {
+        for (int image : cluster) {
+            num_images = std::max(num_images, image + 1);
+        }
+    }
+
+    registration = Registration();
+
+    for (int image = 0; image < num_images; ++image) {
+        int source = -1;
+
+        for (int c = 0; c < num_clusters && source == -1; ++c) {
+            if ( aligned[c] && position(c, image) != -1 ) {
+                source = c;
+            }
+        }
+
+        if ( source != -1 ) {
+            registration.cameras.push_back(cameras[source][position(source, image)]);
+            registration.indices.push_back(image);
+        }
+    }
+
+    return registration.indices.size() > 1;
+}
+
+/**
+ * Straightens the panorama by correcting the camera rotations so that the
+ * horizon stays level, the same wave correction cv::Stitcher applies.
+ * 
+ * @param registration cameras to correct
+ */
+void waveCorrect(Registration& registration) {
+    std::vector<cv::Mat> rmats;
+
+    for (const cv::detail::CameraParams& camera : registration.cameras) {
+        rmats.push_back(camera.R.clone());
+    }
+
+    cv::detail::waveCorrect(rmats, cv::detail::WAVE_CORRECT_HORIZ);
+
+    for (std::size_t i = 0; i < rmats.size(); ++i) {
+        registration.cameras[i].R = rmats[i];
+    }
+}
+
+/**
+ * Estimates seams and exposure gains on small warped copies of the images at seam
+ * resolution. The result is shared by every compositor, which only has to warp the
+ * images at compositing resolution and cut them along the seams. Block gains stay
+ * at seam resolution and are stretched over the warped images while warping.
+ * 
+ * @param images input images
+ * @param registration cameras and indices of the images making up the panorama
+ * @param settings stitching pipeline settings
+ * @param seams seam masks and exposure gains at seam resolution
+ */
+void estimateSeams(const std::vector<Image>& images, const Registration& registration,
+                   const Settings& settings, Seams& seams) {
+    std::size_t num_images = registration.indices.size();
+
+    seams.warped_scale = surfaceScale(registration);
+    seams.seam_scale = scaleForResolution(images[registration.indices[0]], settings.seam_estimation_resol);
+
+    std::vector<cv::detail::CameraParams> cameras;
+    scaleCameras(registration, seams.seam_scale, cameras);
+
+    cv::Ptr<cv::detail::RotationWarper> warper =
+        createWarper(settings)->create(static_cast<float>(seams.warped_scale * seams.seam_scale));
+
+    std::vector<cv::UMat> images_warped(num_images);
+    seams.corners.resize(num_images);
+    seams.masks.resize(num_images);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        Image image;
+        cv::resize(images[registration.indices[i]], image, cv::Size(), seams.seam_scale, seams.seam_scale, cv::INTER_LINEAR_EXACT);
+
+        Image mask(image.size(), CV_8U, cv::Scalar::all(255));
+
+        cv::Mat K;
+        cameras[i].K().convertTo(K, CV_32F);
+
+        seams.corners[i] = warper->warp(image, K, cameras[i].R, cv::INTER_LINEAR, cv::BORDER_REFLECT, images_warped[i]);
+        warper->warp(mask, K, cameras[i].R, cv::INTER_NEAREST, cv::BORDER_CONSTANT, seams.masks[i]);
+    }
+
+    seams.compensator = cv::makePtr<BlockGainCompensator>();
+    seams.compensator->feed(seams.corners, images_warped, seams.masks);
+
+    if ( settings.seam_finder == SeamType::VORONOI ) {
+        // Only the footprints matter, the images are neither compensated nor converted
+        std::vector<cv::Size> sizes;
+
+        for (const cv::UMat& image : images_warped) {
+            sizes.push_back(image.size());
+        }
+
+        cv::detail::VoronoiSeamFinder().find(sizes, seams.corners, seams.masks);
+    }
+    else {
+        std::vector<cv::UMat> images_warped_f(num_images);
+
+        for (std::size_t i = 0; i < num_images; ++i) {
+            seams.compensator->apply(static_cast<int>(i), seams.corners[i], images_warped[i], seams.masks[i]);
+            images_warped[i].convertTo(images_warped_f[i], CV_32F);
+        }
+
+        if ( settings.seam_finder == SeamType::GRAPH_CUT_LOW_RES ) {
+            findLowResSeams(images_warped_f, seams.corners, seams.masks);
+        }
+        else {
+            findPairwiseSeams(images_warped_f, seams.corners, seams.masks);
+        }
+    }
+
+    // Seams are upscaled with a small margin, as cv::Stitcher does, dilating the runs
+    for (cv::UMat& mask : seams.masks) {
+        Image dilated;
+        RunMask(mask.getMat(cv::ACCESS_READ)).dilate().decode(cv::Rect(cv::Point(), mask.size()), dilated);
+        dilated.copyTo(mask);
+    }
+}
+
+/**
+ * Finds graph cut seams between every pair of overlapping images, with the same
+ * colour cost as cv::detail::GraphCutSeamFinder. The serial finder cuts pairs in
+ * order and every cut reads the masks left by the earlier cuts of its two images.
+ * Pairs are therefore scheduled in waves, each pair one wave after the last earlier
+ * pair sharing one of its images, so that the pairs of a wave never touch the same
+ * mask and run in parallel with exactly the serial result. Every worker cuts its
+ * pairs in its own arena, which only grows to the largest overlap it has seen.
+ * 
+ * @param images warped images, CV_32FC3
+ * @param corners top left corners of the warped images
+ * @param masks warped masks, cut along the seams in place
+ */
+void findPairwiseSeams(const std::vector<cv::UMat>& images, const std::vector<cv::Point>& corners,
+                       std::vector<cv::UMat>& masks) {
+    int num_images = static_cast<int>(images.size());
+
+    std::vector<std::vector<std::pair<int, int>>> waves;
+    std::vector<int> last_wave(num_images, -1);
+
+    for (int i = 0; i < num_images; ++i) {
+        for (int j = i + 1; j < num_images; ++j) {
+            cv::Rect roi;
+
+            if ( ! cv::detail::overlapRoi(corners[i], corners[j], images[i].size(), images[j].size(), roi) ) {
+                continue;
+            }
+
+            int wave = std::max(last_wave[i], last_wave[j]) + 1;
+            last_wave[i] = wave;
+            last_wave[j] = wave;
+
+            if ( wave >= static_cast<int>(waves.size()) ) {
+                waves.resize(wave + 1);
+            }
+
+            waves[wave].emplace_back(i, j);
+        }
+    }
+
+    // Mapped once up front, workers only touch the pixels
+    std::vector<cv::Mat> image_data(num_images), mask_data(num_images);
+
+    for (int i = 0; i < num_images; ++i) {
+        image_data[i] = images[i].getMat(cv::ACCESS_READ);
+        mask_data[i]  = masks[i].getMat(cv::ACCESS_RW);
+    }
+
+    cv::TLSData<SeamArena> arenas;
+
+    for (const std::vector<std::pair<int, int>>& wave : waves) {
+        cv::parallel_for_(cv::Range(0, static_cast<int>(wave.size())), [&](const cv::Range& range) {
+            SeamArena& arena = arenas.getRef();
+
+            for (int p = range.start; p < range.end; ++p) {
+                int i = wave[p].first;
+                int j = wave[p].second;
+
+                cv::Rect roi;
+                cv::detail::overlapRoi(corners[i], corners[j], images[i].size(), images[j].size(), roi);
+
+                cutSeam(image_data[i], image_data[j], corners[i], corners[j], roi, mask_data[i], mask_data[j], arena);
+            }
+        });
+    }
+}
+
+/**
+ * Colour cost of a pixel of a seam, the squared colour difference of both images.
+ * Summed in float and returned as double, as cv::detail::normL2() does.
+ */
+static inline double seamColorCost(const cv::Point3f& a, const cv::Point3f& b) {
+    cv::Point3f d = a - b;
+    return d.x * d.x + d.y * d.y + d.z * d.z;
+}
+
+/**
+ * Cuts the overlap of two images along the cheapest seam, exactly as the colour cost
+ * of cv::detail::GraphCutSeamFinder does. The overlap and a small gap around it are
+ * copied into the arena, pixels covered by one image only are tied to that image and
+ * edges crossing the border of either mask are penalised. Pixels of the overlap are
+ * then removed from the mask of the image on the other side of the cut.
+ * 
+ * @param image1 first warped image, CV_32FC3
+ * @param image2 second warped image, CV_32FC3
+ * @param tl1 top left corner of the first image
+ * @param tl2 top left corner of the second image
+ * @param roi overlap of both images on the panorama surface
+ * @param mask1 mask of the first image, cut in place
+ * @param mask2 mask of the second image, cut in place
+ * @param arena scratch memory of the calling worker
+ */
+void cutSeam(const cv::Mat& image1, const cv::Mat& image2, cv::Point tl1, cv::Point tl2, cv::Rect roi,
+             cv::Mat& mask1, cv::Mat& mask2, SeamArena& arena) {
+    const int gap                  = 10;
+    const float terminal_cost      = 10000.f;
+    const float bad_region_penalty = 1000.f;
+    const float weight_eps         = 1.f;
+
+    int width  = roi.width + 2 * gap;
+    int height = roi.height + 2 * gap;
+
+    const cv::Mat* images[2] = {&image1, &image2};
+    const cv::Mat* masks[2]  = {&mask1, &mask2};
+    cv::Point offsets[2]     = {roi.tl() - tl1, roi.tl() - tl2};
+
+    // Cut both images and masks with the gap, zero outside of the images
+    for (int k = 0; k < 2; ++k) {
+        arena.pixels[k].assign(static_cast<std::size_t>(width) * height, cv::Point3f(0, 0, 0));
+        arena.masks[k].assign(static_cast<std::size_t>(width) * height, 0);
+
+        int x0 = std::max(-gap, -offsets[k].x);
+        int x1 = std::min(roi.width + gap, images[k]->cols - offsets[k].x);
+
+        for (int y = -gap; y < roi.height + gap; ++y) {
+            int src_y = offsets[k].y + y;
+
+            if ( src_y < 0 || src_y >= images[k]->rows ) {
+                continue;
+            }
+
+            const cv::Point3f* pixel = images[k]->ptr<cv::Point3f>(src_y) + offsets[k].x;
+            const uchar* mask        = masks[k]->ptr<uchar>(src_y) + offsets[k].x;
+            std::size_t row          = static_cast<std::size_t>(y + gap) * width + gap;
+
+            for (int x = x0; x < x1; ++x) {
+                arena.pixels[k][row + x] = pixel[x];
+                arena.masks[k][row + x]  = mask[x];
+            }
+        }
+    }
+
+    const cv::Point3f* pixels1 = arena.pixels[0].data();
+    const cv::Point3f* pixels2 = arena.pixels[1].data();
+    const uchar* submask1      = arena.masks[0].data();
+    const uchar* submask2      = arena.masks[1].data();
+
+    SeamGraph& graph = arena.graph;
+    graph.reset(width * height, (height - 1) * width + (width - 1) * height);
+
+    for (int v = 0; v < width * height; ++v) {
+        graph.addVertex();
+        graph.addTermWeights(v, submask1[v] ? terminal_cost : 0.f, submask2[v] ? terminal_cost : 0.f);
+    }
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int v = y * width + x;
+
+            if ( x < width - 1 ) {
+                float weight = seamColorCost(pixels1[v], pixels2[v]) + seamColorCost(pixels1[v + 1], pixels2[v + 1]) + weight_eps;
+
+                if ( ! submask1[v] || ! submask1[v + 1] || ! submask2[v] || ! submask2[v + 1] ) {
+                    weight += bad_region_penalty;
+                }
+
+                graph.addEdges(v, v + 1, weight, weight);
+            }
+
+            if ( y < height - 1 ) {
+                float weight = seamColorCost(pixels1[v], pixels2[v]) + seamColorCost(pixels1[v + width], pixels2[v + width]) + weight_eps;
+
+                if ( ! submask1[v] || ! submask1[v + width] || ! submask2[v] || ! submask2[v + width] ) {
+                    weight += bad_region_penalty;
+                }
+
+                graph.addEdges(v, v + width, weight, weight);
+            }
+        }
+    }
+
+    graph.maxFlow();
+
+    for (int y = 0; y < roi.height; ++y) {
+        uchar* row1 = mask1.ptr<uchar>(offsets[0].y + y) + offsets[0].x;
+        uchar* row2 = mask2.ptr<uchar>(offsets[1].y + y) + offsets[1].x;
+
+        for (int x = 0; x < roi.width; ++x) {
+            if ( graph.inSourceSegment((y + gap) * width + x + gap) ) {
+                if ( row1[x] ) {
+                    row2[x] = 0;
+                }
+            }
+            else if ( row2[x] ) {
+                row1[x] = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Clears the graph for a new cut, keeping the storage of earlier cuts.
+ * 
+ * @param vertex_count number of vertices of the new cut
+ * @param edge_count number of undirected edges of the new cut
+ */
+void SeamGraph::reset(int vertex_count, int edge_count) {
+    vertices.clear();
+    vertices.reserve(vertex_count);
+
+    // Edges come in pairs from index 2 on, so that 0 ends the edge lists and
+    // the reverse of edge e is e ^ 1
+    edges.clear();
+    edges.reserve(2 * edge_count + 2);
+    edges.resize(2, Edge{0, 0, 0.f});
+
+    flow = 0;
+}
+
+/**
+ * Adds a vertex without any edges.
+ * 
+ * @return index of the vertex
+ */
+int SeamGraph::addVertex() {
+    vertices.push_back(Vertex{nullptr, 0, 0, 0, 0, 0.f, 0});
+    return static_cast<int>(vertices.size()) - 1;
+}
+
+/**
+ * Adds an edge between two vertices in both directions.
+ * 
+ * @param i first vertex
+ * @param j second vertex
+ * @param weight capacity from i to j
+ * @param reverse_weight capacity from j to i
+ */
+void SeamGraph::addEdges(int i, int j, float weight, float reverse_weight) {
+    edges.push_back(Edge{j, vertices[i].first, weight});
+    vertices[i].first = static_cast<int>(edges.size()) - 1;
+
+    edges.push_back(Edge{i, vertices[j].first, reverse_weight});
+    vertices[j].first = static_cast<int>(edges.size()) - 1;
+}
+
+/**
+ * Adds capacities from the source and to the sink of a vertex. Only their
+ * difference is kept, the common part flows straight through.
+ * 
+ * @param i vertex
+ * @param source_weight capacity from the source
+ * @param sink_weight capacity to the sink
+ */
+void SeamGraph::addTermWeights(int i, float source_weight, float sink_weight) {
+    float dw = vertices[i].weight;
+
+    if ( dw > 0 ) {
+        source_weight += dw;
+    }
+    else {
+        sink_weight -= dw;
+    }
+
+    flow += source_weight < sink_weight ? source_weight : sink_weight;
+    vertices[i].weight = source_weight - sink_weight;
+}
+
+/**
+ * Computes the maximum flow, growing search trees from the source and the sink
+ * until they touch, augmenting along the path found and adopting the orphans it
+ * leaves. Same order of operations as cv::detail::GCGraph<float>::maxFlow(), so
+ * cuts are identical to those of cv::detail::GraphCutSeamFinder.
+ * 
+ * @return maximum flow
+ */
+float SeamGraph::maxFlow() {
+    const int TERMINAL = -1;
+    const int ORPHAN   = -2;
+
+    Vertex stub;
+    Vertex* nil   = &stub;
+    Vertex* first = nil;
+    Vertex* last  = nil;
+    int curr_ts   = 0;
+    stub.next     = nil;
+
+    Vertex* vtx = vertices.data();
+    Edge* edge  = edges.data();
+
+    orphans.clear();
+
+    // Every vertex with a terminal capacity starts out active
+    for (Vertex& v : vertices) {
+        v.ts = 0;
+
+        if ( v.weight != 0 ) {
+            last = last->next = &v;
+            v.dist   = 1;
+            v.parent = TERMINAL;
+            v.t      = v.weight < 0;
+        }
+        else {
+            v.parent = 0;
+        }
+    }
+
+    first = first->next;
+    last->next = nil;
+    nil->next  = nullptr;
+
+    for (;;) {
+        Vertex* v;
+        Vertex* u;
+        int e0 = -1, ei = 0, ej = 0;
+        float min_weight, weight;
+        uchar vt;
+
+        // Grow the source and sink trees until an edge connects them
+        while ( first != nil ) {
+            v = first;
+
+            if ( v->parent ) {
+                vt = v->t;
+
+                for (ei = v->first; ei != 0; ei = edge[ei].next) {
+                    if ( edge[ei ^ vt].weight == 0 ) {
+                        continue;
+                    }
+
+                    u = vtx + edge[ei].dst;
+
+                    if ( ! u->parent ) {
+                        u->t      = vt;
+                        u->parent = ei ^ 1;
+                        u->ts     = v->ts;
+                        u->dist   = v->dist + 1;
+
+                        if ( ! u->next ) {
+                            u->next = nil;
+                            last = last->next = u;
+                        }
+
+                        continue;
+                    }
+
+                    if ( u->t != vt ) {
+                        e0 = ei ^ vt;
+                        break;
+                    }
+
+                    if ( u->dist > v->dist + 1 && u->ts <= v->ts ) {
+                        u->parent = ei ^ 1;
+                        u->ts     = v->ts;
+                        u->dist   = v->dist + 1;
+                    }
+                }
+
+                if ( e0 > 0 ) {
+                    break;
+                }
+            }
+
+            first = first->next;
+            v->next = nullptr;
+        }
+
+        if ( e0 <= 0 ) {
+            break;
+        }
+
+        // Bottleneck of the path, k = 1 walks the source tree, k = 0 the sink tree
+        min_weight = edge[e0].weight;
+
+        for (int k = 1; k >= 0; --k) {
+            for (v = vtx + edge[e0 ^ k].dst;; v = vtx + edge[ei].dst) {
+                if ( (ei = v->parent) < 0 ) {
+                    break;
+                }
+
+                weight = edge[ei ^ k].weight;
+                min_weight = std::min(min_weight, weight);
+            }
+
+            weight = std::fabs(v->weight);
+            min_weight = std::min(min_weight, weight);
+        }
+
+        // Augment along the path, saturated edges leave orphans behind
+        edge[e0].weight -= min_weight;
+        edge[e0 ^ 1].weight += min_weight;
+        flow += min_weight;
+
+        for (int k = 1; k >= 0; --k) {
+            for (v = vtx + edge[e0 ^ k].dst;; v = vtx + edge[ei].dst) {
+                if ( (ei = v->parent) < 0 ) {
+                    break;
+                }
+
+                edge[ei ^ (k ^ 1)].weight += min_weight;
+
+                if ( (edge[ei ^ k].weight -= min_weight) == 0 ) {
+                    orphans.push_back(v);
+                    v->parent = ORPHAN;
+                }
+            }
+
+            v->weight = v->weight + min_weight * (1 - k * 2);
+
+            if ( v->weight == 0 ) {
+                orphans.push_back(v);
+                v->parent = ORPHAN;
+            }
+        }
+
+        // Adopt the orphans into their trees again or release them
+        curr_ts++;
+
+        while ( ! orphans.empty() ) {
+            Vertex* orphan = orphans.back();
+            orphans.pop_back();
+
+            int d, min_dist = INT_MAX;
+            e0 = 0;
+            vt = orphan->t;
+
+            for (ei = orphan->first; ei != 0; ei = edge[ei].next) {
+                if ( edge[ei ^ (vt ^ 1)].weight == 0 ) {
+                    continue;
+                }
+
+                u = vtx + edge[ei].dst;
+
+                if ( u->t != vt || u->parent == 0 ) {
+                    continue;
+                }
+
+                // Distance to the root of the tree
+                for (d = 0;;) {
+                    if ( u->ts == curr_ts ) {
+                        d += u->dist;
+                        break;
+                    }
+
+                    ej = u->parent;
+                    d++;
+
+                    if ( ej < 0 ) {
+                        if ( ej == ORPHAN ) {
+                            d = INT_MAX - 1;
+                        }
+                        else {
+                            u->ts   = curr_ts;
+                            u->dist = 1;
+                        }
+
+                        break;
+                    }
+
+                    u = vtx + edge[ej].dst;
+                }
+
+                if ( ++d < INT_MAX ) {
+                    if ( d < min_dist ) {
+                        min_dist = d;
+                        e0 = ei;
+                    }
+
+                    for (u = vtx + edge[ei].dst; u->ts != curr_ts; u = vtx + edge[u->parent].dst) {
+                        u->ts   = curr_ts;
+                        u->dist = --d;
+                    }
+                }
+            }
+
+            if ( (orphan->parent = e0) > 0 ) {
+                orphan->ts   = curr_ts;
+                orphan->dist = min_dist;
+                continue;
+            }
+
+            // No parent found, the neighbours become active and their children orphans
+            orphan->ts = 0;
+
+            for (ei = orphan->first; ei != 0; ei = edge[ei].next) {
+                u = vtx + edge[ei].dst;
+                ej = u->parent;
+
+                if ( u->t != vt || ! ej ) {
+                    continue;
+                }
+
+                if ( edge[ei ^ (vt ^ 1)].weight && ! u->next ) {
+                    u->next = nil;
+                    last = last->next = u;
+                }
+
+                if ( ej > 0 && vtx + edge[ej].dst == orphan ) {
+                    orphans.push_back(u);
+                    u->parent = ORPHAN;
+                }
+            }
+        }
+    }
+
+    return flow;
+}
+
+/**
+ * Tells on which side of the cut a vertex ended up.
+ * 
+ * @param i vertex
+ * 
+ * @return true if the vertex stayed connected to the source
+ */
+bool SeamGraph::inSourceSegment(int i) const {
+    return vertices[i].t == 0;
+}
+
+/**
+ * Finds graph cut seams on a copy of the warped images downscaled once more, which
+ * cuts the size of every graph by four, and upsamples the resulting masks. Masks are
+ * upsampled with linear interpolation and keep every pixel next to a kept one, so
+ * that neighbouring images overlap along the seams rather than leave gaps.
+ * 
+ * @param images warped images, CV_32FC3
+ * @param corners top left corners of the warped images
+ * @param masks warped masks, cut along the seams in place
+ */
+void findLowResSeams(const std::vector<cv::UMat>& images, const std::vector<cv::Point>& corners,
+                     std::vector<cv::UMat>& masks) {
+    const double scale = 0.5;
+
+    std::size_t num_images = images.size();
+
+    std::vector<cv::UMat> images_low(num_images), masks_low(num_images);
+    std::vector<cv::Point> corners_low(num_images);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        cv::Size size(std::max(1, cvRound(images[i].cols * scale)), std::max(1, cvRound(images[i].rows * scale)));
+
+        cv::resize(images[i], images_low[i], size, 0, 0, cv::INTER_AREA);
+        cv::resize(masks[i], masks_low[i], size, 0, 0, cv::INTER_NEAREST);
+        corners_low[i] = cv::Point(cvRound(corners[i].x * scale), cvRound(corners[i].y * scale));
+    }
+
+    findPairwiseSeams(images_low, corners_low, masks_low);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        cv::UMat mask;
+        cv::resize(masks_low[i], mask, masks[i].size(), 0, 0, cv::INTER_LINEAR);
+        cv::compare(mask, 0, mask, cv::CMP_GT);
+        cv::bitwise_and(mask, masks[i], masks[i]);
+    }
+}
+
+/**
+ * Composites the panorama in memory. Every image is warped at compositing resolution,
+ * gain compensated, cut along its seam and fed to the multi-band blender, just as
+ * cv::Stitcher composes its result. Warping, the warped mask and the gains are one
+ * pass over each image. Feather blending goes further: each image gets its feather
+ * weight from its own seam, and is sampled, gain compensated, weighted and accumulated
+ * into the canvas in a single pass, so that neither a warped copy of an image nor the
+ * weights of the others are ever stored. With auto-crop, warping and blending are
+ * restricted to the crop from the start. The result is kept in tiles, and only the
+ * tiles some image reaches are ever allocated.
+ * 
+ * @param images input images
+ * @param registration cameras and indices of the images making up the panorama
+ * @param settings stitching pipeline settings
+ * @param panorama resulting panorama, in tiles
+ * @param tables optional cached warp tables, which replace warping with a lookup and
+ *               provide the seams and gains
+ * 
+ * @return true if the panorama was composited
+ */
+bool compositePanorama(const std::vector<Image>& images, const Registration& registration,
+                       const Settings& settings, TileCanvas& panorama, const WarpTables* tables) {
+    std::size_t num_images = registration.indices.size();
+
+    Seams seams;
+
+    if ( tables ) {
+        seams = tables->seams;
+    }
+    else {
+        estimateSeams(images, registration, settings, seams);
+    }
+
+    double compose_scale = tables ? tables->compose_scale : compositingScale(images, registration, settings);
+
+    std::vector<cv::detail::CameraParams> cameras;
+    scaleCameras(registration, compose_scale, cameras);
+
+    float surface_scale = static_cast<float>(seams.warped_scale * compose_scale);
+
+    cv::Ptr<cv::detail::RotationWarper> warper = createWarper(settings)->create(surface_scale);
+
+    std::vector<cv::Rect> footprints(num_images);
+    std::vector<cv::Mat> gain_maps;
+
+    seams.compensator->getMatGains(gain_maps);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        if ( tables ) {
+            footprints[i] = tables->masks[i].roi();
+        }
+        else {
+            footprints[i] = warpedRoi(images[registration.indices[i]], cameras[i], compose_scale, warper);
+        }
+    }
+
+    // Only the parts of the footprints inside the crop are warped and blended, images
+    // outside of it are left out altogether
+    cv::Rect crop = settings.auto_crop ? autoCrop(seams, compose_scale) : cv::Rect();
+
+    std::vector<std::size_t> composited;
+    std::vector<cv::Rect> areas(num_images);
+    std::vector<cv::Point> corners;
+    std::vector<cv::Size> sizes;
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        areas[i] = crop.empty() ? footprints[i] : (footprints[i] & crop);
+
+        if ( ! areas[i].empty() ) {
+            composited.push_back(i);
+            corners.push_back(areas[i].tl());
+            sizes.push_back(areas[i].size());
+        }
+    }
+
+    if ( settings.blend == BlendType::FEATHER ) {
+        // Same weights as cv::detail::FeatherBlender, but each image only keeps its own
+        // while it is accumulated. The canvas and weight sum are divided once at the end
+        const float sharpness  = 0.02f;
+        const float weight_eps = 1e-5f;
+
+        // Canvas and weight sum only hold the tiles some cut mask reaches
+        cv::Rect canvas_roi = cv::detail::resultRoi(corners, sizes);
+        TileCanvas canvas(canvas_roi, settings.tile_size, CV_32FC3);
+        TileCanvas weight_sum(canvas_roi, settings.tile_size, CV_32F);
+
+        for (std::size_t i : composited) {
+            RowCoordinates coordinates;
+            Image image, mask_warped, seam_mask, weight;
+            RunMask warped_runs;
+
+            composeImage(images[registration.indices[i]], compose_scale, image);
+
+            if ( tables ) {
+                cv::Rect local = areas[i] - footprints[i].tl();
+                coordinates = tableCoordinates(tables->maps[i](local), tables->weights[i](local));
+                warped_runs = tables->masks[i];
+            }
+            else {
+                SurfaceProjector projector(settings.projection, surface_scale, cameras[i]);
+                coordinates = projectorCoordinates(projector, areas[i]);
+                warpMask(image.size(), coordinates, areas[i].size(), mask_warped);
+                warped_runs = RunMask(mask_warped, areas[i].tl());
+            }
+
+            // Warped mask cut along the seam as runs, weighted by the distance to its border
+            seamArea(seams.masks[i], footprints[i], areas[i], seam_mask);
+            RunMask cut = RunMask(seam_mask, areas[i].tl()).bitwiseAnd(warped_runs);
+            cut.decode(areas[i], mask_warped);
+            cv::distanceTransform(mask_warped, weight, cv::DIST_L1, 3);
+            cv::threshold(weight * sharpness, weight, 1., 1., cv::THRESH_TRUNC);
+
+            for (int index = 0; index < canvas.tiles(); ++index) {
+                if ( cut.any(canvas.tile(index)) ) {
+                    canvas.allocate(index);
+                    weight_sum.allocate(index);
+                }
+            }
+
+            GainField gains {gain_maps[i], footprints[i]};
+            featherArea(image, coordinates, areas[i], gains, weight, canvas, weight_sum);
+        }
+
+        std::vector<int> occupied;
+        panorama = TileCanvas(canvas_roi, settings.tile_size, CV_8UC3);
+
+        for (int index = 0; index < canvas.tiles(); ++index) {
+            if ( canvas.occupied(index) ) {
+                occupied.push_back(index);
+                panorama.allocate(index);
+            }
+        }
+
+        // Each tile is divided by its weight sum and dropped once converted
+        cv::parallel_for_(cv::Range(0, static_cast<int>(occupied.size())), [&](const cv::Range& range) {
+            for (int t = range.start; t < range.end; ++t) {
+                int index = occupied[t];
+                const cv::Mat& sum = weight_sum.at(index);
+                const cv::Mat& in  = canvas.at(index);
+                cv::Mat& out       = panorama.at(index);
+
+                for (int v = 0; v < in.rows; ++v) {
+                    const float* p = in.ptr<float>(v);
+                    const float* w = sum.ptr<float>(v);
+                    uchar* o       = out.ptr<uchar>(v);
+
+                    for (int u = 0; u < in.cols; ++u) {
+                        float norm = 1.f / (w[u] + weight_eps);
+
+                        for (int c = 0; c < 3; ++c) {
+                            o[3 * u + c] = cv::saturate_cast<uchar>(p[3 * u + c] * norm);
+                        }
+                    }
+                }
+
+                canvas.release(index);
+                weight_sum.release(index);
+            }
+        });
+
+        return ! occupied.empty();
+    }
+
+    cv::Ptr<cv::detail::Blender> blender = createBlender(settings);
+    blender->prepare(corners, sizes);
+
+    for (std::size_t i : composited) {
+        Image image;
+        composeImage(images[registration.indices[i]], compose_scale, image);
+
+        Image image_warped, image_warped_s, mask_warped, seam_mask;
+
+        if ( tables ) {
+            cv::Rect local = areas[i] - footprints[i].tl();
+            cv::remap(image, image_warped, tables->maps[i](local), tables->weights[i](local), cv::INTER_LINEAR, cv::BORDER_REFLECT);
+            tables->masks[i].decode(areas[i], mask_warped);
+
+            if ( areas[i] == footprints[i] ) {
+                seams.compensator->apply(static_cast<int>(i), areas[i].tl(), image_warped, mask_warped);
+            }
+            else {
+                Image gains;
+                resampleArea(gain_maps[i], footprints[i], areas[i], cv::INTER_LINEAR, gains);
+                applyGains(gains, image_warped);
+            }
+        }
+        else {
+            // Image, mask and gains in a single pass over the area
+            GainField gains {gain_maps[i], footprints[i]};
+            SurfaceProjector projector(settings.projection, surface_scale, cameras[i]);
+
+            warpArea(image, projector, areas[i], cv::INTER_LINEAR, cv::BORDER_REFLECT,
+                     image_warped, &mask_warped, &gains);
+        }
+
+        image_warped.convertTo(image_warped_s, CV_16S);
+
+        // Seam masks are upscaled from seam resolution and cut against the warped mask,
+        // both as runs, which only decode the cut for the blender
+        RunMask warped_runs = tables ? tables->masks[i] : RunMask(mask_warped, areas[i].tl());
+        seamArea(seams.masks[i], footprints[i], areas[i], seam_mask);
+        RunMask(seam_mask, areas[i].tl()).bitwiseAnd(warped_runs).decode(areas[i], mask_warped);
+
+        blender->feed(image_warped_s, mask_warped, areas[i].tl());
+    }
+
+    // The tiled blender writes straight into tiles, the stock ones into a dense canvas
+    TiledMultiBandBlender* tiled = dynamic_cast<TiledMultiBandBlender*>(blender.get());
+
+    if ( tiled ) {
+        TileCanvas result_mask;
+        tiled->blend(panorama, result_mask);
+    }
+    else {
+        Image result, result_mask, result_8u;
+        blender->blend(result, result_mask);
+        result.convertTo(result_8u, CV_8U);
+
+        panorama = TileCanvas(cv::detail::resultRoi(corners, sizes), settings.tile_size, CV_8UC3);
+        panorama.paste(result_8u);
+    }
+
+    return panorama.roi().area() > 0;
+}
+
+/**
+ * Precomputes the warp of every image of a calibrated rig at compositing resolution.
+ * Maps are stored in the fixed point form cv::remap() uses internally, integer
+ * coordinates plus an index into its interpolation weight table, so that later
+ * shots only have to look the pixels up. Warped masks are kept as runs. Seams and
+ * exposure gains are estimated once here and fixed along with the cameras.
+ * 
+ * @param images input images
+ * @param registration cameras and indices of the images making up the panorama
+ * @param settings stitching pipeline settings
+ * @param tables resulting warp tables
+ */
+void buildWarpTables(const std::vector<Image>& images, const Registration& registration,
+                     const Settings& settings, WarpTables& tables) {
+    std::size_t num_images = registration.indices.size();
+
+    tables.registration  = registration;
+    tables.projection    = settings.projection;
+    tables.compose_scale = compositingScale(images, registration, settings);
+    tables.image_sizes.clear();
+
+    for (const Image& image : images) {
+        tables.image_sizes.push_back(image.size());
+    }
+
+    std::vector<cv::detail::CameraParams> cameras;
+    scaleCameras(registration, tables.compose_scale, cameras);
+
+    cv::Ptr<cv::detail::RotationWarper> warper =
+        createWarper(settings)->create(static_cast<float>(surfaceScale(registration) * tables.compose_scale));
+
+    tables.corners.resize(num_images);
+    tables.maps.resize(num_images);
+    tables.weights.resize(num_images);
+    tables.masks.resize(num_images);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        Image image;
+        composeImage(images[registration.indices[i]], tables.compose_scale, image);
+
+        Image mask(image.size(), CV_8U, cv::Scalar::all(255));
+        Image xmap, ymap, mask_warped;
+
+        cv::Mat K;
+        cameras[i].K().convertTo(K, CV_32F);
+
+        tables.corners[i] = warper->buildMaps(image.size(), K, cameras[i].R, xmap, ymap).tl();
+        cv::convertMaps(xmap, ymap, tables.maps[i], tables.weights[i], CV_16SC2);
+
+        warper->warp(mask, K, cameras[i].R, cv::INTER_NEAREST, cv::BORDER_CONSTANT, mask_warped);
+        tables.masks[i] = RunMask(mask_warped, tables.corners[i]);
+    }
+
+    tables.seam_finder = settings.seam_finder;
+    estimateSeams(images, registration, settings, tables.seams);
+}
+
+/**
+ * Saves warp tables together with the rig calibration. Tables are written as base64
+ * and compressed when the filename ends in .gz.
+ * 
+ * @param filename YAML, XML or JSON file, as supported by cv::FileStorage
+ * @param tables warp tables to save
+ * 
+ * @return true if the tables were saved
+ */
+bool saveWarpTables(const Filename& filename, const WarpTables& tables) {
+    try {
+        cv::FileStorage fs(filename, cv::FileStorage::WRITE_BASE64);
+
+        if ( ! fs.isOpened() ) {
+            return false;
+        }
+
+        fs << "projection" << static_cast<int>(tables.projection);
+        fs << "compose_scale" << tables.compose_scale;
+        fs << "image_sizes" << tables.image_sizes;
+        fs << "indices" << tables.registration.indices;
+        fs << "cameras" << "[";
+
+        for (const cv::detail::CameraParams& camera : tables.registration.cameras) {
+            fs << "{" << "focal" << camera.focal << "aspect" << camera.aspect
+               << "ppx" << camera.ppx << "ppy" << camera.ppy
+               << "R" << camera.R << "t" << camera.t << "}";
+        }
+
+        fs << "]";
+        fs << "corners" << tables.corners;
+        fs << "maps" << tables.maps;
+        fs << "weights" << tables.weights;
+        fs << "mask_runs" << "[";
+
+        for (const RunMask& mask : tables.masks) {
+            fs << "{";
+            mask.write(fs);
+            fs << "}";
+        }
+
+        fs << "]";
+
+        // Seam masks at seam resolution keep their corner as the origin of their runs
+        std::vector<cv::Mat> gain_maps;
+        tables.seams.compensator->getMatGains(gain_maps);
+
+        fs << "seam_finder" << static_cast<int>(tables.seam_finder);
+        fs << "seam_scale" << tables.seams.seam_scale;
+        fs << "seam_runs" << "[";
+
+        for (std::size_t i = 0; i < tables.seams.masks.size(); ++i) {
+            fs << "{";
+            RunMask(tables.seams.masks[i].getMat(cv::ACCESS_READ), tables.seams.corners[i]).write(fs);
+            fs << "}";
+        }
+
+        fs << "]";
+        fs << "gain_maps" << gain_maps;
+
+        return true;
+    }
+    catch (const cv::Exception&) {
+        return false;
+    }
+}
+
+/**
+ * Loads cached warp tables. The tables are only used when they were made for the
+ * same surface, compositing resolution, image sizes, seam finder and seam resolution.
+ * 
+ * @param filename file written by saveWarpTables()
+ * @param images input images the tables should apply to
+ * @param settings stitching pipeline settings
+ * @param tables loaded warp tables
+ * 
+ * @return true if the tables were loaded and match the images
+ */
+bool loadWarpTables(const Filename& filename, const std::vector<Image>& images,
+                    const Settings& settings, WarpTables& tables) {
+    std::vector<cv::Mat> gain_maps;
+
+    try {
+        cv::FileStorage fs(filename, cv::FileStorage::READ);
+
+        if ( ! fs.isOpened() ) {
+            return false;
+        }
+
+        int projection;
+        fs["projection"] >> projection;
+        fs["compose_scale"] >> tables.compose_scale;
+        fs["image_sizes"] >> tables.image_sizes;
+        fs["indices"] >> tables.registration.indices;
+
+        tables.projection = static_cast<Projection>(projection);
+        tables.registration.affine = tables.projection == Projection::AFFINE;
+        tables.registration.cameras.clear();
+
+        for (const cv::FileNode& node : fs["cameras"]) {
+            cv::detail::CameraParams camera;
+            node["focal"] >> camera.focal;
+            node["aspect"] >> camera.aspect;
+            node["ppx"] >> camera.ppx;
+            node["ppy"] >> camera.ppy;
+            node["R"] >> camera.R;
+            node["t"] >> camera.t;
+            tables.registration.cameras.push_back(camera);
+        }
+
+        fs["corners"] >> tables.corners;
+        fs["maps"] >> tables.maps;
+        fs["weights"] >> tables.weights;
+        tables.masks.clear();
+
+        for (const cv::FileNode& node : fs["mask_runs"]) {
+            RunMask mask;
+            mask.read(node);
+            tables.masks.push_back(mask);
+        }
+
+        int seam_finder = -1;
+        fs["seam_finder"] >> seam_finder;
+        fs["seam_scale"] >> tables.seams.seam_scale;
+
+        tables.seam_finder = static_cast<SeamType>(seam_finder);
+        tables.seams.warped_scale = surfaceScale(tables.registration);
+        tables.seams.corners.clear();
+        tables.seams.masks.clear();
+
+        for (const cv::FileNode& node : fs["seam_runs"]) {
+            RunMask mask;
+            mask.read(node);
+
+            Image decoded;
+            cv::UMat seam_mask;
+            mask.decode(mask.roi(), decoded);
+            decoded.copyTo(seam_mask);
+
+            tables.seams.corners.push_back(mask.roi().tl());
+            tables.seams.masks.push_back(seam_mask);
+        }
+
+        fs["gain_maps"] >> gain_maps;
+        tables.seams.compensator = cv::makePtr<BlockGainCompensator>();
+        tables.seams.compensator->setMatGains(gain_maps);
+    }
+    catch (const cv::Exception&) {
+        return false;
+    }
+
+    std::size_t num_images = tables.registration.indices.size();
+
+    // Scans detected at calibration time stay valid unless the affine pipeline is turned off
+    bool surface = tables.registration.affine ? settings.scans != ScansMode::OFF
+                                              : tables.projection == settings.projection && settings.scans != ScansMode::ON;
+
+    bool valid = surface
+              && tables.image_sizes.size() == images.size()
+              && tables.registration.cameras.size() == num_images
+              && tables.corners.size() == num_images
+              && tables.maps.size() == num_images
+              && tables.weights.size() == num_images
+              && tables.masks.size() == num_images
+              && tables.seams.masks.size() == num_images
+              && gain_maps.size() == num_images
+              && tables.seam_finder == settings.seam_finder
+              && num_images > 1;
+
+    // Runs that failed validation were read back as empty masks
+    for (std::size_t i = 0; valid && i < num_images; ++i) {
+        valid = tables.masks[i].size() == tables.maps[i].size() && ! tables.seams.masks[i].empty();
+    }
+
+    for (std::size_t i = 0; valid && i < images.size(); ++i) {
+        valid = tables.image_sizes[i] == images[i].size();
+    }
+
+    for (std::size_t i = 0; valid && i < num_images; ++i) {
+        valid = 0 <= tables.registration.indices[i] && tables.registration.indices[i] < static_cast<int>(images.size());
+    }
+
+    // Seams are only reused at the resolution they were found at
+    if ( valid ) {
+        double seam_scale = scaleForResolution(images[tables.registration.indices[0]], settings.seam_estimation_resol);
+        valid = std::abs(tables.seams.seam_scale - seam_scale) < 1e-9;
+    }
+
+    if ( ! valid ) {
+        std::cout << YELLOW;
+        std::cout << "Cached warp tables don't match this rig, recalibrating" << std::endl;
+    }
+
+    return valid;
+}
+
+/**
+ * Composites the panorama tile by tile straight into a tiled BigTIFF on disk, so
+ * that the full canvas never has to be held in memory. For each output tile only the
+ * images whose seams reach it are warped, and only within the tile. A guard band
+ * around every tile gives the multi-band blender enough context for its pyramid, so
+ * peak memory is bounded by the tile size and the number of overlapping images.
+ * Tiles no image reaches, such as the corners of a spherical panorama, are neither
+ * warped nor blended and share one stored empty tile in the file.
+ * 
+ * @param images input images
+ * @param registration cameras and indices of the images making up the panorama
+ * @param settings stitching pipeline settings
+ * @param filename output BigTIFF file
+ * 
+ * @return true if the panorama was written
+ */
+bool compositeTiled(const std::vector<Image>& images, const Registration& registration,
+                    const Settings& settings, const Filename& filename) {
+    const int num_bands = 5;
+    const int guard     = 4 << num_bands;
+
+    std::size_t num_images = registration.indices.size();
+
+    Seams seams;
+    estimateSeams(images, registration, settings, seams);
+
+    double compose_scale = compositingScale(images, registration, settings);
+    float surface_scale  = static_cast<float>(seams.warped_scale * compose_scale);
+
+    std::vector<cv::detail::CameraParams> cameras;
+    scaleCameras(registration, compose_scale, cameras);
+
+    cv::Ptr<cv::detail::RotationWarper> warper = createWarper(settings)->create(surface_scale);
+
+    // Images at compositing resolution, their warped footprints and block gains
+    std::vector<Image> compose_images(num_images);
+    std::vector<cv::Rect> rois(num_images);
+    std::vector<cv::Mat> gain_maps;
+    cv::Rect canvas;
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        const Image& image = images[registration.indices[i]];
+        composeImage(image, compose_scale, compose_images[i]);
+
+        rois[i] = warpedRoi(image, cameras[i], compose_scale, warper);
+        canvas  = i == 0 ? rois[i] : (canvas | rois[i]);
+    }
+
+    if ( settings.auto_crop ) {
+        cv::Rect crop = autoCrop(seams, compose_scale) & canvas;
+        canvas = crop.empty() ? canvas : crop;
+    }
+
+    seams.compensator->getMatGains(gain_maps);
+
+    // Tiles each image can contribute to, from its seam mask at seam resolution
+    TileMap tiles(canvas, settings.tile_size, guard);
+
+    for (std::size_t i = 0; i < num_images; ++i) {
+        tiles.cover(static_cast<int>(i), seams.masks[i].getMat(cv::ACCESS_READ), rois[i]);
+    }
+
+    TiledTiffWriter writer;
+
+    if ( ! writer.open(filename, canvas.size(), settings.tile_size) ) {
+        return false;
+    }
+
+    for (int ty = 0; ty < tiles.rows(); ++ty) {
+        for (int tx = 0; tx < tiles.columns(); ++tx) {
+            int index = ty * tiles.columns() + tx;
+
+            if ( ! tiles.occupied(index) ) {
+                if ( ! writer.writeEmpty(index) ) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            cv::Rect tile    = tiles.tile(index);
+            cv::Rect guarded = tiles.guarded(index);
+
+            Image tile_image(settings.tile_size, settings.tile_size, CV_8UC3, cv::Scalar::all(0));
+            cv::detail::MultiBandBlender blender(false, num_bands);
+            bool fed = false;
+
+            for (int i : tiles.images(index)) {
+                cv::Rect area = guarded & rois[i];
+
+                // Gains are stretched over the footprint while warping this area only
+                Image image_warped, image_warped_s, mask_warped, seam_mask;
+                GainField gains {gain_maps[i], rois[i]};
+                SurfaceProjector projector(settings.projection, surface_scale, cameras[i]);
+                warpArea(compose_images[i], projector, area, cv::INTER_LINEAR, cv::BORDER_REFLECT,
+                         image_warped, &mask_warped, &gains);
+
+                if ( cv::countNonZero(mask_warped) == 0 ) {
+                    continue;
+                }
+
+                // Seam masks are resampled from seam resolution for this area only
+                resampleArea(seams.masks[i].getMat(cv::ACCESS_READ), rois[i], area, cv::INTER_LINEAR, seam_mask);
+                cv::bitwise_and(seam_mask, mask_warped, mask_warped);
+
+                if ( ! fed ) {
+                    blender.prepare(guarded);
+                    fed = true;
+                }
+
+                image_warped.convertTo(image_warped_s, CV_16S);
+                blender.feed(image_warped_s, mask_warped, area.tl());
+            }
+
+            if ( fed ) {
+                Image result, result_mask;
+                blender.blend(result, result_mask);
+
+                cv::Rect inner = tile - guarded.tl();
+                result(inner).convertTo(tile_image(cv::Rect(cv::Point(0, 0), inner.size())), CV_8U);
+            }
+
+            if ( ! writer.write(index, tile_image) ) {
+                return false;
+            }
+        }
+
+        std::cout << CYAN;
+        std::cout << "Composited tile row " << ty + 1 << " of " << tiles.rows() << std::endl;
+    }
+
+    return writer.close();
+}
+
+/**
+ * Creates an empty tile map over the canvas.
+ * 
+ * @param canvas area of the panorama
+ * @param tile_size width and height of the tiles
+ * @param guard width of the band around each tile the blender looks at
+ */
+TileMap::TileMap(cv::Rect canvas, int tile_size, int guard)
+    : canvas(canvas), tile_size(tile_size), guard(guard),
+      tiles_x((canvas.width  + tile_size - 1) / tile_size),
+      tiles_y((canvas.height + tile_size - 1) / tile_size),
+      tile_images(static_cast<std::size_t>(tiles_x) * tiles_y) {}
+
+/**
+ * Adds an image to the tiles its seam mask reaches. The mask is checked at seam
+ * resolution over each guarded tile widened by a pixel, which covers every pixel the
+ * upscaled mask could set, so a tile is never missed and seldom added needlessly.
+ * 
+ * @param image index of the image
+ * @param seam_mask seam mask of the image at seam resolution
+ * @param footprint warped footprint of the image at compositing resolution
+ */
+void TileMap::cover(int image, const cv::Mat& seam_mask, cv::Rect footprint) {
+    double sx = static_cast<double>(seam_mask.cols) / footprint.width;
+    double sy = static_cast<double>(seam_mask.rows) / footprint.height;
+
+    cv::Rect reach(footprint.x - guard, footprint.y - guard, footprint.width + 2 * guard, footprint.height + 2 * guard);
+    reach &= canvas;
+
+    int tx0 = (reach.x - canvas.x) / tile_size, tx1 = (reach.br().x - 1 - canvas.x) / tile_size;
+    int ty0 = (reach.y - canvas.y) / tile_size, ty1 = (reach.br().y - 1 - canvas.y) / tile_size;
+
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            int index = ty * tiles_x + tx;
+            cv::Rect area = guarded(index) & footprint;
+
+            if ( area.empty() ) {
+                continue;
+            }
+
+            cv::Point tl(cvFloor((area.x - footprint.x) * sx) - 1, cvFloor((area.y - footprint.y) * sy) - 1);
+            cv::Point br(cvCeil((area.br().x - footprint.x) * sx) + 1, cvCeil((area.br().y - footprint.y) * sy) + 1);
+            cv::Rect low_res = cv::Rect(tl, br) & cv::Rect(cv::Point(), seam_mask.size());
+
+            if ( ! low_res.empty() && cv::countNonZero(seam_mask(low_res)) > 0 ) {
+                tile_images[index].push_back(image);
+            }
+        }
+    }
+}
+
+/**
+ * Adds an image to the tiles its run mask reaches, guard band included. Only the runs
+ * are looked at, so tiles are found without decoding the mask.
+ * 
+ * @param image index of the image
+ * @param mask mask of the image on the panorama surface
+ */
+void TileMap::cover(int image, const RunMask& mask) {
+    cv::Rect bounds = mask.roi();
+    cv::Rect reach(bounds.x - guard, bounds.y - guard, bounds.width + 2 * guard, bounds.height + 2 * guard);
+    reach &= canvas;
+
+    if ( reach.empty() ) {
+        return;
+    }
+
+    int tx0 = (reach.x - canvas.x) / tile_size, tx1 = (reach.br().x - 1 - canvas.x) / tile_size;
+    int ty0 = (reach.y - canvas.y) / tile_size, ty1 = (reach.br().y - 1 - canvas.y) / tile_size;
+
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            int index = ty * tiles_x + tx;
+
+            if ( mask.any(guarded(index)) ) {
+                tile_images[index].push_back(image);
+            }
+        }
+    }
+}
+
+/**
+ * Area of a tile on the panorama surface, clipped to the canvas.
+ * 
+ * @param index tile index, in row major order
+ * 
+ * @return area of the tile
+ */
+cv::Rect TileMap::tile(int index) const {
+    cv::Rect area(canvas.x + (index % tiles_x) * tile_size, canvas.y + (index / tiles_x) * tile_size, tile_size, tile_size);
+
+    return area & canvas;
+}
+
+/**
+ * Area of a tile together with its guard band, clipped to the canvas.
+ * 
+ * @param index tile index, in row major order
+ * 
+ * @return guarded area of the tile
+ */
+cv::Rect TileMap::guarded(int index) const {
+    cv::Rect area = tile(index);
+    area = cv::Rect(area.x - guard, area.y - guard, area.width + 2 * guard, area.height + 2 * guard);
+
+    return area & canvas;
+}
+
+/**
+ * Creates an empty tile store over a canvas. No tile is allocated until written to.
+ * 
+ * @param canvas area of the panorama
+ * @param tile_size width and height of the tiles
+ * @param type pixel type of the tiles
+ */
+TileCanvas::TileCanvas(cv::Rect canvas, int tile_size, int type)
+    : canvas(canvas), tile_size(tile_size), type(type),
+      tiles_x((canvas.width  + tile_size - 1) / tile_size),
+      tiles_y((canvas.height + tile_size - 1) / tile_size),
+      data(tiles_x * tiles_y) {}
+
+/**
+ * Index of the tile holding a pixel of the canvas.
+ * 
+ * @param x column on the panorama surface, inside the canvas
+ * @param y row on the panorama surface, inside the canvas
+ * 
+ * @return tile index, in row major order
+ */
+int TileCanvas::index(int x, int y) const {
+    return (y - canvas.y) / tile_size * tiles_x + (x - canvas.x) / tile_size;
+}
+
+/**
+ * Area of a tile on the panorama surface, clipped to the canvas. The tile itself is
+ * always tile_size x tile_size, its pixels past the canvas are unused.
+ * 
+ * @param index tile index, in row major order
+ * 
+ * @return area of the tile
+ */
+cv::Rect TileCanvas::tile(int index) const {
+    cv::Rect area(canvas.x + (index % tiles_x) * tile_size, canvas.y + (index / tiles_x) * tile_size, tile_size, tile_size);
+
+    return area & canvas;
+}
+
+/**
+ * Allocates a tile filled with zeros, unless it is already allocated.
+ * 
+ * @param index tile index, in row major order
+ * 
+ * @return the tile
+ */
+cv::Mat& TileCanvas::allocate(int index) {
+    if ( data[index].empty() ) {
+        data[index] = cv::Mat(tile_size, tile_size, type, cv::Scalar::all(0));
+    }
+
+    return data[index];
+}
+
+/**
+ * Copies a dense image covering the whole canvas into the store. Tiles that would
+ * only hold zeros are left unallocated.
+ * 
+ * @param image image the size of the canvas, of the type of the store
+ */
+void TileCanvas::paste(const cv::Mat& image) {
+    CV_Assert(image.size() == canvas.size() && image.type() == type);
+
+    for (int index = 0; index < tiles(); ++index) {
+        cv::Rect area = tile(index);
+        cv::Mat part  = image(area - canvas.tl());
+
+        if ( cv::countNonZero(part.reshape(1)) > 0 ) {
+            part.copyTo(allocate(index)(cv::Rect(cv::Point(), area.size())));
+        }
+    }
+}
+
+/**
+ * Makes the store dense, with unallocated tiles black.
+ * 
+ * @param dst image the size of the canvas
+ */
+void TileCanvas::copyTo(cv::Mat& dst) const {
+    dst.create(canvas.size(), type);
+
+    for (int index = 0; index < tiles(); ++index) {
+        cv::Rect area = tile(index);
+        cv::Mat part  = dst(area - canvas.tl());
+
+        if ( occupied(index) ) {
+            data[index](cv::Rect(cv::Point(), area.size())).copyTo(part);
+        }
+        else {
+            part.setTo(cv::Scalar::all(0));
+        }
+    }
+}
+
+/**
+ * Writes a CV_8UC3 store straight to a tiled BigTIFF with the same tiles, so the
+ * panorama is never made dense. The tile size must be a multiple of 16.
+ * 
+ * @param filename output file
+ * 
+ * @return true if the file was written
+ */
+bool TileCanvas::writeTiff(const Filename& filename) const {
+    TiledTiffWriter writer;
+
+    if ( ! writer.open(filename, canvas.size(), tile_size) ) {
+        return false;
+    }
+
+    bool written = true;
+
+    for (int index = 0; written && index < tiles(); ++index) {
+        written = occupied(index) ? writer.write(index, data[index]) : writer.writeEmpty(index);
+    }
+
+    return writer.close() && written;
+}
+
+/**
+ * Resamples a map covering the warped footprint of an image, such as a seam mask or a
+ * block gain map, onto a sub area of that footprint. Equivalent to resizing the map to
+ * the full footprint and cropping it, without ever allocating the full footprint.
+ * 
+ * @param map map covering the whole footprint at low resolution
+ * @param footprint warped footprint of the image at compositing resolution
+ * @param area area of the footprint to resample
+ * @param interpolation interpolation used for resampling
+ * @param result resampled map, the size of area
+ */
+void resampleArea(const cv::Mat& map, cv::Rect footprint, cv::Rect area, int interpolation, cv::Mat& result) {
+    double sx = static_cast<double>(map.cols) / footprint.width;
+    double sy = static_cast<double>(map.rows) / footprint.height;
+
+    // Same pixel centre convention as cv::resize
+    cv::Mat_<double> M(2, 3);
+    M << sx, 0, (area.x - footprint.x + 0.5) * sx - 0.5,
+         0, sy, (area.y - footprint.y + 0.5) * sy - 0.5;
+
+    cv::warpAffine(map, result, M, area.size(), interpolation | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+}
+
+/**
+ * Upscales the seam mask of an image onto an area of its footprint. The whole
+ * footprint is resized the same way as cv::Stitcher does, smaller areas are
+ * resampled without allocating the full footprint.
+ * 
+ * @param seam_mask seam mask at seam resolution
+ * @param footprint warped footprint of the image at compositing resolution
+ * @param area area of the footprint to upscale
+ * @param result seam mask of the area
+ */
+void seamArea(const cv::UMat& seam_mask, cv::Rect footprint, cv::Rect area, cv::Mat& result) {
+    if ( area == footprint ) {
+        cv::resize(seam_mask, result, footprint.size(), 0, 0, cv::INTER_LINEAR_EXACT);
+    }
+    else {
+        resampleArea(seam_mask.getMat(cv::ACCESS_READ), footprint, area, cv::INTER_LINEAR, result);
+    }
+}
+
+/**
+ * Finds the auto-crop of the panorama at compositing resolution: the largest axis
+ * aligned rectangle inside the union of the warped images. The union is taken from
+ * the seam masks, which cover every warped pixel once cut, and eroded by the margin
+ * the seams were dilated with. The rectangle is scaled up from seam resolution and
+ * pulled in by one seam pixel, so that upscaling never lets it reach the border.
+ * 
+ * @param seams seam masks and corners at seam resolution
+ * @param compose_scale compositing scale
+ * 
+ * @return crop on the panorama surface at compositing resolution, empty if none
+ */
+cv::Rect autoCrop(const Seams& seams, double compose_scale) {
+    std::vector<cv::Size> sizes;
+
+    for (const cv::UMat& mask : seams.masks) {
+        sizes.push_back(mask.size());
+    }
+
+    cv::Rect roi = cv::detail::resultRoi(seams.corners, sizes);
+    Image coverage(roi.size(), CV_8U, cv::Scalar::all(0));
+
+    for (std::size_t i = 0; i < seams.masks.size(); ++i) {
+        Image area = coverage(cv::Rect(seams.corners[i] - roi.tl(), sizes[i]));
+        cv::bitwise_or(area, seams.masks[i], area);
+    }
+
+    cv::erode(coverage, coverage, Image());
+
+    cv::Rect inside = largestInscribedRect(coverage);
+
+    if ( inside.empty() ) {
+        return cv::Rect();
+    }
+
+    double scale = compose_scale / seams.seam_scale;
+
+    cv::Point tl(cvCeil((roi.x + inside.x + 1) * scale), cvCeil((roi.y + inside.y + 1) * scale));
+    cv::Point br(cvFloor((roi.x + inside.br().x - 1) * scale), cvFloor((roi.y + inside.br().y - 1) * scale));
+
+    return br.x > tl.x && br.y > tl.y ? cv::Rect(tl, br) : cv::Rect();
+}
+
+/**
+ * Finds the largest axis aligned rectangle of set pixels in a mask in one pass over
+ * the rows. Each row keeps the height of the set columns above it, and the largest
+ * rectangle under that histogram comes out of a stack of rising heights.
+ * 
+ * @param mask CV_8U mask
+ * 
+ * @return largest rectangle of non zero pixels, empty if there are none
+ */
+cv::Rect largestInscribedRect(const cv::Mat& mask) {
+    std::vector<int> heights(mask.cols + 1, 0);
+    std::vector<int> stack;
+    cv::Rect best;
+
+    for (int y = 0; y < mask.rows; ++y) {
+        const uchar* row = mask.ptr<uchar>(y);
+
+        for (int x = 0; x < mask.cols; ++x) {
+            heights[x] = row[x] ? heights[x] + 1 : 0;
+        }
+
+        // The extra column of height zero empties the stack at the end of the row
+        stack.clear();
+
+        for (int x = 0; x <= mask.cols; ++x) {
+            while ( ! stack.empty() && heights[stack.back()] >= heights[x] ) {
+                int height = heights[stack.back()];
+                stack.pop_back();
+
+                int left = stack.empty() ? 0 : stack.back() + 1;
+
+                if ( (x - left) * height > best.area() ) {
+                    best = cv::Rect(left, y - height + 1, x - left, height);
+                }
+            }
+
+            stack.push_back(x);
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Creates the blender used by the in-memory compositor. Multi-band blending over the
+ * full canvas is the default, a memory ceiling switches to tile-local pyramids.
+ * 
+ * @param settings stitching pipeline settings
+ * 
+ * @return blender to feed warped images to
+ */
+cv::Ptr<cv::detail::Blender> createBlender(const Settings& settings) {
+    if ( settings.blend_memory_mb > 0 ) {
+        return cv::makePtr<TiledMultiBandBlender>(5, settings.blend_memory_mb << 20);
+    }
+
+    return cv::makePtr<cv::detail::MultiBandBlender>(false);
+}
+
+/**
+ * Estimates one gain per block of every image, the same way as
+ * cv::detail::BlocksGainCompensator: images are split into blocks of about the block
+ * size, the gains minimise the intensity differences over all overlapping block
+ * pairs, and each gain map is smoothed twice. Overlap statistics of the block pairs
+ * are independent and gathered in parallel, rows of the pair matrix per thread.
+ * 
+ * @param corners top left corners of the warped images
+ * @param images warped images, CV_8UC3
+ * @param masks warped masks with the value marking valid pixels
+ */
+void BlockGainCompensator::feed(const std::vector<cv::Point>& corners, const std::vector<cv::UMat>& images,
+                                const std::vector<std::pair<cv::UMat, uchar>>& masks) {
+    const double alpha = 0.01;
+    const double beta  = 100;
+
+    struct Block {
+        int image;
+        cv::Rect rect;
+    };
+
+    int num_images = static_cast<int>(images.size());
+
+    std::vector<Block> blocks;
+    std::vector<cv::Size> grids(num_images);
+    std::vector<cv::Mat> image_data(num_images), mask_data(num_images);
+
+    for (int i = 0; i < num_images; ++i) {
+        image_data[i] = images[i].getMat(cv::ACCESS_READ);
+        mask_data[i]  = masks[i].first.getMat(cv::ACCESS_READ);
+
+        cv::Size grid((images[i].cols + block_size - 1) / block_size, (images[i].rows + block_size - 1) / block_size);
+        int width  = (images[i].cols + grid.width - 1) / grid.width;
+        int height = (images[i].rows + grid.height - 1) / grid.height;
+
+        grids[i] = grid;
+
+        for (int by = 0; by < grid.height; ++by) {
+            for (int bx = 0; bx < grid.width; ++bx) {
+                cv::Point tl(bx * width, by * height);
+                cv::Point br(std::min(tl.x + width, images[i].cols), std::min(tl.y + height, images[i].rows));
+                blocks.push_back({i, cv::Rect(tl, br)});
+            }
+        }
+    }
+
+    int num_blocks = static_cast<int>(blocks.size());
+
+    cv::Mat_<int> N(num_blocks, num_blocks, 0);
+    cv::Mat_<double> I(num_blocks, num_blocks, 0.);
+    cv::Mat_<uchar> overlap(num_blocks, num_blocks, uchar(0));
+
+    // Row a writes cells (a, b) and (b, a) for b >= a only, so rows never collide
+    cv::parallel_for_(cv::Range(0, num_blocks), [&](const cv::Range& range) {
+        for (int a = range.start; a < range.end; ++a) {
+            const Block& block1 = blocks[a];
+            cv::Rect rect1 = block1.rect + corners[block1.image];
+
+            for (int b = a; b < num_blocks; ++b) {
+                const Block& block2 = blocks[b];
+                cv::Rect roi = rect1 & (block2.rect + corners[block2.image]);
+
+                if ( roi.empty() ) {
+                    continue;
+                }
+
+                cv::Point offset1 = roi.tl() - corners[block1.image];
+                cv::Point offset2 = roi.tl() - corners[block2.image];
+                uchar valid1 = masks[block1.image].second;
+                uchar valid2 = masks[block2.image].second;
+
+                int count = 0;
+                double sum1 = 0, sum2 = 0;
+
+                for (int y = 0; y < roi.height; ++y) {
+                    const cv::Vec3b* pixel1 = image_data[block1.image].ptr<cv::Vec3b>(offset1.y + y) + offset1.x;
+                    const cv::Vec3b* pixel2 = image_data[block2.image].ptr<cv::Vec3b>(offset2.y + y) + offset2.x;
+                    const uchar* mask1      = mask_data[block1.image].ptr<uchar>(offset1.y + y) + offset1.x;
+                    const uchar* mask2      = mask_data[block2.image].ptr<uchar>(offset2.y + y) + offset2.x;
+
+                    for (int x = 0; x < roi.width; ++x) {
+                        if ( mask1[x] == valid1 && mask2[x] == valid2 ) {
+                            ++count;
+                            sum1 += cv::norm(pixel1[x]);
+                            sum2 += cv::norm(pixel2[x]);
+                        }
+                    }
+                }
+
+                N(a, b) = N(b, a) = std::max(1, count);
+
+                if ( count > 0 ) {
+                    overlap(a, b) = overlap(b, a) = a != b;
+                    I(a, b) = sum1 / N(a, b);
+                    I(b, a) = sum2 / N(a, b);
+                }
+            }
+        }
+    });
+
+    // Blocks without any overlap keep unit gain and stay out of the system
+    std::vector<int> equation(num_blocks, -1);
+    int num_eq = 0;
+
+    for (int a = 0; a < num_blocks; ++a) {
+        if ( cv::countNonZero(overlap.row(a)) > 0 ) {
+            equation[a] = num_eq++;
+        }
+    }
+
+    std::vector<double> gains(num_blocks, 1.);
+
+    if ( num_eq > 0 ) {
+        cv::Mat_<double> A(num_eq, num_eq, 0.);
+        cv::Mat_<double> rhs(num_eq, 1, 0.);
+
+        for (int a = 0; a < num_blocks; ++a) {
+            int ka = equation[a];
+
+            if ( ka < 0 ) {
+                continue;
+            }
+
+            for (int b = 0; b < num_blocks; ++b) {
+                int kb = equation[b];
+
+                if ( kb < 0 ) {
+                    continue;
+                }
+
+                rhs(ka) += beta * N(a, b);
+                A(ka, ka) += beta * N(a, b);
+
+                if ( a != b ) {
+                    A(ka, ka) += 2 * alpha * I(a, b) * I(a, b) * N(a, b);
+                    A(ka, kb) -= 2 * alpha * I(a, b) * I(b, a) * N(a, b);
+                }
+            }
+        }
+
+        // The system is symmetric positive definite, Cholesky halves the cost of LU
+        cv::Mat_<double> solution;
+        cv::solve(A, rhs, solution, cv::DECOMP_CHOLESKY);
+
+        for (int a = 0; a < num_blocks; ++a) {
+            if ( equation[a] >= 0 ) {
+                gains[a] = solution(equation[a]);
+            }
+        }
+    }
+
+    cv::Mat_<float> kernel(1, 3);
+    kernel << 0.25f, 0.5f, 0.25f;
+
+    gain_maps.resize(num_images);
+
+    for (int i = 0, block = 0; i < num_images; ++i) {
+        cv::Mat_<float> gain_map(grids[i]);
+
+        for (int by = 0; by < grids[i].height; ++by) {
+            for (int bx = 0; bx < grids[i].width; ++bx) {
+                gain_map(by, bx) = static_cast<float>(gains[block++]);
+            }
+        }
+
+        cv::sepFilter2D(gain_map, gain_map, CV_32F, kernel, kernel);
+        cv::sepFilter2D(gain_map, gain_map, CV_32F, kernel, kernel);
+        gain_maps[i] = gain_map;
+    }
+}
+
+/**
+ * Applies the block gains to a warped image, stretching the gain map over it.
+ * 
+ * @param index index of the image
+ * @param corner top left corner of the warped image, unused
+ * @param image warped CV_8UC3 image to compensate in place
+ * @param mask warped mask, unused
+ */
+void BlockGainCompensator::apply(int index, cv::Point, cv::InputOutputArray image, cv::InputArray) {
+    Image gains;
+    cv::resize(gain_maps[index], gains, image.size(), 0, 0, cv::INTER_LINEAR);
+
+    Image pixels = image.getMat();
+    applyGains(gains, pixels);
+}
+
+/**
+ * @param gains block gain map of every image
+ */
+void BlockGainCompensator::getMatGains(std::vector<cv::Mat>& gains) {
+    gains = gain_maps;
+}
+
+/**
+ * @param gains block gain map of every image
+ */
+void BlockGainCompensator::setMatGains(std::vector<cv::Mat>& gains) {
+    gain_maps = gains;
+}
+
+/**
+ * Multiplies a warped image by a per pixel gain map.
+ * 
+ * @param gains CV_32F gain map with one or three channels, same size as the image
+ * @param image CV_8UC3 image to compensate in place
+ */
+void applyGains(const cv::Mat& gains, cv::Mat& image) {
+    int step = gains.channels() == 3 ? 1 : 0;
+
+    for (int y = 0; y < image.rows; ++y) {
+        const float* gain = gains.ptr<float>(y);
+        cv::Vec3b* pixel  = image.ptr<cv::Vec3b>(y);
+
+        for (int x = 0; x < image.cols; ++x, gain += gains.channels()) {
+            for (int c = 0; c < 3; ++c) {
+                pixel[x][c] = cv::saturate_cast<uchar>(pixel[x][c] * gain[c * step]);
+            }
+        }
+    }
+}
+
+/**
+ * Scales registered cameras from full resolution to another resolution.
+ * 
+ * @param registration cameras in full resolution pixel units
+ * @param scale scale of the target resolution
+ * @param cameras scaled cameras
+ */
+void scaleCameras(const Registration& registration, double scale, std::vector<cv::detail::CameraParams>& cameras) {
+    cameras = registration.cameras;
+
+    for (cv::detail::CameraParams& camera : cameras) {
+        camera.focal *= scale;
+        camera.ppx   *= scale;
+        camera.ppy   *= scale;
+    }
+}
+
+/**
+ * Computes the compositing scale of a registered set. Images are composited at
+ * full resolution unless a compositing resolution was set.
+ * 
+ * @param images input images
+ * @param registration cameras and indices of the images making up the panorama
+ * @param settings stitching pipeline settings
+ * 
+ * @return compositing scale
+ */
+double compositingScale(const std::vector<Image>& images, const Registration& registration, const Settings& settings) {
+    return settings.compositing_resol > 0
+        ? scaleForResolution(images[registration.indices[0]], settings.compositing_resol)
+        : 1.0;
+}
+
+/**
+ * Computes the scale of the panorama surface, the median focal length of the
+ * registered cameras in full resolution pixel units.
+ * 
+ * @param registration registered cameras
+ * 
+ * @return radius of the panorama surface at full resolution
+ */
+double surfaceScale(const Registration& registration) {
+    std::vector<double> focals;
+
+    for (const cv::detail::CameraParams& camera : registration.cameras) {
+        focals.push_back(camera.focal);
+    }
+
+    std::sort(focals.begin(), focals.end());
+
+    return focals.size() % 2 == 1
+        ? focals[focals.size() / 2]
+        : (focals[focals.size() / 2 - 1] + focals[focals.size() / 2]) * 0.5;
+}
+
+/**
+ * Resizes an input image to compositing resolution. Images within 10% of full
+ * resolution are composited as is, the same as cv::Stitcher.
+ * 
+ * @param image full resolution input image
+ * @param compose_scale compositing scale
+ * @param result image at compositing resolution
+ */
+void composeImage(const Image& image, double compose_scale, Image& result) {
+    if ( std::abs(compose_scale - 1) > 1e-1 ) {
+        cv::resize(image, result, cv::Size(), compose_scale, compose_scale, cv::INTER_LINEAR_EXACT);
+    }
+    else {
+        result = image;
+    }
+}
+
+/**
+ * Computes the size of an input image at compositing resolution without resizing it.
+ * 
+ * @param image full resolution input image
+ * @param compose_scale compositing scale
+ * 
+ * @return size of the image composeImage() returns
+ */
+cv::Size composedSize(const Image& image, double compose_scale) {
+    if ( std::abs(compose_scale - 1) > 1e-1 ) {
+        return cv::Size(cvRound(image.cols * compose_scale), cvRound(image.rows * compose_scale));
+    }
+
+    return image.size();
+}
+
+/**
+ * Computes the footprint of an image on the panorama surface at compositing scale.
+ * 
+ * @param image full resolution input image
+ * @param camera camera scaled to compositing resolution
+ * @param compose_scale compositing scale
+ * @param warper warper at compositing scale
+ * 
+ * @return warped footprint of the image
+ */
+cv::Rect warpedRoi(const Image& image, const cv::detail::CameraParams& camera, double compose_scale,
+                   const cv::Ptr<cv::detail::RotationWarper>& warper) {
+    cv::Size size = composedSize(image, compose_scale);
+
+    cv::Mat K;
+    camera.K().convertTo(K, CV_32F);
+
+    return warper->warpRoi(size, K, camera.R);
+}
+
+/**
+ * Creates a projector for one camera on the panorama surface.
+ * 
+ * @param projection projection of the panorama surface
+ * @param scale radius of the panorama surface
+ * @param camera camera at the resolution of the surface
+ */
+SurfaceProjector::SurfaceProjector(Projection projection, float scale, const cv::detail::CameraParams& camera)
+    : projection(projection), scale(scale) {
+    cv::Mat_<float> K, R;
+    camera.K().convertTo(K, CV_32F);
+    camera.R.convertTo(R, CV_32F);
+
+    if ( projection == Projection::AFFINE ) {
+        // Split into the linear part and translation as cv::detail::AffineWarper does
+        cv::Mat_<float> T = cv::Mat_<float>::zeros(3, 1);
+        T(0) = R(0, 2);
+        T(1) = R(1, 2);
+        R(0, 2) = 0.f;
+        R(1, 2) = 0.f;
+
+        // The linear part is inverted, not transposed, so that similarities with a
+        // scale other than 1 land where cv::detail::AffineWarper::warpRoi() puts them
+        R = R.inv();
+        T = -(R * T);
+
+        for (int i = 0; i < 3; ++i) {
+            t[i] = T(i);
+        }
+    }
+
+    cv::Mat_<float> K_Rinv = K * R.t();
+
+    for (int i = 0; i < 9; ++i) {
+        k_rinv[i] = K_Rinv(i / 3, i % 3);
+    }
+}
+
+/**
+ * Creates a projector from the K * R^-1 matrix of an OpenCV projector.
+ * 
+ * @param projection projection of the panorama surface
+ * @param scale radius of the panorama surface
+ * @param k_rinv row major K * R^-1 matrix
+ */
+SurfaceProjector::SurfaceProjector(Projection projection, float scale, const float k_rinv[9])
+    : projection(projection), scale(scale) {
+    std::copy(k_rinv, k_rinv + 9, this->k_rinv);
+}
+
+/**
+ * Builds the backward maps of any area of the panorama surface onto the camera
+ * image, for use with cv::remap(). Points behind the camera map to (-1, -1).
+ * 
+ * @param area area of the panorama surface
+ * @param xmap x coordinates in the camera image, CV_32F
+ * @param ymap y coordinates in the camera image, CV_32F
+ */
+void SurfaceProjector::buildMaps(cv::Rect area, cv::Mat& xmap, cv::Mat& ymap) const {
+    std::vector<float> sin_u(area.width), cos_u(area.width);
+    columnTables(area.x, area.width, sin_u.data(), cos_u.data());
+
+    xmap.create(area.size(), CV_32F);
+    ymap.create(area.size(), CV_32F);
+
+    for (int v = 0; v < area.height; ++v) {
+        projectRow(rowCoefficients(area.y + v), sin_u.data(), cos_u.data(), area.width,
+                   xmap.ptr<float>(v), ymap.ptr<float>(v));
+    }
+}
+
+/**
+ * Computes the trigonometry of a range of surface columns. For both the spherical
+ * and the cylindrical surface the only per pixel transcendentals are the sine and
+ * cosine of the column angle, which are shared by every row. The plane of an affine
+ * registration has no angles, its columns are stored as x coordinates with unit cosine.
+ * 
+ * @param u0 first column on the panorama surface
+ * @param width number of columns
+ * @param sin_u sine of each column angle
+ * @param cos_u cosine of each column angle
+ */
+void SurfaceProjector::columnTables(int u0, int width, float* sin_u, float* cos_u) const {
+    if ( projection == Projection::AFFINE ) {
+        for (int u = 0; u < width; ++u) {
+            sin_u[u] = (u0 + u) / scale - t[0];
+            cos_u[u] = 1.f;
+        }
+
+        return;
+    }
+
+    for (int u = 0; u < width; ++u) {
+        float angle = (u0 + u) / scale;
+        sin_u[u] = std::sin(angle);
+        cos_u[u] = std::cos(angle);
+    }
+}
+
+/**
+ * Folds the row dependent part of the projection together with K * R^-1, leaving
+ * three fused multiply adds per coordinate for every pixel of the row. The maths are
+ * the same as cv::detail::SphericalProjector, CylindricalProjector and, for affine
+ * registrations, PlaneProjector mapBackward().
+ * 
+ * @param v row on the panorama surface
+ * 
+ * @return coefficients of the row
+ */
+RowCoefficients SurfaceProjector::rowCoefficients(int v) const {
+    RowCoefficients row;
+    float angle = v / scale;
+
+    // Ray = (sin_u * s, y_, cos_u * s), where s scales the column terms
+    float s  = 1.f;
+    float y_ = angle;
+
+    if ( projection == Projection::AFFINE ) {
+        // Ray = (x_, y_, 1 - t[2]) on the plane, x_ comes from the column tables
+        for (int i = 0; i < 3; ++i) {
+            row.a[i] = k_rinv[3 * i + 0];
+            row.c[i] = k_rinv[3 * i + 2] * (1.f - t[2]);
+            row.b[i] = k_rinv[3 * i + 1] * (angle - t[1]);
+        }
+
+        return row;
+    }
+
+    if ( projection == Projection::SPHERICAL ) {
+        s  = std::sin(static_cast<float>(CV_PI) - angle);
+        y_ = std::cos(static_cast<float>(CV_PI) - angle);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        row.a[i] = k_rinv[3 * i + 0] * s;
+        row.c[i] = k_rinv[3 * i + 2] * s;
+        row.b[i] = k_rinv[3 * i + 1] * y_;
+    }
+
+    return row;
+}
+
+/**
+ * Scalar row kernel, also used for the tail of the vectorised kernels.
+ */
+static void projectRowScalar(const RowCoefficients& row, const float* sin_u, const float* cos_u,
+                             int width, float* x, float* y) {
+    for (int u = 0; u < width; ++u) {
+        float X = row.a[0] * sin_u[u] + row.c[0] * cos_u[u] + row.b[0];
+        float Y = row.a[1] * sin_u[u] + row.c[1] * cos_u[u] + row.b[1];
+        float Z = row.a[2] * sin_u[u] + row.c[2] * cos_u[u] + row.b[2];
+
+        x[u] = Z > 0 ? X / Z : -1.f;
+        y[u] = Z > 0 ? Y / Z : -1.f;
+    }
+}
+
+/**
+ * Row kernel using OpenCV universal intrinsics, which map to the baseline SIMD
+ * instruction set of the build, i.e. SSE2 on x86 or NEON on ARM.
+ */
+static void projectRowUniversal(const RowCoefficients& row, const float* sin_u, const float* cos_u,
+                                int width, float* x, float* y) {
+    int u = 0;
+
+#if CV_SIMD || CV_SIMD_SCALABLE
+    const int lanes = cv::VTraits<cv::v_float32>::vlanes();
+
+    cv::v_float32 a0 = cv::vx_setall_f32(row.a[0]), a1 = cv::vx_setall_f32(row.a[1]), a2 = cv::vx_setall_f32(row.a[2]);
+    cv::v_float32 c0 = cv::vx_setall_f32(row.c[0]), c1 = cv::vx_setall_f32(row.c[1]), c2 = cv::vx_setall_f32(row.c[2]);
+    cv::v_float32 b0 = cv::vx_setall_f32(row.b[0]), b1 = cv::vx_setall_f32(row.b[1]), b2 = cv::vx_setall_f32(row.b[2]);
+    cv::v_float32 zero = cv::vx_setzero_f32(), minus_one = cv::vx_setall_f32(-1.f);
+
+    for (; u + lanes <= width; u += lanes) {
+        cv::v_float32 s = cv::vx_load(sin_u + u);
+        cv::v_float32 c = cv::vx_load(cos_u + u);
+
+        cv::v_float32 X = cv::v_muladd(a0, s, cv::v_muladd(c0, c, b0));
+        cv::v_float32 Y = cv::v_muladd(a1, s, cv::v_muladd(c1, c, b1));
+        cv::v_float32 Z = cv::v_muladd(a2, s, cv::v_muladd(c2, c, b2));
+        cv::v_float32 valid = cv::v_gt(Z, zero);
+
+        cv::v_store(x + u, cv::v_select(valid, cv::v_div(X, Z), minus_one));
+        cv::v_store(y + u, cv::v_select(valid, cv::v_div(Y, Z), minus_one));
+    }
+#endif
+
+    projectRowScalar(row, sin_u + u, cos_u + u, width - u, x + u, y + u);
+}
+
+#if PANORAMA_X86_DISPATCH
+/**
+ * AVX2 row kernel, only called when the CPU supports AVX2 and FMA.
+ */
+__attribute__((target("avx2,fma")))
+static void projectRowAVX2(const RowCoefficients& row, const float* sin_u, const float* cos_u,
+                           int width, float* x, float* y) {
+    int u = 0;
+
+    __m256 a0 = _mm256_set1_ps(row.a[0]), a1 = _mm256_set1_ps(row.a[1]), a2 = _mm256_set1_ps(row.a[2]);
+    __m256 c0 = _mm256_set1_ps(row.c[0]), c1 = _mm256_set1_ps(row.c[1]), c2 = _mm256_set1_ps(row.c[2]);
+    __m256 b0 = _mm256_set1_ps(row.b[0]), b1 = _mm256_set1_ps(row.b[1]), b2 = _mm256_set1_ps(row.b[2]);
+    __m256 zero = _mm256_setzero_ps(), minus_one = _mm256_set1_ps(-1.f);
+
+    for (; u + 8 <= width; u += 8) {
+        __m256 s = _mm256_loadu_ps(sin_u + u);
+        __m256 c = _mm256_loadu_ps(cos_u + u);
+
+        __m256 X = _mm256_fmadd_ps(a0, s, _mm256_fmadd_ps(c0, c, b0));
+        __m256 Y = _mm256_fmadd_ps(a1, s, _mm256_fmadd_ps(c1, c, b1));
+        __m256 Z = _mm256_fmadd_ps(a2, s, _mm256_fmadd_ps(c2, c, b2));
+        __m256 valid = _mm256_cmp_ps(Z, zero, _CMP_GT_OQ);
+
+        _mm256_storeu_ps(x + u, _mm256_blendv_ps(minus_one, _mm256_div_ps(X, Z), valid));
+        _mm256_storeu_ps(y + u, _mm256_blendv_ps(minus_one, _mm256_div_ps(Y, Z), valid));
+    }
+
+    projectRowScalar(row, sin_u + u, cos_u + u, width - u, x + u, y + u);
+}
+
+/**
+ * AVX-512 row kernel, only called when the CPU supports AVX-512F.
+ */
+__attribute__((target("avx512f")))
+static void projectRowAVX512(const RowCoefficients& row, const float* sin_u, const float* cos_u,
+                             int width, float* x, float* y) {
+    int u = 0;
+
+    __m512 a0 = _mm512_set1_ps(row.a[0]), a1 = _mm512_set1_ps(row.a[1]), a2 = _mm512_set1_ps(row.a[2]);
+    __m512 c0 = _mm512_set1_ps(row.c[0]), c1 = _mm512_set1_ps(row.c[1]), c2 = _mm512_set1_ps(row.c[2]);
+    __m512 b0 = _mm512_set1_ps(row.b[0]), b1 = _mm512_set1_ps(row.b[1]), b2 = _mm512_set1_ps(row.b[2]);
+    __m512 zero = _mm512_setzero_ps(), minus_one = _mm512_set1_ps(-1.f);
+
+    for (; u + 16 <= width; u += 16) {
+        __m512 s = _mm512_loadu_ps(sin_u + u);
+        __m512 c = _mm512_loadu_ps(cos_u + u);
+
+        __m512 X = _mm512_fmadd_ps(a0, s, _mm512_fmadd_ps(c0, c, b0));
+        __m512 Y = _mm512_fmadd_ps(a1, s, _mm512_fmadd_ps(c1, c, b1));
+        __m512 Z = _mm512_fmadd_ps(a2, s, _mm512_fmadd_ps(c2, c, b2));
+        __mmask16 valid = _mm512_cmp_ps_mask(Z, zero, _CMP_GT_OQ);
+
+        _mm512_storeu_ps(x + u, _mm512_mask_div_ps(minus_one, valid, X, Z));
+        _mm512_storeu_ps(y + u, _mm512_mask_div_ps(minus_one, valid, Y, Z));
+    }
+
+    projectRowScalar(row, sin_u + u, cos_u + u, width - u, x + u, y + u);
+}
+#endif
+
+/**
+ * Picks the widest row kernel the CPU supports. On x86 this is decided at runtime
+ * the first time a row is projected, elsewhere the universal intrinsics kernel
+ * is used.
+ * 
+ * @return row kernel and its name
+ */
+const RowKernel& rowKernel() {
+    static const RowKernel kernel = []() -> RowKernel {
+#if PANORAMA_X86_DISPATCH
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports("avx512f") ) {
+            return {projectRowAVX512, "AVX-512"};
+        }
+        if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ) {
+            return {projectRowAVX2, "AVX2"};
+        }
+#endif
+        return {projectRowUniversal, CV_SIMD || CV_SIMD_SCALABLE ? "universal intrinsics" : "scalar"};
+    }();
+
+    return kernel;
+}
+
+/**
+ * Projects one row of the panorama surface onto the camera image with the widest
+ * kernel the CPU supports. Points behind the camera map to (-1, -1).
+ * 
+ * @param row coefficients of the row
+ * @param sin_u sine of each column angle
+ * @param cos_u cosine of each column angle
+ * @param width number of columns
+ * @param x x coordinates in the camera image
+ * @param y y coordinates in the camera image
+ */
+void projectRow(const RowCoefficients& row, const float* sin_u, const float* cos_u, int width, float* x, float* y) {
+    rowKernel().function(row, sin_u, cos_u, width, x, y);
+}
+
+/**
+ * Portable Hamming kernel, OpenCV's own vectorised popcount.
+ */
+static void hammingRowUniversal(const std::uint64_t* query, const std::uint64_t* train,
+                                int words, int count, int* distances) {
+    for (int t = 0; t < count; ++t, train += words) {
+        distances[t] = cv::hal::normHamming(reinterpret_cast<const uchar*>(query),
+                                            reinterpret_cast<const uchar*>(train), words * 8);
+    }
+}
+
+#if PANORAMA_X86_DISPATCH
+/**
+ * Hamming kernel using the scalar popcnt instruction.
+ */
+__attribute__((target("popcnt")))
+static void hammingRowPopcnt(const std::uint64_t* query, const std::uint64_t* train,
+                             int words, int count, int* distances) {
+    for (int t = 0; t < count; ++t, train += words) {
+        long long distance = 0;
+
+        for (int w = 0; w < words; ++w) {
+            distance += _mm_popcnt_u64(query[w] ^ train[w]);
+        }
+
+        distances[t] = static_cast<int>(distance);
+    }
+}
+
+/**
+ * AVX2 Hamming kernel. AVX2 has no vector popcount, bytes are counted with a nibble
+ * lookup table and summed with SAD. Rows are whole 256 bit chunks.
+ */
+__attribute__((target("avx2")))
+static void hammingRowAVX2(const std::uint64_t* query, const std::uint64_t* train,
+                           int words, int count, int* distances) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low  = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (int t = 0; t < count; ++t, train += words) {
+        __m256i sum = zero;
+
+        for (int w = 0; w < words; w += 4) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + w)),
+                                         _mm256_loadu_si256(reinterpret_cast<const __m256i*>(train + w)));
+            __m256i bits = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                           _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+            sum = _mm256_add_epi64(sum, _mm256_sad_epu8(bits, zero));
+        }
+
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        distances[t] = static_cast<int>(_mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1));
+    }
+}
+
+/**
+ * AVX-512 Hamming kernel with vpopcntq. 256 bit descriptors such as ORB are
+ * compared two train rows at a time, longer ones a 512 bit chunk at a time.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void hammingRowAVX512(const std::uint64_t* query, const std::uint64_t* train,
+                             int words, int count, int* distances) {
+    int t = 0;
+
+    if ( words == 4 ) {
+        __m512i q = _mm512_broadcast_i64x4(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(query)));
+
+        for (; t + 2 <= count; t += 2, train += 8) {
+            __m512i bits = _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(train)));
+            distances[t]     = static_cast<int>(_mm512_mask_reduce_add_epi64(0x0f, bits));
+            distances[t + 1] = static_cast<int>(_mm512_mask_reduce_add_epi64(0xf0, bits));
+        }
+    }
+
+    for (; t < count; ++t, train += words) {
+        __m512i sum = _mm512_setzero_si512();
+
+        for (int w = 0; w < words; w += 8) {
+            __mmask8 mask = words - w >= 8 ? 0xff : static_cast<__mmask8>((1u << (words - w)) - 1);
+            __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, query + w),
+                                         _mm512_maskz_loadu_epi64(mask, train + w));
+            sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+        }
+
+        distances[t] = static_cast<int>(_mm512_reduce_add_epi64(sum));
+    }
+}
+#endif
+
+/**
+ * Picks the widest Hamming kernel the CPU supports, decided at runtime on x86 the
+ * same way as the warp kernels.
+ * 
+ * @return Hamming kernel and its name
+ */
+const HammingKernel& hammingKernel() {
+    static const HammingKernel kernel = []() -> HammingKernel {
+#if PANORAMA_X86_DISPATCH
+        __builtin_cpu_init();
+
+        if ( __builtin_cpu_supports("avx512vpopcntdq") ) {
+            return {hammingRowAVX512, "AVX-512 VPOPCNTDQ"};
+        }
+        if ( __builtin_cpu_supports("avx2") ) {
+            return {hammingRowAVX2, "AVX2"};
+        }
+        if ( __builtin_cpu_supports("popcnt") ) {
+            return {hammingRowPopcnt, "POPCNT"};
+        }
+#endif
+        return {hammingRowUniversal, "universal"};
+    }();
+
+    return kernel;
+}
+
+/**
+ * Maps a coordinate outside the source onto the source like cv::borderInterpolate().
+ * Reflections are periodic, so far coordinates are folded into the first period
+ * with a single modulo instead of letting cv::borderInterpolate() walk there.
+ */
+static inline int borderPixel(int p, int len, int border_mode) {
+    int period = border_mode == cv::BORDER_REFLECT ? 2 * len : border_mode == cv::BORDER_REFLECT_101 ? 2 * len - 2 : 0;
+
+    if ( period > 0 ) {
+        p %= period;
+        p += p < 0 ? period : 0;
+    }
+
+    return cv::borderInterpolate(p, len, border_mode);
+}
+
+/**
+ * Samples one source pixel for the fused warp. Bilinear weights use the same fixed
+ * point grid as cv::remap(), and border handling follows cv::remap() as well.
+ */
+template <int cn>
+static inline void samplePixel(const cv::Mat& src, float fx, float fy, int interp_mode, int border_mode, uchar* out) {
+    // Keep far away points in range of the fixed point maths
+    fx = std::min(std::max(fx, -1e6f), 1e6f);
+    fy = std::min(std::max(fy, -1e6f), 1e6f);
+
+    if ( interp_mode == cv::INTER_NEAREST ) {
+        int ix = cvRound(fx), iy = cvRound(fy);
+
+        if ( 0 <= ix && ix < src.cols && 0 <= iy && iy < src.rows ) {
+            std::copy_n(src.ptr<uchar>(iy) + ix * cn, cn, out);
+        }
+        else if ( border_mode == cv::BORDER_CONSTANT ) {
+            std::fill_n(out, cn, 0);
+        }
+        else {
+            ix = borderPixel(ix, src.cols, border_mode);
+            iy = borderPixel(iy, src.rows, border_mode);
+            std::copy_n(src.ptr<uchar>(iy) + ix * cn, cn, out);
+        }
+
+        return;
+    }
+
+    int X  = cvRound(fx * cv::INTER_TAB_SIZE);
+    int Y  = cvRound(fy * cv::INTER_TAB_SIZE);
+    int ix = X >> cv::INTER_BITS, ax = X & (cv::INTER_TAB_SIZE - 1);
+    int iy = Y >> cv::INTER_BITS, ay = Y & (cv::INTER_TAB_SIZE - 1);
+
+    const int weights[4] = {
+        (cv::INTER_TAB_SIZE - ax) * (cv::INTER_TAB_SIZE - ay), ax * (cv::INTER_TAB_SIZE - ay),
+        (cv::INTER_TAB_SIZE - ax) * ay,                        ax * ay
+    };
+    const uchar* taps[4];
+
+    if ( 0 <= ix && ix + 1 < src.cols && 0 <= iy && iy + 1 < src.rows ) {
+        taps[0] = src.ptr<uchar>(iy) + ix * cn;
+        taps[1] = taps[0] + cn;
+        taps[2] = src.ptr<uchar>(iy + 1) + ix * cn;
+        taps[3] = taps[2] + cn;
+    }
+    else {
+        static const uchar zeros[cn] = {};
+
+        for (int t = 0; t < 4; ++t) {
+            int tx = ix + (t & 1), ty = iy + (t >> 1);
+
+            if ( 0 <= tx && tx < src.cols && 0 <= ty && ty < src.rows ) {
+                taps[t] = src.ptr<uchar>(ty) + tx * cn;
+            }
+            else if ( border_mode == cv::BORDER_CONSTANT ) {
+                taps[t] = zeros;
+            }
+            else {
+                taps[t] = src.ptr<uchar>(borderPixel(ty, src.rows, border_mode))
+                        + borderPixel(tx, src.cols, border_mode) * cn;
+            }
+        }
+    }
+
+    const int half = cv::INTER_TAB_SIZE * cv::INTER_TAB_SIZE / 2;
+
+    for (int c = 0; c < cn; ++c) {
+        int value = taps[0][c] * weights[0] + taps[1][c] * weights[1] + taps[2][c] * weights[2] + taps[3][c] * weights[3];
+        out[c] = static_cast<uchar>((value + half) >> (2 * cv::INTER_BITS));
+    }
+}
+
+/**
+ * Warps an area of the panorama surface from a camera image without building map
+ * matrices. Rows are projected into small per thread buffers and sampled straight
+ * away. Optionally the warped mask is produced in the same pass, matching a nearest
+ * neighbour warp of a full mask, and exposure gains are applied to the sampled row
+ * while it is still in cache. Gains are interpolated the same way as resizing the
+ * gain map to the footprint would.
+ * 
+ * @param src CV_8UC1 or CV_8UC3 camera image
+ * @param projector projector of the camera
+ * @param area area of the panorama surface to warp
+ * @param interp_mode cv::INTER_LINEAR or cv::INTER_NEAREST
+ * @param border_mode cv::BORDER_REFLECT or cv::BORDER_CONSTANT
+ * @param dst warped image, the size of area
+ * @param mask optional warped mask, the size of area
+ * @param gains optional gain map to apply
+ */
+void warpArea(const cv::Mat& src, const SurfaceProjector& projector, cv::Rect area,
+              int interp_mode, int border_mode, cv::Mat& dst, cv::Mat* mask, const GainField* gains) {
+    std::vector<float> sin_u(area.width), cos_u(area.width);
+    projector.columnTables(area.x, area.width, sin_u.data(), cos_u.data());
+
+    dst.create(area.size(), src.type());
+
+    if ( mask ) {
+        mask->create(area.size(), CV_8U);
+    }
+
+    cv::Ptr<GainRows> gain_rows;
+    int gain_cn = 0;
+
+    if ( gains ) {
+        gain_rows = cv::makePtr<GainRows>(*gains, area);
+        gain_cn = gain_rows->channels();
+    }
+
+    cv::parallel_for_(cv::Range(0, area.height), [&](const cv::Range& range) {
+        std::vector<float> x(area.width), y(area.width), gain(area.width * std::max(gain_cn, 1));
+
+        for (int v = range.start; v < range.end; ++v) {
+            projectRow(projector.rowCoefficients(area.y + v), sin_u.data(), cos_u.data(), area.width, x.data(), y.data());
+
+            uchar* out = dst.ptr<uchar>(v);
+
+            for (int u = 0; u < area.width; ++u) {
+                if ( src.channels() == 3 ) {
+                    samplePixel<3>(src, x[u], y[u], interp_mode, border_mode, out + 3 * u);
+                }
+                else {
+                    samplePixel<1>(src, x[u], y[u], interp_mode, border_mode, out + u);
+                }
+            }
+
+            if ( gains ) {
+                gain_rows->row(v, gain.data());
+
+                int cn = src.channels();
+                int gain_step = gain_cn == cn ? 1 : 0;
+
+                for (int u = 0; u < area.width; ++u) {
+                    for (int c = 0; c < cn; ++c) {
+                        out[u * cn + c] = cv::saturate_cast<uchar>(out[u * cn + c] * gain[u * gain_cn + c * gain_step]);
+                    }
+                }
+            }
+
+            if ( mask ) {
+                uchar* m = mask->ptr<uchar>(v);
+
+                for (int u = 0; u < area.width; ++u) {
+                    int ix = cvRound(x[u]), iy = cvRound(y[u]);
+                    m[u] = 0 <= ix && ix < src.cols && 0 <= iy && iy < src.rows ? 255 : 0;
+                }
+            }
+        }
+    });
+}
+
+/**
+ * Sets up the gain map columns of an area and their interpolation weights.
+ * 
+ * @param field gain map and the footprint it covers
+ * @param area area of the panorama surface the gains are wanted for
+ */
+GainRows::GainRows(const GainField& field, cv::Rect area)
+    : field(field), area(area), x0(area.width), x1(area.width), wx(area.width) {
+    float sx = static_cast<float>(field.map.cols) / field.footprint.width;
+
+    for (int u = 0; u < area.width; ++u) {
+        float fx = std::min(std::max((area.x + u - field.footprint.x + 0.5f) * sx - 0.5f, 0.f),
+                            static_cast<float>(field.map.cols - 1));
+        x0[u] = static_cast<int>(fx);
+        x1[u] = std::min(x0[u] + 1, field.map.cols - 1);
+        wx[u] = fx - x0[u];
+    }
+}
+
+/**
+ * Interpolates the gains of one row of the area.
+ * 
+ * @param v row of the area
+ * @param gain channels() gains per pixel of the row
+ */
+void GainRows::row(int v, float* gain) const {
+    int cn = channels();
+
+    float sy = static_cast<float>(field.map.rows) / field.footprint.height;
+    float fy = std::min(std::max((area.y + v - field.footprint.y + 0.5f) * sy - 0.5f, 0.f),
+                        static_cast<float>(field.map.rows - 1));
+    int y0   = static_cast<int>(fy);
+    int y1   = std::min(y0 + 1, field.map.rows - 1);
+    float wy = fy - y0;
+
+    const float* top    = field.map.ptr<float>(y0);
+    const float* bottom = field.map.ptr<float>(y1);
+
+    for (int u = 0; u < area.width; ++u) {
+        for (int c = 0; c < cn; ++c) {
+            int c0 = x0[u] * cn + c, c1 = x1[u] * cn + c;
+            float upper = top[c0] + (top[c1] - top[c0]) * wx[u];
+            float lower = bottom[c0] + (bottom[c1] - bottom[c0]) * wx[u];
+            gain[u * cn + c] = upper + (lower - upper) * wy;
+        }
+    }
+}
+
+/**
+ * Source coordinates of a footprint projected with the row kernels.
+ * 
+ * @param projector projector of the camera
+ * @param area warped footprint of the camera
+ * 
+ * @return coordinates of the footprint rows
+ */
+RowCoordinates projectorCoordinates(const SurfaceProjector& projector, cv::Rect area) {
+    std::vector<float> sin_u(area.width), cos_u(area.width);
+    projector.columnTables(area.x, area.width, sin_u.data(), cos_u.data());
+
+    return [projector, area, sin_u, cos_u](int v, float* x, float* y) {
+        projectRow(projector.rowCoefficients(area.y + v), sin_u.data(), cos_u.data(), area.width, x, y);
+    };
+}
+
+/**
+ * Source coordinates of a footprint read back from fixed point warp tables. The
+ * coordinates land on the cv::remap() interpolation grid, so sampling them matches
+ * remapping with the tables within rounding.
+ * 
+ * @param map CV_16SC2 integer coordinates
+ * @param weights CV_16UC1 interpolation table indices
+ * 
+ * @return coordinates of the footprint rows
+ */
+RowCoordinates tableCoordinates(const cv::Mat& map, const cv::Mat& weights) {
+    return [map, weights](int v, float* x, float* y) {
+        const short* xy     = map.ptr<short>(v);
+        const ushort* index = weights.ptr<ushort>(v);
+
+        for (int u = 0; u < map.cols; ++u) {
+            x[u] = xy[2 * u]     + static_cast<float>(index[u] & (cv::INTER_TAB_SIZE - 1)) / cv::INTER_TAB_SIZE;
+            y[u] = xy[2 * u + 1] + static_cast<float>(index[u] >> cv::INTER_BITS) / cv::INTER_TAB_SIZE;
+        }
+    };
+}
+
+/**
+ * Warps the mask of a camera image, the same as a nearest neighbour warp of a full
+ * mask, without touching the image itself.
+ * 
+ * @param src_size size of the camera image
+ * @param coordinates source coordinates of the footprint rows
+ * @param size size of the footprint
+ * @param mask warped mask
+ */
+void warpMask(cv::Size src_size, const RowCoordinates& coordinates, cv::Size size, cv::Mat& mask) {
+    mask.create(size, CV_8U);
+
+    cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range) {
+        std::vector<float> x(size.width), y(size.width);
+
+        for (int v = range.start; v < range.end; ++v) {
+            coordinates(v, x.data(), y.data());
+
+            uchar* m = mask.ptr<uchar>(v);
+
+            for (int u = 0; u < size.width; ++u) {
+                int ix = cvRound(x[u]), iy = cvRound(y[u]);
+                m[u] = 0 <= ix && ix < src_size.width && 0 <= iy && iy < src_size.height ? 255 : 0;
+            }
+        }
+    });
+}
+
+/**
+ * Fused feather pass over the footprint of an image. Each pixel is sampled from the
+ * camera image, gain compensated, weighted and added to the canvas while still in
+ * registers; pixels without weight are never sampled. Weights are the raw feather
+ * weights and are added to the weight sum alongside, the caller divides the canvas by
+ * it once every image is in. Canvas tiles under weighted pixels must be allocated
+ * beforehand. Rows run in parallel and own their canvas rows.
+ * 
+ * @param src CV_8UC3 camera image at compositing resolution
+ * @param coordinates source coordinates of the footprint rows
+ * @param area warped footprint of the image
+ * @param gains gain map of the image
+ * @param weight CV_32F feather weights, the size of area
+ * @param canvas CV_32FC3 tiles of the canvas
+ * @param weight_sum CV_32F tiles of the weight sum, laid out as the canvas
+ */
+void featherArea(const cv::Mat& src, const RowCoordinates& coordinates, cv::Rect area,
+                 const GainField& gains, const cv::Mat& weight, TileCanvas& canvas, TileCanvas& weight_sum) {
+    GainRows gain_rows(gains, area);
+    int gain_cn   = gain_rows.channels();
+    int gain_step = gain_cn == 3 ? 1 : 0;
+
+    cv::parallel_for_(cv::Range(0, area.height), [&](const cv::Range& range) {
+        std::vector<float> x(area.width), y(area.width), gain(area.width * gain_cn);
+
+        for (int v = range.start; v < range.end; ++v) {
+            coordinates(v, x.data(), y.data());
+            gain_rows.row(v, gain.data());
+
+            const float* w = weight.ptr<float>(v);
+            int row = area.y + v;
+
+            // Row by row through the tiles it crosses
+            for (int x0 = area.x; x0 < area.br().x; ) {
+                int index     = canvas.index(x0, row);
+                cv::Rect tile = canvas.tile(index);
+                int x1        = std::min(area.br().x, tile.br().x);
+
+                if ( canvas.occupied(index) ) {
+                    float* out = canvas.at(index).ptr<float>(row - tile.y) + 3 * (x0 - tile.x);
+                    float* sum = weight_sum.at(index).ptr<float>(row - tile.y) + (x0 - tile.x);
+
+                    for (int u = x0 - area.x; u < x1 - area.x; ++u, out += 3, ++sum) {
+                        if ( w[u] == 0.f ) {
+                            continue;
+                        }
+
+                        uchar pixel[3];
+                        samplePixel<3>(src, x[u], y[u], cv::INTER_LINEAR, cv::BORDER_REFLECT, pixel);
+
+                        for (int c = 0; c < 3; ++c) {
+                            uchar value = cv::saturate_cast<uchar>(pixel[c] * gain[u * gain_cn + c * gain_step]);
+                            out[c] += value * w[u];
+                        }
+
+                        *sum += w[u];
+                    }
+                }
+
+                x0 = x1;
+            }
+        }
+    });
+}
+
+/**
+ * Warps a camera image onto the panorama surface with the fused kernels. Falls back
+ * to the stock OpenCV warper for image types and modes the kernels don't cover.
+ * 
+ * @param src camera image
+ * @param K camera intrinsics
+ * @param R camera rotation
+ * @param interp_mode interpolation mode
+ * @param border_mode border mode
+ * @param dst warped image
+ * 
+ * @return top left corner of the warped image on the panorama surface
+ */
+template <class Base, Projection P>
+cv::Point FastRotationWarper<Base, P>::warp(cv::InputArray src, cv::InputArray K, cv::InputArray R,
+                                            int interp_mode, int border_mode, cv::OutputArray dst) {
+    bool supported = (src.type() == CV_8UC1 || src.type() == CV_8UC3)
+                  && (interp_mode == cv::INTER_LINEAR || interp_mode == cv::INTER_NEAREST)
+                  && (border_mode == cv::BORDER_REFLECT || border_mode == cv::BORDER_CONSTANT);
+
+    if ( ! supported ) {
+        return Base::warp(src, K, R, interp_mode, border_mode, dst);
+    }
+
+    // Same footprint as the stock warper
+    this->projector_.setCameraParams(K, R);
+
+    cv::Point dst_tl, dst_br;
+    this->detectResultRoi(src.size(), dst_tl, dst_br);
+
+    cv::Rect area(dst_tl, cv::Point(dst_br.x + 1, dst_br.y + 1));
+    SurfaceProjector projector(P, this->projector_.scale, this->projector_.k_rinv);
+
+    Image warped;
+    warpArea(src.getMat(), projector, area, interp_mode, border_mode, warped);
+    dst.assign(warped);
+
+    return dst_tl;
+}
+
+/**
+ * Builds float backward maps for a camera image with the vectorised row kernels.
+ * 
+ * @param src_size size of the camera image
+ * @param K camera intrinsics
+ * @param R camera rotation
+ * @param xmap x coordinates in the camera image, CV_32F
+ * @param ymap y coordinates in the camera image, CV_32F
+ * 
+ * @return area of the panorama surface covered by the maps
+ */
+template <class Base, Projection P>
+cv::Rect FastRotationWarper<Base, P>::buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                                                cv::OutputArray xmap, cv::OutputArray ymap) {
+    this->projector_.setCameraParams(K, R);
+
+    cv::Point dst_tl, dst_br;
+    this->detectResultRoi(src_size, dst_tl, dst_br);
+
+    cv::Rect area(dst_tl, cv::Point(dst_br.x + 1, dst_br.y + 1));
+    SurfaceProjector projector(P, this->projector_.scale, this->projector_.k_rinv);
+
+    Image x, y;
+    projector.buildMaps(area, x, y);
+    xmap.assign(x);
+    ymap.assign(y);
+
+    // Same convention as the stock warpers, the maps are one pixel larger
+    return cv::Rect(dst_tl, dst_br);
+}
+
+/**
+ * Creates a fast warper for a panorama surface of the given radius.
+ * 
+ * @param scale radius of the panorama surface
+ * 
+ * @return rotation warper
+ */
+template <class Warper>
+cv::Ptr<cv::detail::RotationWarper> FastWarperCreator<Warper>::create(float scale) const {
+    return cv::makePtr<Warper>(scale);
+}
+
+/**
+ * Creates the warper creator for the configured panorama surface.
+ * 
+ * @param settings stitching pipeline settings
+ * 
+ * @return warper creator
+ */
+cv::Ptr<cv::WarperCreator> createWarper(const Settings& settings) {
+    if ( settings.projection == Projection::AFFINE ) {
+        return cv::makePtr<cv::AffineWarper>();
+    }
+
+    if ( settings.projection == Projection::CYLINDRICAL ) {
+        return cv::makePtr<FastWarperCreator<FastCylindricalWarper>>();
+    }
+
+    return cv::makePtr<FastWarperCreator<FastSphericalWarper>>();
+}
+
+/**
+ * Finds where a run of equal pixels ends. Pixels are compared eight at a time while
+ * the row holds the value of the run, so wide constant areas of a mask cost one
+ * comparison per word.
+ * 
+ * @param row mask row
+ * @param x first column of the run
+ * @param width width of the row
+ * @param value value of the run
+ * 
+ * @return column just past the run
+ */
+static inline int runEnd(const uchar* row, int x, int width, uchar value) {
+    const std::uint64_t fill = value * UINT64_C(0x0101010101010101);
+
+    for (; x + 8 <= width; x += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, row + x, sizeof(word));
+
+        if ( word != fill ) {
+            break;
+        }
+    }
+
+    while ( x < width && row[x] == value ) {
+        ++x;
+    }
+
+    return x;
+}
+
+/**
+ * Encodes a mask as runs. Binary masks give one run per set span, soft edges such as
+ * those of upscaled seams give a short run per value.
+ * 
+ * @param mask CV_8U mask
+ * @param tl top left corner of the mask on the panorama surface
+ */
+RunMask::RunMask(const cv::Mat& mask, cv::Point tl) : bounds(tl, mask.size()) {
+    CV_Assert(mask.type() == CV_8U);
+
+    rows.reserve(mask.rows + 1);
+
+    for (int y = 0; y < mask.rows; ++y) {
+        const uchar* row = mask.ptr<uchar>(y);
+        rows.push_back(static_cast<int>(runs.size() / 3));
+
+        for (int x = runEnd(row, 0, mask.cols, 0); x < mask.cols; ) {
+            int end = runEnd(row, x, mask.cols, row[x]);
+            runs.push_back(x);
+            runs.push_back(end);
+            runs.push_back(row[x]);
+
+            x = runEnd(row, end, mask.cols, 0);
+        }
+    }
+
+    rows.push_back(static_cast<int>(runs.size() / 3));
+}
+
+/**
+ * Checks whether any pixel of an area is set, by looking at the runs only.
+ * 
+ * @param area area of the panorama surface
+ * 
+ * @return true if a run crosses the area
+ */
+bool RunMask::any(cv::Rect area) const {
+    cv::Rect overlap = (area & bounds) - bounds.tl();
+
+    for (int y = overlap.y; y < overlap.br().y; ++y) {
+        for (int r = rows[y]; r < rows[y + 1]; ++r) {
+            if ( runs[3 * r] < overlap.br().x && runs[3 * r + 1] > overlap.x ) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Decodes an area of the mask, pixels outside the bounds being zero.
+ * 
+ * @param area area of the panorama surface
+ * @param mask CV_8U mask of the area
+ */
+void RunMask::decode(cv::Rect area, cv::Mat& mask) const {
+    mask.create(area.size(), CV_8U);
+    mask.setTo(cv::Scalar::all(0));
+
+    cv::Rect overlap = area & bounds;
+    int offset_x = bounds.x - area.x;
+
+    for (int y = overlap.y; y < overlap.br().y; ++y) {
+        uchar* row = mask.ptr<uchar>(y - area.y);
+        int v = y - bounds.y;
+
+        for (int r = rows[v]; r < rows[v + 1]; ++r) {
+            int begin = std::max(runs[3 * r] + offset_x, 0);
+            int end   = std::min(runs[3 * r + 1] + offset_x, area.width);
+
+            if ( begin < end ) {
+                std::memset(row + begin, runs[3 * r + 2], end - begin);
+            }
+        }
+    }
+}
+
+/**
+ * Appends a run to the runs of a row, extending the last run when it ends where the
+ * new one begins with the same value.
+ * 
+ * @param row begin, end and value of the runs so far
+ * @param begin first column of the run
+ * @param end column after the run
+ * @param value value of the run
+ */
+static inline void appendRun(std::vector<int>& row, int begin, int end, int value) {
+    std::size_t n = row.size();
+
+    if ( n >= 3 && row[n - 2] == begin && row[n - 1] == value ) {
+        row[n - 2] = end;
+    }
+    else {
+        row.insert(row.end(), {begin, end, value});
+    }
+}
+
+/**
+ * Intersects two masks run by run, with the same values as cv::bitwise_and() of the
+ * decoded masks. Only the runs are walked, never the pixels.
+ * 
+ * @param other mask to intersect with, anywhere on the panorama surface
+ * 
+ * @return intersection within the bounds of this mask
+ */
+RunMask RunMask::bitwiseAnd(const RunMask& other) const {
+    std::vector<std::vector<int>> row_runs(bounds.height);
+    int offset_x = other.bounds.x - bounds.x;
+
+    cv::parallel_for_(cv::Range(0, bounds.height), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            int v = y + bounds.y - other.bounds.y;
+
+            if ( v < 0 || v >= other.bounds.height ) {
+                continue;
+            }
+
+            int a = rows[y], b = other.rows[v];
+
+            while ( a < rows[y + 1] && b < other.rows[v + 1] ) {
+                int end_a = runs[3 * a + 1];
+                int end_b = other.runs[3 * b + 1] + offset_x;
+                int begin = std::max(runs[3 * a], other.runs[3 * b] + offset_x);
+                int end   = std::min(end_a, end_b);
+                int value = runs[3 * a + 2] & other.runs[3 * b + 2];
+
+                if ( begin < end && value != 0 ) {
+                    appendRun(row_runs[y], begin, end, value);
+                }
+
+                if ( end_a < end_b ) {
+                    ++a;
+                }
+                else {
+                    ++b;
+                }
+            }
+        }
+    });
+
+    RunMask result;
+    result.bounds = bounds;
+    result.assign(row_runs);
+
+    return result;
+}
+
+/**
+ * Dilates the mask run by run, the same as cv::dilate() with the default 3x3
+ * rectangle: every run of a row and its two neighbours grows by a pixel on each
+ * side, and where runs overlap the largest value wins. The bounds don't grow.
+ * 
+ * @return dilated mask
+ */
+RunMask RunMask::dilate() const {
+    std::vector<std::vector<int>> row_runs(bounds.height);
+
+    cv::parallel_for_(cv::Range(0, bounds.height), [&](const cv::Range& range) {
+        std::vector<int> spans, cuts;
+
+        for (int y = range.start; y < range.end; ++y) {
+            spans.clear();
+            cuts.clear();
+
+            for (int v = std::max(y - 1, 0); v <= std::min(y + 1, bounds.height - 1); ++v) {
+                for (int r = rows[v]; r < rows[v + 1]; ++r) {
+                    int begin = std::max(runs[3 * r] - 1, 0);
+                    int end   = std::min(runs[3 * r + 1] + 1, bounds.width);
+
+                    spans.insert(spans.end(), {begin, end, runs[3 * r + 2]});
+                    cuts.insert(cuts.end(), {begin, end});
+                }
+            }
+
+            std::sort(cuts.begin(), cuts.end());
+            cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+
+            // Largest value over each piece between two consecutive run ends
+            for (std::size_t c = 0; c + 1 < cuts.size(); ++c) {
+                int value = 0;
+
+                for (std::size_t s = 0; s < spans.size(); s += 3) {
+                    if ( spans[s] <= cuts[c] && cuts[c + 1] <= spans[s + 1] ) {
+                        value = std::max(value, spans[s + 2]);
+                    }
+                }
+
+                if ( value != 0 ) {
+                    appendRun(row_runs[y], cuts[c], cuts[c + 1], value);
+                }
+            }
+        }
+    });
+
+    RunMask result;
+    result.bounds = bounds;
+    result.assign(row_runs);
+
+    return result;
+}
+
+/**
+ * Replaces the runs by the given runs of every row.
+ * 
+ * @param row_runs begin, end and value of the runs of every row within the bounds
+ */
+void RunMask::assign(const std::vector<std::vector<int>>& row_runs) {
+    rows.assign(1, 0);
+    runs.clear();
+
+    for (const std::vector<int>& row : row_runs) {
+        runs.insert(runs.end(), row.begin(), row.end());
+        rows.push_back(static_cast<int>(runs.size() / 3));
+    }
+}
+
+/**
+ * Writes the runs to an open structure of a file storage.
+ * 
+ * @param fs file storage
+ */
+void RunMask::write(cv::FileStorage& fs) const {
+    fs << "roi" << bounds << "rows" << rows << "runs" << runs;
+}
+
+/**
+ * Reads runs written by write(). Runs that don't fit their bounds leave the mask empty,
+ * so that a corrupt or edited file can never make decode() write out of bounds.
+ * 
+ * @param node structure holding the runs
+ */
+void RunMask::read(const cv::FileNode& node) {
+    node["roi"] >> bounds;
+    node["rows"] >> rows;
+    node["runs"] >> runs;
+
+    bool valid = bounds.width >= 0 && bounds.height >= 0
+              && static_cast<int>(rows.size()) == bounds.height + 1
+              && runs.size() % 3 == 0
+              && rows.front() == 0
+              && static_cast<std::size_t>(rows.back()) * 3 == runs.size();
+
+    // Row offsets must not go back, and every run must lie within the row
+    for (std::size_t y = 1; valid && y < rows.size(); ++y) {
+        valid = rows[y - 1] <= rows[y];
+    }
+
+    for (std::size_t r = 0; valid && r < runs.size(); r += 3) {
+        valid = 0 <= runs[r] && runs[r] < runs[r + 1] && runs[r + 1] <= bounds.width
+             && 0 < runs[r + 2] && runs[r + 2] <= UCHAR_MAX;
+    }
+
+    if ( ! valid ) {
+        *this = RunMask();
+    }
+}
+
+/**
+ * Creates a tile-local multi-band blender.
+ * 
+ * @param num_bands number of pyramid bands, as for cv::detail::MultiBandBlender
+ * @param memory_limit rough ceiling in bytes for the pyramids of one tile
+ */
+TiledMultiBandBlender::TiledMultiBandBlender(int num_bands, std::size_t memory_limit)
+    : num_bands(num_bands), memory_limit(memory_limit) {}
+
+/**
+ * Removes the spill file if the blender is dropped before blending.
+ */
+TiledMultiBandBlender::~TiledMultiBandBlender() {
+    closeSpill();
+}
+
+/**
+ * Prepares the blender for the given panorama area. Unlike the stock blenders,
+ * nothing is allocated until blend() is called.
+ * 
+ * @param dst_roi area of the panorama
+ */
+void TiledMultiBandBlender::prepare(cv::Rect dst_roi) {
+    dst_roi_ = dst_roi;
+    inputs.clear();
+    closeSpill();
+}
+
+/**
+ * Spills a warped image to disk and keeps its mask for blending. Images are fed as
+ * CV_16SC3 with values in [0, 255], so they are written as CV_8UC3 without loss, and
+ * masks are kept as runs.
+ * 
+ * @param img warped image
+ * @param mask warped mask, cut along the seam
+ * @param tl top left corner of the image on the panorama
+ */
+void TiledMultiBandBlender::feed(cv::InputArray img, cv::InputArray mask, cv::Point tl) {
+    if ( ! spill.is_open() ) {
+        spill_name = cv::tempfile(".raw");
+        spill.open(spill_name, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    }
+
+    Image image;
+    img.getMat().convertTo(image, CV_8U);
+
+    Input input;
+    input.roi = cv::Rect(tl, image.size());
+    spill.seekp(0, std::ios::end);
+    input.offset = static_cast<std::uint64_t>(spill.tellp());
+    input.mask = RunMask(mask.getMat(), tl);
+
+    for (int y = 0; y < image.rows; ++y) {
+        spill.write(reinterpret_cast<const char*>(image.ptr(y)), image.cols * image.elemSize());
+    }
+
+    if ( ! spill ) {
+        CV_Error(cv::Error::StsError, "Could not write the blender spill file " + spill_name);
+    }
+
+    inputs.push_back(input);
+}
+
+/**
+ * Blends the stored images tile by tile. Each tile is blended with a guard band wide
+ * enough for the pyramid to see the same neighbourhood it would over the full canvas.
+ * Tiles and guards are aligned to the coarsest pyramid level relative to the canvas,
+ * so sampling grids line up and results match the full-canvas blend within rounding.
+ * Tile size follows from the memory ceiling, in multiples of 16 so the result can go
+ * to a tiled BigTIFF as is. Only the tiles an image reaches are blended and stored,
+ * the others stay unallocated.
+ * 
+ * @param dst blended panorama, CV_8UC3 tiles
+ * @param dst_mask mask of the blended panorama, CV_8U tiles
+ */
+void TiledMultiBandBlender::blend(TileCanvas& dst, TileCanvas& dst_mask) {
+    // Laplacian and weight pyramids of the tile, plus those of the image being fed
+    const std::size_t bytes_per_pixel = 32;
+
+    int align = std::max(16, 1 << num_bands);
+    int guard = 4 << num_bands;
+    int side  = static_cast<int>(std::sqrt(static_cast<double>(memory_limit) / bytes_per_pixel));
+    int tile  = std::max(8 * align, (side - 2 * guard) / align * align);
+
+    TileMap tiles(dst_roi_, tile, guard);
+
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        tiles.cover(static_cast<int>(i), inputs[i].mask);
+    }
+
+    int num_tiles = tiles.columns() * tiles.rows();
+
+    dst      = TileCanvas(dst_roi_, tile, CV_8UC3);
+    dst_mask = TileCanvas(dst_roi_, tile, CV_8U);
+
+    for (int index = 0; index < num_tiles; ++index) {
+        if ( ! tiles.occupied(index) ) {
+            continue;
+        }
+
+        cv::Rect area    = tiles.tile(index);
+        cv::Rect guarded = tiles.guarded(index);
+
+        cv::detail::MultiBandBlender blender(false, num_bands);
+        blender.prepare(guarded);
+
+        for (int i : tiles.images(index)) {
+            const Input& input = inputs[i];
+            cv::Rect overlap = guarded & input.roi;
+
+            Image image, image_s, mask;
+            readArea(input, overlap, image);
+            image.convertTo(image_s, CV_16S);
+            input.mask.decode(overlap, mask);
+            blender.feed(image_s, mask, overlap.tl());
+        }
+
+        Image tile_result, tile_mask;
+        blender.blend(tile_result, tile_mask);
+
+        cv::Rect inner = area - guarded.tl();
+        cv::Rect local(cv::Point(), inner.size());
+        tile_result(inner).convertTo(dst.allocate(index)(local), CV_8U);
+        tile_mask(inner).copyTo(dst_mask.allocate(index)(local));
+    }
+
+    inputs.clear();
+    closeSpill();
+}
+
+/**
+ * Blends the stored images into one dense canvas, as cv::detail::Blender hands its
+ * result back. The panorama is blended into tiles and only made dense here.
+ * 
+ * @param dst blended panorama, CV_8UC3
+ * @param dst_mask mask of the blended panorama
+ */
+void TiledMultiBandBlender::blend(cv::InputOutputArray dst, cv::InputOutputArray dst_mask) {
+    TileCanvas result, result_mask;
+    blend(result, result_mask);
+
+    Image dense, dense_mask;
+    result.copyTo(dense);
+    result_mask.copyTo(dense_mask);
+
+    dst.assign(dense);
+    dst_mask.assign(dense_mask);
+}
+
+/**
+ * Reads an area of a spilled image back from disk, one row at a time.
+ * 
+ * @param input spilled image
+ * @param area area on the panorama, inside the image
+ * @param image pixels of the area, CV_8UC3
+ */
+void TiledMultiBandBlender::readArea(const Input& input, cv::Rect area, Image& image) {
+    image.create(area.size(), CV_8UC3);
+
+    for (int y = 0; y < area.height; ++y) {
+        std::uint64_t row = static_cast<std::uint64_t>(area.y - input.roi.y + y) * input.roi.width;
+        spill.seekg(static_cast<std::streamoff>(input.offset + (row + area.x - input.roi.x) * 3));
+        spill.read(reinterpret_cast<char*>(image.ptr(y)), area.width * 3);
+    }
+
+    if ( ! spill ) {
+        CV_Error(cv::Error::StsError, "Could not read the blender spill file " + spill_name);
+    }
+}
+
+/**
+ * Closes and removes the spill file, if one was opened.
+ */
+void TiledMultiBandBlender::closeSpill() {
+    if ( spill.is_open() ) {
+        spill.close();
+        std::remove(spill_name.c_str());
+    }
+
+    spill.clear();
+}
+
+/**
+ * Opens a tiled BigTIFF for writing. The header is written straight away, tiles
+ * follow as they are composited and the directory is appended on close().
+ * 
+ * @param filename output file
+ * @param size size of the whole image
+ * @param tile_size width and height of the tiles, a multiple of 16
+ * 
+ * @return true if the file could be opened
+ */
+bool TiledTiffWriter::open(const Filename& filename, cv::Size size, int tile_size) {
+    this->size      = size;
+    this->tile_size = tile_size;
+
+    int tiles = ((size.width + tile_size - 1) / tile_size) * ((size.height + tile_size - 1) / tile_size);
+    offsets.assign(tiles, 0);
+    byte_counts.assign(tiles, 0);
+    empty_tile = -1;
+
+    file.open(filename, std::ios::binary | std::ios::trunc);
+
+    // Little endian BigTIFF header, the directory offset is patched on close()
+    writeBytes(0x4949, 2);
+    writeBytes(43, 2);
+    writeBytes(8, 2);
+    writeBytes(0, 2);
+    writeBytes(0, 8);
+
+    return file.good();
+}
+
+/**
+ * Writes one tile of the image. Tiles may be written in any order.
+ * 
+ * @param index tile index, in row major order
+ * @param tile CV_8UC3 tile of tile_size x tile_size pixels
+ * 
+ * @return true if the tile was written
+ */
+bool TiledTiffWriter::write(int index, const Image& tile) {
+    Image rgb;
+    cv::cvtColor(tile, rgb, cv::COLOR_BGR2RGB);
+
+    offsets[index]     = static_cast<std::uint64_t>(file.tellp());
+    byte_counts[index] = rgb.total() * rgb.elemSize();
+
+    for (int y = 0; y < rgb.rows; ++y) {
+        file.write(reinterpret_cast<const char*>(rgb.ptr(y)), rgb.cols * rgb.elemSize());
+    }
+
+    return file.good();
+}
+
+/**
+ * Writes a tile no image reaches. The first empty tile is stored once, every later
+ * one points at the same bytes.
+ * 
+ * @param index tile index, in row major order
+ * 
+ * @return true if the tile was written
+ */
+bool TiledTiffWriter::writeEmpty(int index) {
+    if ( empty_tile < 0 ) {
+        empty_tile = index;
+        return write(index, Image(tile_size, tile_size, CV_8UC3, cv::Scalar::all(0)));
+    }
+
+    offsets[index]     = offsets[empty_tile];
+    byte_counts[index] = byte_counts[empty_tile];
+
+    return file.good();
+}
+
+/**
+ * Writes the image directory and closes the file.
+ * 
+ * @return true if the file is complete
+ */
+bool TiledTiffWriter::close() {
+    const std::uint16_t SHORT = 3, LONG = 4, LONG8 = 16;
+
+    std::uint64_t count = offsets.size();
+
+    // Arrays which don't fit inline are written ahead of the directory
+    std::uint64_t offsets_at = 0, byte_counts_at = 0;
+
+    if ( count > 1 ) {
+        offsets_at = static_cast<std::uint64_t>(file.tellp());
+        for (std::uint64_t offset : offsets) writeBytes(offset, 8);
+
+        byte_counts_at = static_cast<std::uint64_t>(file.tellp());
+        for (std::uint64_t byte_count : byte_counts) writeBytes(byte_count, 8);
+    }
+
+    std::uint64_t directory_at = static_cast<std::uint64_t>(file.tellp());
+
+    // Entries must be sorted by tag
+    writeBytes(11, 8);
+    writeEntry(256, LONG,  1, size.width);
+    writeEntry(257, LONG,  1, size.height);
+    writeEntry(258, SHORT, 3, 8 | 8 << 16 | std::uint64_t(8) << 32);
+    writeEntry(259, SHORT, 1, 1);
+    writeEntry(262, SHORT, 1, 2);
+    writeEntry(277, SHORT, 1, 3);
+    writeEntry(284, SHORT, 1, 1);
+    writeEntry(322, LONG,  1, tile_size);
+    writeEntry(323, LONG,  1, tile_size);
+    writeEntry(324, LONG8, count, count > 1 ? offsets_at : offsets[0]);
+    writeEntry(325, LONG8, count, count > 1 ? byte_counts_at : byte_counts[0]);
+    writeBytes(0, 8);
+
+    file.seekp(8);
+    writeBytes(directory_at, 8);
+    file.close();
+
+    return ! file.fail();
+}
+
+/**
+ * Writes one BigTIFF directory entry. Values of up to 8 bytes are stored inline.
+ * 
+ * @param tag TIFF tag
+ * @param type TIFF field type
+ * @param count number of values
+ * @param value inline value or offset of the values
+ */
+void TiledTiffWriter::writeEntry(std::uint16_t tag, std::uint16_t type, std::uint64_t count, std::uint64_t value) {
+    writeBytes(tag, 2);
+    writeBytes(type, 2);
+    writeBytes(count, 8);
+    writeBytes(value, 8);
+}
+
+/**
+ * Writes an integer in little endian byte order.
+ * 
+ * @param value integer to write
+ * @param bytes number of bytes to write
+ */
+void TiledTiffWriter::writeBytes(std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        file.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+/**
+ * Computes the scale at which an image has roughly the given number of
+ * megapixels. Images are never upscaled.
+ * 
+ * @param image reference image of the set
+ * @param megapixels target resolution in megapixels
+ * 
+ * @return scale factor in (0, 1]
+ */
+double scaleForResolution(const Image& image, double megapixels) {
+    return std::min(1.0, std::sqrt(megapixels * 1e6 / image.size().area()));
+}
+
+/**
+ * Prompts the user if they wish to save the panorama. Dialog appears only
+ * after the preview is marked to be closed. If they user chooses to save
+ * the image, they can browse to the subdirectory using the GUI and name
+ * the file whatever they want. Files ending in .tif or .tiff are written
+ * as a tiled BigTIFF straight from the tiles, other formats are written
+ * from a dense copy.
+ * 
+ * @param panorama Panorama tiles to be saved
+ */
+void promptSaveImage(const TileCanvas& panorama) {
     auto save =
         pfd::message(
             "Save image?",
@@ -388,8 +8643,27 @@ void promptSaveImage(const Image& image) {
         auto dir = pfd::save_file("Choose save location", "./").result();
 
         if ( dir != "" ) {
-            cv::imwrite(dir, image);
-            showNotification("Panorama saved at: " + dir);
+            Filename extension = dir.substr(std::min(dir.size(), dir.find_last_of('.')));
+            std::transform(extension.begin(), extension.end(), extension.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+            bool saved = false;
+
+            if ( extension == ".tif" || extension == ".tiff" ) {
+                saved = panorama.writeTiff(dir);
+            }
+            else {
+                Image image;
+                panorama.copyTo(image);
+                saved = cv::imwrite(dir, image);
+            }
+
+            if ( saved ) {
+                showNotification("Panorama saved at: " + dir);
+            }
+            else {
+                showError("Panorama could not be saved at: " + dir);
+            }
         }
     }
 }